@@ -0,0 +1,719 @@
+/*
+ * Copyright (c) 2024, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * First come, first served locking of boards, shared between cdba-server
+ * processes. The lockfile of each board holds its current owner followed by
+ * the queue of waiters, and is only flock()ed while it's being updated.
+ * Waiters are woken through inotify as the file changes, and through a pidfd
+ * as the process ahead of them in the queue exits. Entries of processes that
+ * are gone are dropped, so locks held by crashed sessions are reclaimed.
+ */
+#define _GNU_SOURCE
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "board_lock.h"
+#include "watch.h"
+
+#define BOARD_LOCK_USER_LEN	64
+
+/*
+ * Shared by the users of cdba-server, through its group, but not accessible to
+ * others, who could otherwise tamper with the queues. Overridden by "lock_dir"
+ * of the configuration.
+ */
+#define BOARD_LOCK_DIR		"/run/cdba"
+
+static const char *board_lock_dir = BOARD_LOCK_DIR;
+static bool board_lock_dir_checked;
+
+/* Interval at which a contended lockfile is retried, without blocking */
+#define BOARD_LOCK_RETRY_MS	10
+
+struct board_lock_entry {
+	unsigned int id;
+	pid_t pid;
+	unsigned long long starttime;
+	time_t since;
+	char user[BOARD_LOCK_USER_LEN];
+};
+
+/*
+ * Parsed lockfile. When non-empty, the first entry is the owner of the board,
+ * the remaining entries are waiting in order of arrival. @avg_hold is the
+ * moving average of the time the board is held, in seconds.
+ */
+struct board_lock_queue {
+	struct board_lock_entry *entries;
+	size_t count;
+	long avg_hold;
+};
+
+struct board_lock {
+	char path[PATH_MAX];
+	char *board;
+	char *username;
+
+	int fd;
+	int inotify_fd;
+
+	/* process ahead in the queue, if not ourselves */
+	int pidfd;
+	pid_t pidfd_pid;
+
+	unsigned int id;
+	bool held;
+	int position;
+	int eta;
+	char owner[BOARD_LOCK_USER_LEN + 64];
+
+	void (*cb)(struct board_lock *, void *);
+	void *data;
+
+	/* lockfile updates of requests are retried, rather than waited for */
+	bool async;
+	bool releasing;
+	struct watch_timer *retry_timer;
+};
+
+/* Start time of the process, telling it apart from a later one reusing the pid */
+static unsigned long long board_lock_starttime(pid_t pid)
+{
+	unsigned long long starttime = 0;
+	char path[64];
+	char buf[1024];
+	char *p;
+	ssize_t n;
+	int fd;
+	int i;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+
+	/* skip past the command, which might contain spaces */
+	p = strrchr(buf, ')');
+	if (!p)
+		return 0;
+
+	/* processes that have exited are gone, even if not yet reaped */
+	if (p[1] == ' ' && (p[2] == 'Z' || p[2] == 'X'))
+		return 0;
+
+	/* starttime is the 22nd field, the 20th after the command */
+	for (i = 0; i < 20 && p; i++)
+		p = strchr(p + 1, ' ');
+
+	if (p)
+		sscanf(p, "%llu", &starttime);
+
+	return starttime;
+}
+
+static unsigned long long board_lock_self_starttime(void)
+{
+	static unsigned long long starttime;
+
+	if (!starttime)
+		starttime = board_lock_starttime(getpid());
+
+	return starttime;
+}
+
+static bool board_lock_entry_alive(struct board_lock_entry *entry)
+{
+	unsigned long long starttime = board_lock_starttime(entry->pid);
+
+	return starttime && starttime == entry->starttime;
+}
+
+static bool board_lock_entry_is(struct board_lock_entry *entry,
+				struct board_lock *lock)
+{
+	return entry->pid == getpid() && entry->id == lock->id &&
+	       entry->starttime == board_lock_self_starttime();
+}
+
+static void board_lock_append(struct board_lock_queue *q,
+			      struct board_lock_entry *entry)
+{
+	struct board_lock_entry *entries;
+
+	entries = realloc(q->entries, (q->count + 1) * sizeof(*entries));
+	if (!entries)
+		err(1, "failed to allocate lock queue");
+
+	entries[q->count++] = *entry;
+	q->entries = entries;
+}
+
+static void board_lock_remove(struct board_lock_queue *q, size_t idx)
+{
+	memmove(&q->entries[idx], &q->entries[idx + 1],
+		(q->count - idx - 1) * sizeof(*q->entries));
+	q->count--;
+}
+
+static void board_lock_read(struct board_lock *lock, struct board_lock_queue *q)
+{
+	struct board_lock_entry entry;
+	char line[256];
+	FILE *fp;
+	int fd;
+
+	q->entries = NULL;
+	q->count = 0;
+	q->avg_hold = 0;
+
+	fd = dup(lock->fd);
+	if (fd < 0)
+		err(1, "failed to read lockfile %s", lock->path);
+
+	fp = fdopen(fd, "r");
+	if (!fp)
+		err(1, "failed to read lockfile %s", lock->path);
+
+	rewind(fp);
+
+	/* Lockfiles of older servers are empty, unknown lines are ignored */
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "avg %ld", &q->avg_hold) == 1)
+			continue;
+
+		memset(&entry, 0, sizeof(entry));
+		if (sscanf(line, "entry %u %d %llu %ld %63s", &entry.id, &entry.pid,
+			   &entry.starttime, &entry.since, entry.user) == 5)
+			board_lock_append(q, &entry);
+	}
+
+	fclose(fp);
+}
+
+static void board_lock_write(struct board_lock *lock, struct board_lock_queue *q)
+{
+	struct board_lock_entry *entry;
+	size_t i;
+
+	if (ftruncate(lock->fd, 0) < 0)
+		err(1, "failed to update lockfile %s", lock->path);
+
+	lseek(lock->fd, 0, SEEK_SET);
+
+	dprintf(lock->fd, "avg %ld\n", q->avg_hold);
+	for (i = 0; i < q->count; i++) {
+		entry = &q->entries[i];
+		dprintf(lock->fd, "entry %u %d %llu %ld %s\n", entry->id, entry->pid,
+			entry->starttime, (long)entry->since, entry->user);
+	}
+}
+
+enum board_lock_op {
+	BOARD_LOCK_ENQUEUE,
+	BOARD_LOCK_UPDATE,
+	BOARD_LOCK_RELEASE,
+};
+
+static void board_lock_watch(struct board_lock *lock, pid_t pid);
+static void board_lock_retry(void *data);
+
+/*
+ * Apply @op to the queue in the lockfile and refresh the state of @lock.
+ * Returns true if the state of @lock changed. If the lockfile is being updated
+ * by someone else, updates of asynchronous requests are retried from a timer.
+ */
+static bool board_lock_update(struct board_lock *lock, enum board_lock_op op)
+{
+	struct board_lock_entry self = {};
+	struct board_lock_queue q;
+	struct board_lock_entry *entry;
+	bool changed = false;
+	char since[32];
+	long remaining;
+	long elapsed;
+	int position;
+	time_t now;
+	pid_t ahead;
+	bool held;
+	void **ctx;
+	size_t i;
+	int eta;
+
+	now = time(NULL);
+
+	if (flock(lock->fd, lock->async ? LOCK_EX | LOCK_NB : LOCK_EX) < 0) {
+		if (errno != EWOULDBLOCK)
+			err(1, "failed to lock %s", lock->path);
+
+		if (!lock->retry_timer) {
+			/* released locks outlive the session that added them */
+			ctx = watch_set_context(op == BOARD_LOCK_RELEASE ? NULL : watch_get_context());
+			lock->retry_timer = watch_timer_add(BOARD_LOCK_RETRY_MS,
+							    board_lock_retry, lock);
+			watch_set_context(ctx);
+		}
+
+		return false;
+	}
+
+	board_lock_read(lock, &q);
+
+	for (i = 0; i < q.count; i++) {
+		entry = &q.entries[i];
+		if (board_lock_entry_alive(entry))
+			continue;
+
+		if (!i) {
+			syslog(LOG_WARNING, "reclaiming stale lock of board %s held by %s (pid %d)",
+			       lock->board, entry->user, entry->pid);
+			/* restart the clock for the next owner */
+			if (q.count > 1)
+				q.entries[1].since = now;
+		}
+
+		board_lock_remove(&q, i--);
+		changed = true;
+	}
+
+	for (i = 0; i < q.count; i++) {
+		if (board_lock_entry_is(&q.entries[i], lock))
+			break;
+	}
+
+	if (op == BOARD_LOCK_RELEASE) {
+		if (i == 0 && q.count) {
+			elapsed = now - q.entries[0].since;
+			q.avg_hold = q.avg_hold ? (q.avg_hold * 3 + elapsed) / 4 : elapsed;
+
+			if (q.count > 1)
+				q.entries[1].since = now;
+		}
+
+		if (i < q.count) {
+			board_lock_remove(&q, i);
+			changed = true;
+		}
+	} else if (i == q.count) {
+		/* enqueue, or reinstate an entry dropped by someone else */
+		self.id = lock->id;
+		self.pid = getpid();
+		self.starttime = board_lock_self_starttime();
+		self.since = now;
+		snprintf(self.user, sizeof(self.user), "%s", lock->username);
+
+		board_lock_append(&q, &self);
+		changed = true;
+	}
+
+	if (changed)
+		board_lock_write(lock, &q);
+
+	flock(lock->fd, LOCK_UN);
+
+	if (op == BOARD_LOCK_RELEASE) {
+		free(q.entries);
+		return false;
+	}
+
+	held = i == 0;
+	position = i;
+
+	eta = -1;
+	if (q.avg_hold && !held) {
+		remaining = q.avg_hold - (now - q.entries[0].since);
+		eta = (remaining > 0 ? remaining : 0) + (position - 1) * q.avg_hold;
+	}
+
+	if (!held) {
+		strftime(since, sizeof(since), "%H:%M:%S", localtime(&q.entries[0].since));
+		snprintf(lock->owner, sizeof(lock->owner), "%s (pid %d) since %s",
+			 q.entries[0].user, q.entries[0].pid, since);
+	}
+
+	ahead = held ? 0 : q.entries[i - 1].pid;
+	board_lock_watch(lock, ahead == getpid() ? 0 : ahead);
+
+	changed = held != lock->held || position != lock->position;
+
+	lock->held = held;
+	lock->position = position;
+	lock->eta = eta;
+
+	free(q.entries);
+
+	return changed;
+}
+
+static void board_lock_event(struct board_lock *lock)
+{
+	char buf[4096];
+
+	/* drain the inotify events, the queue is reread in full */
+	while (read(lock->inotify_fd, buf, sizeof(buf)) > 0)
+		;
+
+	if (board_lock_update(lock, BOARD_LOCK_UPDATE) && lock->cb)
+		lock->cb(lock, lock->data);
+}
+
+static void board_lock_free(struct board_lock *lock);
+
+static void board_lock_retry(void *data)
+{
+	struct board_lock *lock = data;
+
+	lock->retry_timer = NULL;
+
+	if (!lock->releasing) {
+		board_lock_event(lock);
+		return;
+	}
+
+	board_lock_update(lock, BOARD_LOCK_RELEASE);
+	if (!lock->retry_timer)
+		board_lock_free(lock);
+}
+
+static int board_lock_inotify(int fd, void *data)
+{
+	board_lock_event(data);
+
+	return 0;
+}
+
+static int board_lock_pidfd(int fd, void *data)
+{
+	board_lock_event(data);
+
+	return 0;
+}
+
+/*
+ * Watch for the exit of the process ahead of us in the queue, as it won't
+ * update the lockfile if it crashes.
+ */
+static void board_lock_watch(struct board_lock *lock, pid_t pid)
+{
+	if (pid == lock->pidfd_pid)
+		return;
+
+	if (lock->pidfd >= 0) {
+		if (lock->cb)
+			watch_del_readfd(lock->pidfd);
+		close(lock->pidfd);
+		lock->pidfd = -1;
+	}
+
+	lock->pidfd_pid = pid;
+	if (!pid)
+		return;
+
+	lock->pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (lock->pidfd < 0) {
+		warn("unable to monitor pid %d holding %s", pid, lock->board);
+		return;
+	}
+
+	if (lock->cb)
+		watch_add_readfd(lock->pidfd, board_lock_pidfd, lock);
+}
+
+/**
+ * board_lock_set_dir() - select the directory holding the lockfiles
+ * @dir:	directory, created as needed
+ */
+void board_lock_set_dir(const char *dir)
+{
+	board_lock_dir = strdup(dir);
+	board_lock_dir_checked = false;
+}
+
+/*
+ * Checked until found usable, rather than once, so that sessions succeed
+ * as soon as the directory is fixed up.
+ */
+static int board_lock_check_dir(void)
+{
+	struct stat sb;
+
+	if (board_lock_dir_checked)
+		return 0;
+
+	if (mkdir(board_lock_dir, 0770) < 0 && errno != EEXIST) {
+		warn("failed to create %s", board_lock_dir);
+		return -1;
+	}
+
+	if (lstat(board_lock_dir, &sb) < 0) {
+		warn("failed to access %s", board_lock_dir);
+		return -1;
+	}
+
+	if (!S_ISDIR(sb.st_mode) || (sb.st_mode & S_IRWXO) ||
+	    (sb.st_uid && sb.st_uid != geteuid())) {
+		warnx("%s must be a directory owned by root or the server's user, not accessible to others",
+		      board_lock_dir);
+		errno = EPERM;
+		return -1;
+	}
+
+	board_lock_dir_checked = true;
+
+	return 0;
+}
+
+static struct board_lock *board_lock_open(const char *board, const char *username)
+{
+	static unsigned int lock_id;
+	struct board_lock *lock;
+	int saved_errno;
+	int n;
+
+	if (board_lock_check_dir() < 0)
+		return NULL;
+
+	lock = calloc(1, sizeof(*lock));
+	if (!lock)
+		err(1, "failed to allocate board lock");
+
+	lock->fd = -1;
+	lock->inotify_fd = -1;
+
+	n = snprintf(lock->path, sizeof(lock->path), "%s/%s.lock", board_lock_dir, board);
+	if (n >= (int)sizeof(lock->path)) {
+		warnx("failed to build lockfile path");
+		errno = ENAMETOOLONG;
+		goto err_free;
+	}
+
+	lock->fd = open(lock->path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0660);
+	if (lock->fd < 0) {
+		warn("failed to open lockfile %s", lock->path);
+		goto err_free;
+	}
+
+	/* the lockfile is shared with the group, regardless of umask */
+	fchmod(lock->fd, 0660);
+
+	lock->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (lock->inotify_fd < 0) {
+		warn("failed to create inotify instance");
+		goto err_free;
+	}
+
+	if (inotify_add_watch(lock->inotify_fd, lock->path, IN_MODIFY) < 0) {
+		warn("failed to watch lockfile %s", lock->path);
+		goto err_free;
+	}
+
+	lock->board = strdup(board);
+	lock->username = strdup(username ? : "nobody");
+	lock->id = lock_id++;
+	lock->pidfd = -1;
+
+	return lock;
+
+err_free:
+	saved_errno = errno;
+	if (lock->inotify_fd >= 0)
+		close(lock->inotify_fd);
+	if (lock->fd >= 0)
+		close(lock->fd);
+	free(lock);
+	errno = saved_errno;
+
+	return NULL;
+}
+
+/**
+ * board_lock_request() - queue up for the lock of a board
+ * @board:	name of the board
+ * @username:	user requesting the board, reported to other waiters
+ * @cb:		invoked as the lock is taken, or the position in queue changes
+ * @data:	context of @cb
+ *
+ * Return: the lock request, check board_lock_held() before waiting for @cb,
+ * or NULL if the lockfile can't be opened
+ */
+struct board_lock *board_lock_request(const char *board, const char *username,
+				      void (*cb)(struct board_lock *, void *),
+				      void *data)
+{
+	struct board_lock *lock;
+
+	lock = board_lock_open(board, username);
+	if (!lock)
+		return NULL;
+
+	lock->cb = cb;
+	lock->data = data;
+	lock->async = true;
+
+	watch_add_readfd(lock->inotify_fd, board_lock_inotify, lock);
+
+	board_lock_update(lock, BOARD_LOCK_ENQUEUE);
+
+	return lock;
+}
+
+/**
+ * board_lock_wait() - take the lock of a board, waiting in queue as needed
+ * @board:	name of the board
+ * @username:	user requesting the board, reported to other waiters
+ *
+ * Return: the lock, held, or NULL if the lockfile can't be opened
+ */
+struct board_lock *board_lock_wait(const char *board, const char *username)
+{
+	struct board_lock *lock;
+	struct pollfd pfd[2];
+	int position = 0;
+
+	lock = board_lock_open(board, username);
+	if (!lock)
+		return NULL;
+
+	board_lock_update(lock, BOARD_LOCK_ENQUEUE);
+
+	while (!lock->held) {
+		if (lock->position != position) {
+			warnx("board is in use by %s, position %d in queue",
+			      lock->owner, lock->position);
+			position = lock->position;
+		}
+
+		pfd[0].fd = lock->inotify_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = lock->pidfd;
+		pfd[1].events = POLLIN;
+
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+			err(1, "failed to wait for lock");
+
+		board_lock_event(lock);
+	}
+
+	return lock;
+}
+
+/**
+ * board_lock_try() - take the lock of a board, if it's free
+ * @board:	name of the board
+ * @username:	user requesting the board
+ *
+ * Return: the lock, held, or NULL if the board is in use, others are queued
+ * or the lockfile can't be opened
+ */
+struct board_lock *board_lock_try(const char *board, const char *username)
+{
+	struct board_lock *lock;
+
+	lock = board_lock_open(board, username);
+	if (!lock)
+		return NULL;
+
+	board_lock_update(lock, BOARD_LOCK_ENQUEUE);
+	if (!lock->held) {
+		board_lock_release(lock);
+		return NULL;
+	}
+
+	return lock;
+}
+
+bool board_lock_held(struct board_lock *lock)
+{
+	return lock->held;
+}
+
+/**
+ * board_lock_position() - position in queue
+ * @lock:	lock request
+ *
+ * Return: number of sessions ahead, including the owner, 0 if held
+ */
+int board_lock_position(struct board_lock *lock)
+{
+	return lock->position;
+}
+
+/**
+ * board_lock_eta() - estimated time until the lock is taken
+ * @lock:	lock request
+ *
+ * The estimate is based on the average time the board has been held.
+ *
+ * Return: estimated wait in seconds, or -1 if unknown
+ */
+int board_lock_eta(struct board_lock *lock)
+{
+	return lock->eta;
+}
+
+/**
+ * board_lock_owner() - describe the current owner of the board
+ * @lock:	lock request, not held
+ *
+ * Return: user, pid and time at which the board was taken
+ */
+const char *board_lock_owner(struct board_lock *lock)
+{
+	return lock->owner;
+}
+
+/**
+ * board_lock_release() - release the lock, or leave the queue
+ * @lock:	lock request, freed
+ */
+void board_lock_release(struct board_lock *lock)
+{
+	if (lock->retry_timer) {
+		watch_timer_cancel(lock->retry_timer);
+		lock->retry_timer = NULL;
+	}
+
+	if (lock->cb)
+		watch_del_readfd(lock->inotify_fd);
+	board_lock_watch(lock, 0);
+
+	lock->cb = NULL;
+	lock->releasing = true;
+
+	/* freed by board_lock_retry() if the lockfile is contended */
+	board_lock_update(lock, BOARD_LOCK_RELEASE);
+	if (!lock->retry_timer)
+		board_lock_free(lock);
+}
+
+static void board_lock_free(struct board_lock *lock)
+{
+	close(lock->inotify_fd);
+	close(lock->fd);
+
+	free(lock->username);
+	free(lock->board);
+	free(lock);
+}
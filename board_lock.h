@@ -0,0 +1,21 @@
+#ifndef __BOARD_LOCK_H__
+#define __BOARD_LOCK_H__
+
+#include <stdbool.h>
+
+struct board_lock;
+
+void board_lock_set_dir(const char *dir);
+
+struct board_lock *board_lock_request(const char *board, const char *username,
+				      void (*cb)(struct board_lock *, void *),
+				      void *data);
+struct board_lock *board_lock_wait(const char *board, const char *username);
+struct board_lock *board_lock_try(const char *board, const char *username);
+bool board_lock_held(struct board_lock *lock);
+int board_lock_position(struct board_lock *lock);
+int board_lock_eta(struct board_lock *lock);
+const char *board_lock_owner(struct board_lock *lock);
+void board_lock_release(struct board_lock *lock);
+
+#endif
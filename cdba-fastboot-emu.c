@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2024, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Fastboot device emulator, serving fastboot over TCP framing on a unix socket,
+ * for boards configured with "fastboot_emulator", or on a TCP port, standing in
+ * for a board configured with "fastboot_tcp". Responses are delayed by the
+ * given latency, downloads are received at the given bandwidth and flashing
+ * takes as long as writing the image at the given write rate, to provide
+ * reproducible conditions for measuring the download and flash paths of cdba.
+ *
+ * The emulated device is in fastboot, and accepts one connection at a time,
+ * until told to boot, continue or reboot. It then exits, or enters fastboot
+ * again after the delay given by -r.
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sha256.h"
+#include "sparse.h"
+
+#define EMU_MESSAGE_SIZE	(1024 * 1024)
+#define EMU_COMMAND_SIZE	64
+
+static unsigned int latency;
+static unsigned long bandwidth;
+static unsigned long max_download_size = 512 * 1024 * 1024;
+static unsigned long write_rate;
+static int reenter_delay = -1;
+
+static char *message;
+static size_t downloaded;
+static char download_head[64];
+static char slot[8] = "a";
+
+static uint64_t emu_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void emu_sleep_us(uint64_t us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000,
+	};
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static int emu_recv(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = recv(fd, p, len, 0);
+		if (n <= 0)
+			return -1;
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Receive the length of the next packet */
+static int emu_recv_header(int fd, uint64_t *size)
+{
+	uint64_t header;
+
+	if (emu_recv(fd, &header, sizeof(header)) < 0)
+		return -1;
+
+	*size = be64toh(header);
+
+	return 0;
+}
+
+static int emu_respond(int fd, const char *fmt, ...)
+{
+	char buf[8 + EMU_COMMAND_SIZE + 1];
+	uint64_t header;
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf + 8, sizeof(buf) - 8, fmt, ap);
+	va_end(ap);
+
+	if (len > EMU_COMMAND_SIZE)
+		len = EMU_COMMAND_SIZE;
+
+	header = htobe64(len);
+	memcpy(buf, &header, sizeof(header));
+
+	if (latency)
+		emu_sleep_us(latency * 1000ULL);
+
+	if (send(fd, buf, 8 + len, MSG_NOSIGNAL) != 8 + len) {
+		warn("failed to send response");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Receive the data phase of a download, at no more than the set bandwidth */
+static int emu_download(int fd, size_t size)
+{
+	struct sha256_ctx ctx;
+	uint8_t digest[32];
+	char hex[65];
+	uint64_t start;
+	uint64_t due;
+	uint64_t now;
+	size_t received = 0;
+	uint64_t left = 0;
+	ssize_t n;
+	int i;
+
+	sha256_init(&ctx);
+	start = emu_now_us();
+
+	while (received < size) {
+		if (!left) {
+			if (emu_recv_header(fd, &left) < 0) {
+				warnx("connection lost after %zu of %zu bytes",
+				      received, size);
+				return -1;
+			}
+
+			if (received + left > size) {
+				warnx("download overrun after %zu of %zu bytes",
+				      received, size);
+				return -1;
+			}
+
+			continue;
+		}
+
+		n = recv(fd, message, left < EMU_MESSAGE_SIZE ? left : EMU_MESSAGE_SIZE, 0);
+		if (n <= 0) {
+			warnx("connection lost after %zu of %zu bytes", received, size);
+			return -1;
+		}
+
+		sha256_update(&ctx, message, n);
+		if (received < sizeof(download_head))
+			memcpy(download_head + received, message,
+			       (size_t)n < sizeof(download_head) - received ?
+			       (size_t)n : sizeof(download_head) - received);
+		received += n;
+		left -= n;
+
+		if (bandwidth) {
+			due = start + received * 1000000ULL / bandwidth;
+			now = emu_now_us();
+			if (due > now)
+				emu_sleep_us(due - now);
+		}
+	}
+
+	sha256_final(&ctx, digest);
+	for (i = 0; i < 32; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+
+	fprintf(stderr, "received %zu bytes in %.2fs, sha256 %s\n", size,
+		(double)(emu_now_us() - start) / 1e6, hex);
+
+	return 0;
+}
+
+static int emu_getvar(int fd, const char *var)
+{
+	if (!strcmp(var, "max-download-size"))
+		return emu_respond(fd, "OKAY0x%08lx", max_download_size);
+	else if (!strcmp(var, "product"))
+		return emu_respond(fd, "OKAYcdba-fastboot-emu");
+	else if (!strcmp(var, "serialno"))
+		return emu_respond(fd, "OKAYemulator");
+	else if (!strcmp(var, "current-slot"))
+		return emu_respond(fd, "OKAY%s", slot);
+	else if (!strcmp(var, "version"))
+		return emu_respond(fd, "OKAY0.4");
+
+	return emu_respond(fd, "FAILunknown variable");
+}
+
+/* Describe what flashing the downloaded image writes */
+static int emu_flash_info(int fd, const char *partition)
+{
+	struct sparse_header header;
+	struct chunk_header chunk;
+	const char *p = download_head + sizeof(header);
+	uint32_t skip = 0;
+
+	memcpy(&header, download_head, sizeof(header));
+	if (downloaded < sizeof(download_head) ||
+	    le32toh(header.magic) != SPARSE_HEADER_MAGIC)
+		return emu_respond(fd, "INFOwriting '%s'", partition);
+
+	memcpy(&chunk, p, sizeof(chunk));
+	if (le16toh(chunk.chunk_type) == CHUNK_TYPE_DONT_CARE) {
+		skip = le32toh(chunk.chunk_sz);
+		memcpy(&chunk, p + sizeof(chunk), sizeof(chunk));
+	}
+
+	return emu_respond(fd, "INFOwriting '%s' blocks %u-%u of %u", partition,
+			   skip, skip + le32toh(chunk.chunk_sz),
+			   le32toh(header.total_blks));
+}
+
+/**
+ * emu_command() - handle one fastboot command
+ * @fd:		connection to the host
+ * @cmd:	NUL-terminated command
+ *
+ * Return: 1 if the device leaves fastboot, 0 to continue, -1 on failure
+ */
+static int emu_command(int fd, const char *cmd)
+{
+	unsigned long size;
+
+	fprintf(stderr, "%s\n", cmd);
+
+	if (!strncmp(cmd, "getvar:", 7)) {
+		return emu_getvar(fd, cmd + 7);
+	} else if (!strncmp(cmd, "download:", 9)) {
+		size = strtoul(cmd + 9, NULL, 16);
+		if (!size || size > max_download_size)
+			return emu_respond(fd, "FAILdata too large");
+
+		downloaded = 0;
+		if (emu_respond(fd, "DATA%08lx", size) < 0 ||
+		    emu_download(fd, size) < 0)
+			return -1;
+
+		downloaded = size;
+		return emu_respond(fd, "OKAY");
+	} else if (!strcmp(cmd, "boot")) {
+		if (!downloaded)
+			return emu_respond(fd, "FAILno image downloaded");
+
+		return emu_respond(fd, "OKAY") ? -1 : 1;
+	} else if (!strcmp(cmd, "continue") || !strcmp(cmd, "reboot")) {
+		return emu_respond(fd, "OKAY") ? -1 : 1;
+	} else if (!strncmp(cmd, "flash:", 6)) {
+		if (!downloaded)
+			return emu_respond(fd, "FAILno image downloaded");
+
+		if (emu_flash_info(fd, cmd + 6) < 0)
+			return -1;
+
+		if (write_rate)
+			emu_sleep_us(downloaded * 1000000ULL / write_rate);
+
+		return emu_respond(fd, "OKAY");
+	} else if (!strncmp(cmd, "erase:", 6)) {
+		return emu_respond(fd, "OKAY");
+	} else if (!strncmp(cmd, "set_active:", 11)) {
+		snprintf(slot, sizeof(slot), "%s", cmd + 11);
+		return emu_respond(fd, "OKAY");
+	}
+
+	return emu_respond(fd, "FAILunknown command");
+}
+
+/* Serve one host, return true if the device left fastboot */
+static bool emu_serve(int fd)
+{
+	char handshake[4];
+	uint64_t size;
+	int ret;
+
+	if (emu_recv(fd, handshake, sizeof(handshake)) < 0 ||
+	    memcmp(handshake, "FB", 2)) {
+		warnx("invalid handshake");
+		return false;
+	}
+
+	if (send(fd, "FB01", 4, MSG_NOSIGNAL) != 4)
+		return false;
+
+	for (;;) {
+		if (emu_recv_header(fd, &size) < 0)
+			return false;
+
+		if (size > EMU_COMMAND_SIZE) {
+			warnx("command of %llu bytes too long", (unsigned long long)size);
+			return false;
+		}
+
+		if (emu_recv(fd, message, size) < 0)
+			return false;
+
+		message[size] = '\0';
+
+		ret = emu_command(fd, message);
+		if (ret)
+			return ret > 0;
+	}
+}
+
+static int emu_listen_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "socket path too long: %s", path);
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		err(1, "failed to create socket");
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		err(1, "failed to bind %s", path);
+
+	return fd;
+}
+
+static int emu_listen_tcp(const char *port)
+{
+	struct addrinfo hints = {0};
+	struct addrinfo *addr;
+	int one = 1;
+	int ret;
+	int fd;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	ret = getaddrinfo(NULL, port, &hints, &addr);
+	if (ret)
+		errx(1, "failed to resolve port %s: %s", port, gai_strerror(ret));
+
+	fd = socket(addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, addr->ai_protocol);
+	if (fd < 0)
+		err(1, "failed to create socket");
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, addr->ai_addr, addr->ai_addrlen) < 0)
+		err(1, "failed to bind port %s", port);
+
+	freeaddrinfo(addr);
+
+	return fd;
+}
+
+static int emu_listen(const char *address, bool tcp)
+{
+	int fd;
+
+	fd = tcp ? emu_listen_tcp(address) : emu_listen_unix(address);
+
+	if (listen(fd, 1) < 0)
+		err(1, "failed to listen on %s", address);
+
+	return fd;
+}
+
+static void usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s [-l <latency-ms>] [-b <bytes-per-second>] "
+			"[-m <max-download-size>] [-r <reenter-delay-ms>] "
+			"[-w <write-bytes-per-second>] <socket> | -t <port>\n",
+			__progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *address;
+	bool tcp = false;
+	bool left;
+	int one = 1;
+	int listen_fd;
+	int fd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:l:m:r:tw:")) != -1) {
+		switch (opt) {
+		case 'b':
+			bandwidth = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			latency = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			max_download_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			reenter_delay = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			tcp = true;
+			break;
+		case 'w':
+			write_rate = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+
+	address = argv[optind];
+
+	message = malloc(EMU_MESSAGE_SIZE);
+	if (!message)
+		err(1, "failed to allocate message buffer");
+
+	for (;;) {
+		listen_fd = emu_listen(address, tcp);
+
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0)
+			err(1, "failed to accept connection");
+
+		/* Only one host at a time gets to see the device */
+		close(listen_fd);
+		if (!tcp)
+			unlink(address);
+
+		if (tcp)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		left = emu_serve(fd);
+		close(fd);
+
+		if (!left)
+			continue;
+
+		downloaded = 0;
+
+		fprintf(stderr, "left fastboot\n");
+		if (reenter_delay < 0)
+			break;
+
+		emu_sleep_us(reenter_delay * 1000ULL);
+	}
+
+	return 0;
+}
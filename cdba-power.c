@@ -20,6 +20,15 @@ void cdba_send_buf(int type, size_t len, const void *buf)
 	/* ignore console messages */
 }
 
+bool cdba_output_throttle(int fd, int (*cb)(int, void*), void *data)
+{
+	return false;
+}
+
+void cdba_boot_phase(int phase, uint64_t value)
+{
+}
+
 static void usage(const char *name)
 {
 	fprintf(stderr, "Usage: %s <board> on|off\n", name);
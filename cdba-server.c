@@ -4,239 +4,1885 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
+#define _GNU_SOURCE /* for accept4 and memfd_create */
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include <pwd.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <time.h>
 
+#include "board_lock.h"
 #include "cdba-server.h"
 #include "circ_buf.h"
 #include "device.h"
 #include "device_parser.h"
 #include "fastboot.h"
+#include "image_cache.h"
 #include "list.h"
 #include "watch.h"
 
-static const char *username;
+#define CDBA_SOCKET_PATH	"/run/cdba/cdba-server.sock"
+
+/*
+ * A session represents one client, either the one connected to stdin/stdout
+ * or, in daemon mode, one of the clients whose file descriptors are handed
+ * over by a shim connecting to the daemon's socket.
+ *
+ * @self refers to the session itself and is used as the watch context of
+ * the session, until a device is selected; from then on the device's session
+ * slot is used, so that the device's watches follow it to its next session.
+ */
+struct session {
+	void *self;
+
+	int in_fd;
+	int out_fd;
+	int err_fd;
+	int shim_fd;
+
+	char *username;
+
+	struct circ_buf recv_buf;
+	bool in_watched;
+
+	/* Maximum payload of a frame, extended if the client negotiates the protocol */
+	size_t max_frame;
+
+	/* Diagnostics not yet written to @err_fd */
+	struct circ_buf err_buf;
+
+	char *output_buf;
+	size_t output_head;
+	size_t output_tail;
+	size_t output_size;
+
+	struct list_head throttled_readers;
+
+	/* Protocol version negotiated with the client, 0 if not negotiated */
+	uint8_t version;
+
+	/* Boot phase timing, in microseconds on CLOCK_MONOTONIC */
+	uint64_t start_time;
+	uint64_t download_start;
+	uint64_t download_size;
+	bool console_seen;
+
+	struct device *device;
+
+	/* board selection, while waiting in the queues of the candidate boards */
+	char *select_param;
+	size_t select_len;
+	struct device **select_devices;
+	struct board_lock **select_locks;
+	size_t select_count;
+	int select_position;
+
+	/* upload of clients not announcing its size, staged once complete */
+	int fastboot_payload_fd;
+	size_t fastboot_size;
+
+	bool fastboot_streaming;
+	int fastboot_stream_status;
+	struct image_cache_writer *fastboot_cache_writer;
+
+	bool fastboot_present;
+	struct fastboot_stage *fastboot_stage;
+	bool fastboot_continue;
+
+	bool fastboot_flashing;
+	int fastboot_flash_status;
+
+	bool quit;
+	struct watch_timer *close_timer;
+};
+
+/*
+ * Boot image received before fastboot showed up, mapped from the image cache
+ * or from a memfd. Its download starts as soon as fastboot does, fed from
+ * @sent while the remainder is still arriving.
+ */
+struct fastboot_stage {
+	char *data;
+	size_t size;
+	size_t len;
+	size_t sent;
+	bool started;
+	bool done;
+};
+
+/* Staged data is passed to fastboot in pieces of this size */
+#define FASTBOOT_STAGE_CHUNK	(256 * 1024)
+
+static bool daemon_mode;
+
+static void session_resume(struct session *session);
+static void session_quit(struct session *session);
+static void fastboot_stage_start(struct session *session);
+static void msg_fastboot_continue(struct session *session);
+static void session_plan_run(struct session *session, const void *data, size_t len);
+
+static struct session *session_current(void)
+{
+	void **ctx = watch_get_context();
+
+	return ctx ? *ctx : NULL;
+}
+
+static int session_err_drain(int fd, void *data)
+{
+	struct session *session = data;
+	struct circ_buf *circ = &session->err_buf;
+	ssize_t n;
+
+	n = write(fd, circ_data(circ), CIRC_AVAIL(circ));
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	/* Diagnostics are dropped if the client's stderr is gone */
+	circ_consume(circ, n < 0 ? CIRC_AVAIL(circ) : (size_t)n);
+
+	if (!CIRC_AVAIL(circ))
+		watch_del_writefd(fd);
+
+	return 0;
+}
+
+/*
+ * Report a diagnostic message to the client of the current session, queued if
+ * the client isn't reading them and dropped once CIRC_BUF_SIZE are pending.
+ */
+static void session_warnx(const char *fmt, ...)
+{
+	struct session *session = session_current();
+	struct circ_buf *circ;
+	char line[1024];
+	va_list ap;
+	size_t len;
+	ssize_t n = 0;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+	if (ret < 0)
+		return;
+
+	len = MIN((size_t)ret, sizeof(line) - 2);
+	line[len++] = '\n';
 
-struct device *selected_device;
+	if (!session) {
+		fwrite(line, 1, len, stderr);
+		return;
+	}
+
+	circ = &session->err_buf;
+	if (!CIRC_AVAIL(circ)) {
+		n = write(session->err_fd, line, len);
+		if (n < 0 && errno != EAGAIN)
+			return;
+		else if (n < 0)
+			n = 0;
+
+		if ((size_t)n == len)
+			return;
+
+		watch_add_writefd(session->err_fd, session_err_drain, session);
+	}
+
+	circ_reserve(circ, CIRC_BUF_SIZE);
+	if (len - n > CIRC_SPACE(circ))
+		return;
+
+	memcpy(circ->buf + (circ->head & (circ->size - 1)), line + n, len - n);
+	circ->head += len - n;
+}
+
+static uint64_t session_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 static void fastboot_opened(struct fastboot *fb, void *data)
 {
+	struct session *session = session_current();
 	const uint8_t one = 1;
 
-	warnx("fastboot connection opened");
+	session_warnx("fastboot connection opened");
+	cdba_boot_phase(BOOT_PHASE_FASTBOOT_ENUMERATED, 0);
 
 	cdba_send_buf(MSG_FASTBOOT_PRESENT, 1, &one);
+
+	if (session) {
+		session->fastboot_present = true;
+		fastboot_stage_start(session);
+
+		/* As planned by the client */
+		if (session->fastboot_continue) {
+			session->fastboot_continue = false;
+			msg_fastboot_continue(session);
+		}
+	}
 }
 
 static void fastboot_info(struct fastboot *fb, const void *buf, size_t len)
 {
-	fprintf(stderr, "%s\n", (const char *)buf);
+	session_warnx("%s", (const char *)buf);
 }
 
 static void fastboot_disconnect(void *data)
 {
+	struct session *session = session_current();
 	const uint8_t zero = 0;
 
+	if (session)
+		session->fastboot_present = false;
+
 	cdba_send_buf(MSG_FASTBOOT_PRESENT, 1, &zero);
 }
 
+static void fastboot_writable(struct fastboot *fb, void *data)
+{
+	struct session *session = session_current();
+
+	if (session)
+		session_resume(session);
+}
+
 static struct fastboot_ops fastboot_ops = {
 	.opened = fastboot_opened,
 	.disconnect = fastboot_disconnect,
 	.info = fastboot_info,
+	.writable = fastboot_writable,
 };
 
-static void msg_select_board(const void *param)
+static void select_board_done(struct session *session, size_t idx)
 {
-	selected_device = device_open(param, username);
-	if (!selected_device) {
-		fprintf(stderr, "failed to open %s\n", (const char *)param);
-		watch_quit();
+	struct msg_select_board_proto proto;
+	const char *board = session->select_param;
+	struct device *device = session->select_devices[idx];
+	size_t len = session->select_len;
+	size_t board_len = strlen(board);
+	size_t plan_offset;
+	char *reply;
+	size_t i;
+	void **ctx;
+
+	syslog(LOG_INFO, "user %s opening board %s", session->username, device->board);
+
+	/* Leave the queues of the other boards of the pool */
+	for (i = 0; i < session->select_count; i++) {
+		if (i != idx)
+			board_lock_release(session->select_locks[i]);
 	}
 
-	device_fastboot_open(selected_device, &fastboot_ops);
+	session->device = device;
+	device->session = session;
 
-	cdba_send(MSG_SELECT_BOARD);
-}
+	ctx = watch_set_context(&device->session);
+	cdba_boot_phase(BOOT_PHASE_LOCK_ACQUIRED, 0);
+	device_acquire(device, session->select_locks[idx]);
+	cdba_boot_phase(BOOT_PHASE_CONTROLLER_OPENED, 0);
+	device_fastboot_open(device, &fastboot_ops);
+
+	/* Older clients only send the board name */
+	if (len - board_len - 1 < sizeof(proto)) {
+		if (strcmp(board, device->board))
+			session_warnx("selected board %s", device->board);
+
+		cdba_send(MSG_SELECT_BOARD);
+	} else {
+		memcpy(&proto, board + board_len + 1, sizeof(proto));
+
+		proto.version = session->version;
+		proto.max_frame = MIN(proto.max_frame, CDBA_MAX_FRAME_SIZE);
+		proto.max_frame = MAX(proto.max_frame, UINT16_MAX);
+
+		session->max_frame = proto.max_frame;
+
+		/* followed by the name of the board, which might be from a pool */
+		board_len = strlen(device->board) + 1;
+		reply = malloc(sizeof(proto) + board_len);
+		if (!reply)
+			err(1, "failed to allocate board selection");
+
+		memcpy(reply, &proto, sizeof(proto));
+		memcpy(reply + sizeof(proto), device->board, board_len);
 
-static void *fastboot_payload;
-static size_t fastboot_size;
+		cdba_send_buf(MSG_SELECT_BOARD, sizeof(proto) + board_len, reply);
+		free(reply);
 
-static void msg_fastboot_download(const void *data, size_t len)
+		plan_offset = strlen(board) + 1 + sizeof(proto);
+		if (session->version >= 5 && len > plan_offset)
+			session_plan_run(session, board + plan_offset, len - plan_offset);
+	}
+
+	watch_set_context(ctx);
+
+	free(session->select_param);
+	free(session->select_devices);
+	free(session->select_locks);
+	session->select_param = NULL;
+	session->select_devices = NULL;
+	session->select_locks = NULL;
+	session->select_count = 0;
+}
+
+/* Report the shortest of the queues the session is waiting in */
+static void select_board_report(struct session *session)
 {
-	size_t new_size = fastboot_size + len;
-	char *newp;
+	struct board_lock *lock = NULL;
+	struct device *device = NULL;
+	size_t i;
+	int eta;
 
-	newp = realloc(fastboot_payload, new_size);
-	if (!newp)
-		err(1, "failed too expant fastboot scratch area");
+	for (i = 0; i < session->select_count; i++) {
+		if (lock && board_lock_position(session->select_locks[i]) >=
+			    board_lock_position(lock))
+			continue;
 
-	memcpy(newp + fastboot_size, data, len);
+		lock = session->select_locks[i];
+		device = session->select_devices[i];
+	}
 
-	fastboot_payload = newp;
-	fastboot_size = new_size;
+	if (board_lock_position(lock) == session->select_position)
+		return;
 
-	if (!len) {
-		device_boot(selected_device, fastboot_payload, fastboot_size);
+	session->select_position = board_lock_position(lock);
 
-		cdba_send(MSG_FASTBOOT_DOWNLOAD);
-		free(fastboot_payload);
-		fastboot_payload = NULL;
-		fastboot_size = 0;
+	eta = board_lock_eta(lock);
+	if (eta < 0) {
+		session_warnx("board %s is in use by %s, position %d in queue",
+			      device->board, board_lock_owner(lock),
+			      board_lock_position(lock));
+	} else {
+		session_warnx("board %s is in use by %s, position %d in queue, estimated wait %d:%02d",
+			      device->board, board_lock_owner(lock),
+			      board_lock_position(lock), eta / 60, eta % 60);
 	}
 }
 
-static void msg_fastboot_continue(void)
+static void select_board_lock_update(struct board_lock *lock, void *data)
 {
-	device_fastboot_continue(selected_device);
-	cdba_send(MSG_FASTBOOT_CONTINUE);
+	struct session *session = data;
+	size_t i;
+
+	if (!board_lock_held(lock)) {
+		select_board_report(session);
+		return;
+	}
+
+	for (i = 0; i < session->select_count; i++) {
+		if (session->select_locks[i] == lock)
+			break;
+	}
+
+	select_board_done(session, i);
+	session_resume(session);
 }
 
-void cdba_send_buf(int type, size_t len, const void *buf)
+static void select_board_add(struct session *session, struct device *device)
 {
-	struct msg msg = {
-		.type = type,
-		.len = len
-	};
+	size_t count = session->select_count + 1;
+
+	session->select_devices = realloc(session->select_devices,
+					  count * sizeof(*session->select_devices));
+	session->select_locks = realloc(session->select_locks,
+					count * sizeof(*session->select_locks));
+	if (!session->select_devices || !session->select_locks)
+		err(1, "failed to allocate board selection");
 
-	write(STDOUT_FILENO, &msg, sizeof(msg));
-	if (len)
-		write(STDOUT_FILENO, buf, len);
+	session->select_devices[session->select_count] = device;
+	session->select_locks[session->select_count] = NULL;
+	session->select_count = count;
 }
 
-static int handle_stdin(int fd, void *buf)
+/*
+ * Returns false if the board is in use, in which case the session waits in
+ * the board's queue and resumes once the lock is taken. For a pool of boards
+ * the session queues up for each of them, and takes the first one available.
+ */
+static bool msg_select_board(struct session *session, const void *param, size_t len)
 {
-	static struct circ_buf recv_buf = { };
-	struct msg *msg;
-	struct msg hdr;
-	size_t n;
-	int ret;
+	struct msg_select_board_proto proto;
+	const char *board = param;
+	struct device *device;
+	size_t board_len;
+	size_t i;
 
-	ret = circ_fill(STDIN_FILENO, &recv_buf);
-	if (ret < 0 && errno != EAGAIN) {
-		fprintf(stderr, "read %d\n", ret);
-		return -1;
+	board_len = strnlen(board, len);
+	if (board_len == len) {
+		session_warnx("malformed board selection");
+		session_quit(session);
+		return true;
 	}
 
-	for (;;) {
-		n = circ_peak(&recv_buf, &hdr, sizeof(hdr));
-		if (n != sizeof(hdr))
-			return 0;
+	/* Older clients only send the board name */
+	if (len - board_len - 1 >= sizeof(proto)) {
+		memcpy(&proto, board + board_len + 1, sizeof(proto));
+		session->version = MIN(proto.version, CDBA_PROTOCOL_VERSION);
+	}
 
-		if (CIRC_AVAIL(&recv_buf) < sizeof(*msg) + hdr.len)
-			return 0;
+	device = device_pool_next(board, session->username, NULL);
+	for (; device; device = device_pool_next(board, session->username, device))
+		select_board_add(session, device);
 
-		msg = malloc(sizeof(*msg) + hdr.len);
-		circ_read(&recv_buf, msg, sizeof(*msg) + hdr.len);
+	if (!session->select_count) {
+		device = device_lookup(board, session->username);
+		if (!device) {
+			session_warnx("failed to open %s", board);
+			session_quit(session);
+			return true;
+		}
 
-		switch (msg->type) {
-		case MSG_CONSOLE:
-			device_write(selected_device, msg->data, msg->len);
-			break;
-		case MSG_FASTBOOT_PRESENT:
-			break;
-		case MSG_SELECT_BOARD:
-			msg_select_board(msg->data);
-			break;
-		case MSG_HARDRESET:
-			// fprintf(stderr, "hard reset\n");
-			break;
-		case MSG_POWER_ON:
-			device_power(selected_device, true);
+		select_board_add(session, device);
+	}
 
-			cdba_send(MSG_POWER_ON);
-			break;
-		case MSG_POWER_OFF:
-			device_power(selected_device, false);
+	session->select_param = malloc(len);
+	if (!session->select_param)
+		err(1, "failed to allocate board selection");
 
-			cdba_send(MSG_POWER_OFF);
-			break;
-		case MSG_FASTBOOT_DOWNLOAD:
-			msg_fastboot_download(msg->data, msg->len);
-			break;
-		case MSG_FASTBOOT_BOOT:
-			// fprintf(stderr, "fastboot boot\n");
-			break;
-		case MSG_STATUS_UPDATE:
-			device_status_enable(selected_device);
-			break;
-		case MSG_VBUS_ON:
-			device_usb(selected_device, true);
-			break;
-		case MSG_VBUS_OFF:
-			device_usb(selected_device, false);
-			break;
-		case MSG_SEND_BREAK:
-			device_send_break(selected_device);
-			break;
-		case MSG_LIST_DEVICES:
-			device_list_devices(username);
-			break;
-		case MSG_BOARD_INFO:
-			device_info(username, msg->data, msg->len);
-			break;
-		case MSG_FASTBOOT_CONTINUE:
-			msg_fastboot_continue();
-			break;
-		default:
-			fprintf(stderr, "unk %d len %d\n", msg->type, msg->len);
-			exit(1);
+	memcpy(session->select_param, param, len);
+	session->select_len = len;
+	session->select_position = 0;
+
+	for (i = 0; i < session->select_count; i++) {
+		device = session->select_devices[i];
+		session->select_locks[i] = board_lock_request(device->board,
+							      session->username,
+							      select_board_lock_update,
+							      session);
+		if (!session->select_locks[i]) {
+			session_warnx("failed to lock %s: %s", device->board,
+				      strerror(errno));
+			session->select_count = i;
+			session_quit(session);
+			return true;
+		}
+
+		if (board_lock_held(session->select_locks[i])) {
+			/* don't queue up for the remaining boards */
+			session->select_count = i + 1;
+			select_board_done(session, i);
+			return true;
 		}
+	}
+
+	select_board_report(session);
+
+	return false;
+}
+
+static void fastboot_stream_done(struct device *device, int ret)
+{
+	cdba_send(MSG_FASTBOOT_DOWNLOAD);
+}
+
+static struct fastboot_stage *fastboot_stage_new(struct session *session,
+						 size_t size)
+{
+	struct fastboot_stage *stage;
+
+	stage = calloc(1, sizeof(*stage));
+	if (!stage)
+		err(1, "failed to allocate fastboot stage");
+
+	stage->size = size;
+	session->fastboot_stage = stage;
+
+	return stage;
+}
+
+static void fastboot_stage_free(struct session *session)
+{
+	struct fastboot_stage *stage = session->fastboot_stage;
 
-		free(msg);
+	if (!stage)
+		return;
+
+	if (stage->size)
+		munmap(stage->data, stage->size);
+	free(stage);
+
+	session->fastboot_stage = NULL;
+}
+
+/* Pass staged data on to fastboot, as far as it accepts it without blocking */
+static void fastboot_stage_pump(struct session *session)
+{
+	struct fastboot_stage *stage = session->fastboot_stage;
+	struct device *device = session->device;
+	size_t len;
+	void **ctx;
+
+	if (!stage || !stage->started)
+		return;
+
+	while (stage->sent < stage->len && !session->fastboot_stream_status) {
+		len = MIN(stage->len - stage->sent, FASTBOOT_STAGE_CHUNK);
+		if (!device_boot_ready(device, len))
+			return;
+
+		session->fastboot_stream_status = device_boot_write(device,
+								    stage->data + stage->sent,
+								    len);
+		stage->sent += len;
 	}
 
-	return 0;
+	if (!stage->done)
+		return;
+
+	fastboot_stage_free(session);
+
+	ctx = watch_set_context(&device->session);
+	if (!session->fastboot_stream_status) {
+		device_boot_finish(device, fastboot_stream_done);
+	} else {
+		session_warnx("failed to stream boot image");
+		cdba_send(MSG_FASTBOOT_DOWNLOAD);
+	}
+	watch_set_context(ctx);
 }
 
-static void sigpipe_handler(int signo)
+/* Start the download of the staged image, as fastboot shows up */
+static void fastboot_stage_start(struct session *session)
 {
-	watch_quit();
+	struct fastboot_stage *stage = session->fastboot_stage;
+
+	if (!stage || stage->started)
+		return;
+
+	stage->started = true;
+	session->fastboot_stream_status = device_boot_start(session->device,
+							    stage->size);
+
+	fastboot_stage_pump(session);
 }
 
-static void atexit_handler(void)
+static void fastboot_stage_write(struct session *session,
+				 const void *data, size_t len)
 {
-	syslog(LOG_INFO, "exiting");
+	struct fastboot_stage *stage = session->fastboot_stage;
+
+	if (len > stage->size - stage->len) {
+		session_warnx("discarding %zu bytes beyond announced image size",
+			      len - (stage->size - stage->len));
+		len = stage->size - stage->len;
+	}
+
+	memcpy(stage->data + stage->len, data, len);
+	stage->len += len;
+
+	fastboot_stage_pump(session);
 }
 
-int main(int argc, char **argv)
+static void msg_fastboot_cache_lookup(struct session *session,
+				      const void *data, size_t len)
 {
-	int flags;
-	int ret;
+	struct msg_fastboot_cache_lookup lookup;
+	struct fastboot_stage *stage;
+	void *payload = MAP_FAILED;
+	uint8_t hit;
+	int fd;
 
-	signal(SIGPIPE, sigpipe_handler);
+	if (len != sizeof(lookup)) {
+		session_warnx("malformed fastboot cache lookup");
+		session_quit(session);
+		return;
+	}
 
-	fprintf(stderr, "Starting cdba server\n");
+	memcpy(&lookup, data, sizeof(lookup));
 
-	username = getenv("CDBA_USER");
-	if (!username)
-		username = getenv("USER");
-	if (!username)
-		username = "nobody";
+	/* Left behind by an aborted upload */
+	if (session->fastboot_cache_writer) {
+		image_cache_abort(session->fastboot_cache_writer);
+		session->fastboot_cache_writer = NULL;
+	}
 
-	openlog("cdba-server", LOG_PID, LOG_DAEMON);
-	atexit(atexit_handler);
+	fd = image_cache_lookup(lookup.sha256, lookup.size);
+	if (fd >= 0) {
+		payload = mmap(NULL, lookup.size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+	}
 
-	ret = device_parser(".cdba");
-	if (ret) {
-		ret = device_parser("/etc/cdba");
-		if (ret) {
-			fprintf(stderr, "device parser: unable to open config file\n");
-			exit(1);
-		}
+	hit = payload != MAP_FAILED;
+	cdba_send_buf(MSG_FASTBOOT_CACHE_LOOKUP, 1, &hit);
+
+	if (!hit) {
+		session->fastboot_cache_writer = image_cache_store(lookup.sha256, lookup.size);
+		return;
+	}
+
+	session_warnx("boot image found in cache, skipping upload");
+
+	/* Fed to fastboot as it accepts it, or once it shows up */
+	stage = fastboot_stage_new(session, lookup.size);
+	stage->data = payload;
+	stage->len = lookup.size;
+	stage->done = true;
+
+	if (session->fastboot_present)
+		fastboot_stage_start(session);
+	else
+		session_warnx("fastboot not present, staging boot image");
+}
+
+/* Back the stage with a memfd, rather than holding the image on the heap */
+static void *fastboot_stage_map(size_t size)
+{
+	void *ptr;
+	int fd;
+
+	if (!size)
+		return NULL;
+
+	fd = memfd_create("fastboot_stage", MFD_CLOEXEC);
+	if (fd < 0)
+		err(1, "failed to create fastboot stage");
+
+	if (ftruncate(fd, size) < 0)
+		err(1, "failed to size fastboot stage");
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+		err(1, "failed to map fastboot stage");
+
+	close(fd);
+
+	return ptr;
+}
+
+static void msg_fastboot_download_size(struct session *session,
+				       const void *data, size_t len)
+{
+	struct fastboot_stage *stage;
+	uint32_t size;
+
+	if (len != sizeof(size)) {
+		session_warnx("malformed fastboot download size");
+		session_quit(session);
+		return;
+	}
+
+	memcpy(&size, data, sizeof(size));
+
+	if (!session->fastboot_present && size > session->device->stage_max_size) {
+		session_warnx("boot image of %u bytes exceeds stage_max_size of %zu bytes",
+			      size, session->device->stage_max_size);
+		session_quit(session);
+		return;
+	}
+
+	session->fastboot_streaming = true;
+
+	/* Uploaded ahead of fastboot showing up, hold on to the image */
+	if (!session->fastboot_present) {
+		session_warnx("fastboot not present, staging boot image");
+		stage = fastboot_stage_new(session, size);
+		stage->data = fastboot_stage_map(size);
+		return;
+	}
+
+	session->fastboot_stream_status = device_boot_start(session->device, size);
+}
+
+static void msg_fastboot_download_stream(struct session *session,
+					 const void *data, size_t len)
+{
+	if (len) {
+		if (session->fastboot_stage)
+			fastboot_stage_write(session, data, len);
+		else if (!session->fastboot_stream_status)
+			session->fastboot_stream_status = device_boot_write(session->device, data, len);
+		if (session->fastboot_cache_writer)
+			image_cache_write(session->fastboot_cache_writer, data, len);
+		return;
+	}
+
+	if (session->fastboot_cache_writer) {
+		image_cache_commit(session->fastboot_cache_writer);
+		session->fastboot_cache_writer = NULL;
+	}
+
+	session->fastboot_streaming = false;
+
+	if (session->fastboot_stage) {
+		session->fastboot_stage->done = true;
+		fastboot_stage_pump(session);
+		return;
 	}
 
-	watch_add_readfd(STDIN_FILENO, handle_stdin, NULL);
+	if (!session->fastboot_stream_status) {
+		/* acknowledged once the remaining transfers have completed */
+		device_boot_finish(session->device, fastboot_stream_done);
+	} else {
+		session_warnx("failed to stream boot image");
+		cdba_send(MSG_FASTBOOT_DOWNLOAD);
+	}
+}
+
+static void msg_fastboot_flash(struct session *session,
+			       const void *data, size_t len)
+{
+	struct msg_fastboot_flash flash;
+
+	if (len != sizeof(flash)) {
+		session_warnx("malformed fastboot flash request");
+		session_quit(session);
+		return;
+	}
+
+	memcpy(&flash, data, sizeof(flash));
+	flash.partition[sizeof(flash.partition) - 1] = '\0';
+
+	session->fastboot_flashing = true;
+	session->fastboot_flash_status = device_flash_start(session->device,
+							    flash.partition,
+							    flash.size);
+}
+
+static void fastboot_flash_done(struct device *device, int ret)
+{
+	uint8_t failed = ret < 0;
+
+	cdba_send_buf(MSG_FASTBOOT_FLASH, 1, &failed);
+}
+
+static void msg_fastboot_flash_stream(struct session *session,
+				      const void *data, size_t len)
+{
+	if (len) {
+		if (!session->fastboot_flash_status)
+			device_flash_write(session->device, data, len);
+		return;
+	}
+
+	session->fastboot_flashing = false;
+
+	/* acknowledged once the device has written the last piece */
+	if (!session->fastboot_flash_status)
+		device_flash_finish(session->device, fastboot_flash_done);
+	else
+		fastboot_flash_done(session->device, session->fastboot_flash_status);
+}
+
+/*
+ * Returns true if the given message would have to wait for in-flight USB
+ * transfers, or for the device to write a previous image, in which case input
+ * is left unread until fastboot signals that the payload can be accepted.
+ */
+static bool fastboot_stream_busy(struct session *session, int type, size_t len)
+{
+	if (type == MSG_FASTBOOT_FLASH)
+		return !device_flash_idle(session->device);
+
+	if (type != MSG_FASTBOOT_DOWNLOAD || !len)
+		return false;
+
+	if (session->fastboot_flashing)
+		return !session->fastboot_flash_status &&
+		       !device_flash_ready(session->device, len);
+
+	/* Staged data is buffered, or fed to fastboot as it becomes ready */
+	if (!session->fastboot_streaming || session->fastboot_stream_status ||
+	    session->fastboot_stage)
+		return false;
+
+	return !device_boot_ready(session->device, len);
+}
+
+/*
+ * Clients predating MSG_FASTBOOT_DOWNLOAD_SIZE upload the image before its
+ * size is known, collect it in a memfd and stage it as the upload completes.
+ */
+static void msg_fastboot_download_legacy(struct session *session,
+					 const void *data, size_t len)
+{
+	struct fastboot_stage *stage;
+	void *payload = NULL;
+	size_t size;
+	int fd;
+
+	if (session->fastboot_payload_fd < 0) {
+		session->fastboot_payload_fd = memfd_create("fastboot_payload", MFD_CLOEXEC);
+		if (session->fastboot_payload_fd < 0)
+			err(1, "failed to create fastboot scratch area");
+	}
+
+	fd = session->fastboot_payload_fd;
+
+	if (len) {
+		if (session->fastboot_size + len > session->device->stage_max_size) {
+			session_warnx("boot image exceeds stage_max_size of %zu bytes",
+				      session->device->stage_max_size);
+			session_quit(session);
+			return;
+		}
+
+		if (write(fd, data, len) != (ssize_t)len) {
+			session_warnx("failed to buffer boot image");
+			session_quit(session);
+			return;
+		}
+
+		session->fastboot_size += len;
+		return;
+	}
+
+	size = session->fastboot_size;
+	if (size) {
+		payload = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (payload == MAP_FAILED)
+			err(1, "failed to map fastboot scratch area");
+	}
+
+	close(fd);
+	session->fastboot_payload_fd = -1;
+	session->fastboot_size = 0;
+
+	stage = fastboot_stage_new(session, size);
+	stage->data = payload;
+	stage->len = size;
+	stage->done = true;
+
+	if (session->fastboot_present)
+		fastboot_stage_start(session);
+}
+
+static void msg_fastboot_download(struct session *session,
+				  const void *data, size_t len)
+{
+	if (session->fastboot_streaming) {
+		msg_fastboot_download_stream(session, data, len);
+		return;
+	}
+
+	if (session->fastboot_flashing) {
+		msg_fastboot_flash_stream(session, data, len);
+		return;
+	}
+
+	msg_fastboot_download_legacy(session, data, len);
+}
+
+static void msg_fastboot_continue(struct session *session)
+{
+	device_fastboot_continue(session->device);
+	cdba_send(MSG_FASTBOOT_CONTINUE);
+}
+
+/* Carry out the steps of the session the client asked for up front */
+static void session_plan_run(struct session *session, const void *data, size_t len)
+{
+	struct msg_session_plan plan;
+
+	if (len < sizeof(plan)) {
+		session_warnx("malformed session plan");
+		session_quit(session);
+		return;
+	}
+
+	memcpy(&plan, data, sizeof(plan));
+
+	if (plan.flags & SESSION_PLAN_STATUS_UPDATE)
+		device_status_enable(session->device);
+
+	if (plan.flags & SESSION_PLAN_POWER_ON) {
+		device_power(session->device, true);
+		cdba_send(MSG_POWER_ON);
+	}
+
+	if (plan.flags & SESSION_PLAN_CACHE_LOOKUP)
+		msg_fastboot_cache_lookup(session, &plan.image, sizeof(plan.image));
+
+	if (plan.flags & SESSION_PLAN_CONTINUE) {
+		if (session->fastboot_present)
+			msg_fastboot_continue(session);
+		else
+			session->fastboot_continue = true;
+	}
+}
+
+/*
+ * Messages are queued when the client can't keep up, and console readers are
+ * throttled while more than OUTPUT_HIGH_WATERMARK bytes are queued, until the
+ * queue has been drained below OUTPUT_LOW_WATERMARK.
+ */
+#define OUTPUT_HIGH_WATERMARK	(256 * 1024)
+#define OUTPUT_LOW_WATERMARK	(64 * 1024)
+
+struct throttled_reader {
+	int fd;
+	int (*cb)(int, void*);
+	void *data;
+	void **ctx;
+
+	struct list_head node;
+};
+
+static void output_queue(struct session *session, const void *buf, size_t len)
+{
+	size_t queued = session->output_head - session->output_tail;
+
+	if (session->output_head + len > session->output_size) {
+		/* Move queued data to the front before growing the buffer */
+		memmove(session->output_buf,
+			session->output_buf + session->output_tail, queued);
+		session->output_head = queued;
+		session->output_tail = 0;
+
+		if (queued + len > session->output_size) {
+			session->output_size = MAX(session->output_size * 2, queued + len);
+			session->output_buf = realloc(session->output_buf, session->output_size);
+			if (!session->output_buf)
+				err(1, "failed to allocate output queue");
+		}
+	}
+
+	memcpy(session->output_buf + session->output_head, buf, len);
+	session->output_head += len;
+}
+
+static void output_unthrottle(struct session *session)
+{
+	struct throttled_reader *next;
+	struct throttled_reader *reader;
+	void **ctx;
+
+	list_for_each_entry_safe(reader, next, &session->throttled_readers, node) {
+		ctx = watch_set_context(reader->ctx);
+		watch_add_readfd(reader->fd, reader->cb, reader->data);
+		watch_set_context(ctx);
+
+		list_del(&reader->node);
+		free(reader);
+	}
+}
+
+static int output_drain(int fd, void *data)
+{
+	struct session *session = data;
+	ssize_t n;
+
+	n = write(fd, session->output_buf + session->output_tail,
+		  session->output_head - session->output_tail);
+	if (n < 0 && errno == EAGAIN) {
+		return 0;
+	} else if (n < 0) {
+		session_quit(session);
+		return 0;
+	}
+
+	session->output_tail += n;
+
+	if (session->output_tail == session->output_head) {
+		session->output_head = 0;
+		session->output_tail = 0;
+
+		watch_del_writefd(fd);
+	}
+
+	if (session->output_head - session->output_tail <= OUTPUT_LOW_WATERMARK)
+		output_unthrottle(session);
+
+	return 0;
+}
+
+void cdba_send_buf(int type, size_t len, const void *buf)
+{
+	struct session *session = session_current();
+	struct msg_long long_msg = {
+		.type = type | MSG_LONG,
+		.len = len
+	};
+	struct msg msg = {
+		.type = type,
+		.len = len
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &msg, .iov_len = sizeof(msg) },
+		{ .iov_base = (void *)buf, .iov_len = len },
+	};
+	ssize_t n = 0;
+
+	/* Output of devices not in use by any session is discarded */
+	if (!session || session->quit)
+		return;
+
+	/* Only the session is lost, not all sessions of a daemon */
+	if (len > session->max_frame) {
+		session_warnx("message of %zu bytes exceeds maximum frame size", len);
+		session_quit(session);
+		return;
+	}
+
+	if (len > UINT16_MAX) {
+		iov[0].iov_base = &long_msg;
+		iov[0].iov_len = sizeof(long_msg);
+	}
+
+	/* Messages must not overtake those already queued */
+	if (session->output_head == session->output_tail) {
+		n = writev(session->out_fd, iov, 2);
+		if (n < 0 && errno != EAGAIN) {
+			session_quit(session);
+			return;
+		} else if (n < 0) {
+			n = 0;
+		}
+
+		if (n == iov[0].iov_len + len)
+			return;
+
+		watch_add_writefd(session->out_fd, output_drain, session);
+	}
+
+	if (n < iov[0].iov_len) {
+		output_queue(session, (char *)iov[0].iov_base + n, iov[0].iov_len - n);
+		output_queue(session, buf, len);
+	} else {
+		output_queue(session, (const char *)buf + n - iov[0].iov_len,
+			     iov[0].iov_len + len - n);
+	}
+}
+
+/**
+ * cdba_output_throttle() - throttle reader while the output queue is full
+ * @fd:		file descriptor of the reader
+ * @cb:		read callback, as registered with watch_add_readfd()
+ * @data:	context of @cb
+ *
+ * Readers producing data for the client, such as the console, should call
+ * this after each message, so that the read watch of @fd is removed while the
+ * client isn't keeping up and reinstated once the output queue has drained.
+ *
+ * Return: true if the reader was throttled
+ */
+bool cdba_output_throttle(int fd, int (*cb)(int, void*), void *data)
+{
+	struct session *session = session_current();
+	struct throttled_reader *reader;
+
+	if (!session)
+		return false;
+
+	if (session->output_head - session->output_tail < OUTPUT_HIGH_WATERMARK)
+		return false;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		err(1, "failed to allocate throttled reader");
+
+	reader->fd = fd;
+	reader->cb = cb;
+	reader->data = data;
+	reader->ctx = watch_get_context();
+
+	list_add(&session->throttled_readers, &reader->node);
+
+	watch_del_readfd(fd);
+
+	return true;
+}
+
+/**
+ * cdba_boot_phase() - report that the current session reached a boot phase
+ * @phase:	BOOT_PHASE_* reached
+ * @value:	size of the image, for BOOT_PHASE_DOWNLOAD_START
+ *
+ * The time since the start of the session is logged and reported to clients
+ * supporting MSG_BOOT_PHASE. The throughput of the download is reported with
+ * BOOT_PHASE_DOWNLOAD_DONE, and only the first console output following power
+ * on is reported.
+ */
+void cdba_boot_phase(int phase, uint64_t value)
+{
+	struct session *session = session_current();
+	struct msg_boot_phase msg;
+	uint64_t now = session_now_us();
+	uint64_t elapsed;
+
+	if (!session || !session->device)
+		return;
+
+	switch (phase) {
+	case BOOT_PHASE_POWER_ON:
+		session->console_seen = false;
+		break;
+	case BOOT_PHASE_CONSOLE:
+		if (session->console_seen)
+			return;
+		session->console_seen = true;
+		break;
+	case BOOT_PHASE_DOWNLOAD_START:
+		session->download_start = now;
+		session->download_size = value;
+		break;
+	case BOOT_PHASE_DOWNLOAD_DONE:
+		elapsed = MAX(now - session->download_start, 1);
+		value = session->download_size * 1000000 / elapsed;
+		break;
+	}
+
+	msg.phase = phase;
+	msg.time = now - session->start_time;
+	msg.value = value;
+
+	if (phase == BOOT_PHASE_DOWNLOAD_DONE) {
+		syslog(LOG_INFO, "board %s %s at %llu.%03llus, %llu kB/s",
+		       session->device->board, boot_phase_name(phase),
+		       (unsigned long long)msg.time / 1000000,
+		       (unsigned long long)msg.time / 1000 % 1000,
+		       (unsigned long long)value / 1024);
+	} else {
+		syslog(LOG_INFO, "board %s %s at %llu.%03llus",
+		       session->device->board, boot_phase_name(phase),
+		       (unsigned long long)msg.time / 1000000,
+		       (unsigned long long)msg.time / 1000 % 1000);
+	}
+
+	if (session->version >= 2)
+		cdba_send_buf(MSG_BOOT_PHASE, sizeof(msg), &msg);
+}
+
+/**
+ * msg_peek() - parse the header of the next message
+ * @session:	session to parse the input of
+ * @type:	message type
+ * @len:	payload length
+ *
+ * Return: size of the header, or 0 if the message isn't fully received
+ */
+static size_t msg_peek(struct session *session, int *type, size_t *len)
+{
+	struct circ_buf *recv_buf = &session->recv_buf;
+	struct msg_long *long_hdr;
+	struct msg *hdr;
+	size_t hdr_len;
+
+	if (CIRC_AVAIL(recv_buf) < sizeof(*hdr))
+		return 0;
+
+	hdr = circ_data(recv_buf);
+	if (hdr->type & MSG_LONG) {
+		if (CIRC_AVAIL(recv_buf) < sizeof(*long_hdr))
+			return 0;
+
+		long_hdr = circ_data(recv_buf);
+		*type = long_hdr->type & ~MSG_LONG;
+		*len = long_hdr->len;
+		hdr_len = sizeof(*long_hdr);
+	} else {
+		*type = hdr->type;
+		*len = hdr->len;
+		hdr_len = sizeof(*hdr);
+	}
+
+	if (*len > session->max_frame) {
+		session_warnx("message of %zu bytes exceeds maximum frame size", *len);
+		session_quit(session);
+		return 0;
+	}
+
+	/* Make room for the entire message */
+	circ_reserve(recv_buf, hdr_len + *len);
+
+	if (CIRC_AVAIL(recv_buf) < hdr_len + *len)
+		return 0;
+
+	return hdr_len;
+}
+
+/*
+ * Consecutive console messages are gathered and written to the device as
+ * one, rather than issuing a write for each (typically single character)
+ * message.
+ */
+static char *console_buf;
+static size_t console_len;
+static size_t console_size;
+
+static void console_queue(const void *data, size_t len)
+{
+	if (console_len + len > console_size) {
+		console_size = MAX(console_size * 2, console_len + len);
+		console_buf = realloc(console_buf, console_size);
+		if (!console_buf)
+			err(1, "failed to allocate console buffer");
+	}
+
+	memcpy(console_buf + console_len, data, len);
+	console_len += len;
+}
+
+static void console_flush(struct session *session)
+{
+	if (!console_len)
+		return;
+
+	device_write(session->device, console_buf, console_len);
+	console_len = 0;
+}
+
+/*
+ * Returns false if processing of further messages has to wait, for the
+ * selected board to become available or for fastboot to accept more data.
+ */
+static bool handle_message(struct session *session, int type,
+			   const void *data, size_t len)
+{
+	/* Only board queries are valid before a board is selected */
+	if (!session->device && type != MSG_SELECT_BOARD &&
+	    type != MSG_LIST_DEVICES && type != MSG_BOARD_INFO) {
+		session_warnx("no board selected");
+		session_quit(session);
+		return true;
+	}
+
+	switch (type) {
+	case MSG_FASTBOOT_PRESENT:
+		break;
+	case MSG_SELECT_BOARD:
+		return msg_select_board(session, data, len);
+	case MSG_HARDRESET:
+		// fprintf(stderr, "hard reset\n");
+		break;
+	case MSG_POWER_ON:
+		device_power(session->device, true);
+
+		cdba_send(MSG_POWER_ON);
+		break;
+	case MSG_POWER_OFF:
+		cdba_boot_phase(BOOT_PHASE_POWER_OFF, 0);
+		device_power(session->device, false);
+
+		cdba_send(MSG_POWER_OFF);
+		break;
+	case MSG_FASTBOOT_DOWNLOAD:
+		msg_fastboot_download(session, data, len);
+		break;
+	case MSG_FASTBOOT_DOWNLOAD_SIZE:
+		msg_fastboot_download_size(session, data, len);
+		break;
+	case MSG_FASTBOOT_CACHE_LOOKUP:
+		msg_fastboot_cache_lookup(session, data, len);
+		break;
+	case MSG_FASTBOOT_FLASH:
+		msg_fastboot_flash(session, data, len);
+		break;
+	case MSG_FASTBOOT_BOOT:
+		// fprintf(stderr, "fastboot boot\n");
+		break;
+	case MSG_STATUS_UPDATE:
+		device_status_enable(session->device);
+		break;
+	case MSG_VBUS_ON:
+		device_usb(session->device, true);
+		break;
+	case MSG_VBUS_OFF:
+		device_usb(session->device, false);
+		break;
+	case MSG_SEND_BREAK:
+		device_send_break(session->device);
+		break;
+	case MSG_LIST_DEVICES:
+		device_list_devices(session->username);
+		break;
+	case MSG_BOARD_INFO:
+		device_info(session->username, data, len);
+		break;
+	case MSG_FASTBOOT_CONTINUE:
+		msg_fastboot_continue(session);
+		break;
+	default:
+		session_warnx("unk %d len %zu", type, len);
+		session_quit(session);
+		break;
+	}
+
+	return true;
+}
+
+static void session_pause(struct session *session)
+{
+	if (!session->in_watched)
+		return;
+
+	watch_del_readfd(session->in_fd);
+	session->in_watched = false;
+}
+
+static void handle_messages(struct session *session)
+{
+	size_t hdr_len;
+	char *data;
+	size_t len;
+	void **ctx;
+	bool done;
+	int type;
+
+	while (!session->quit && !session->select_param) {
+		hdr_len = msg_peek(session, &type, &len);
+		if (!hdr_len)
+			break;
+
+		if (session->device && fastboot_stream_busy(session, type, len)) {
+			session_pause(session);
+			break;
+		}
+
+		/* Consumed up front, the data remains valid until the next fill */
+		data = (char *)circ_data(&session->recv_buf) + hdr_len;
+		circ_consume(&session->recv_buf, hdr_len + len);
+
+		if (type == MSG_CONSOLE && session->device) {
+			console_queue(data, len);
+			continue;
+		}
+
+		/* Retain the order of console input and other requests */
+		console_flush(session);
+
+		if (session->device)
+			ctx = watch_set_context(&session->device->session);
+		else
+			ctx = watch_set_context(&session->self);
+
+		done = handle_message(session, type, data, len);
+
+		watch_set_context(ctx);
+
+		if (!done)
+			break;
+	}
+
+	console_flush(session);
+}
+
+static int handle_input(int fd, void *data)
+{
+	struct session *session = data;
+	int ret;
+
+	ret = circ_fill(fd, &session->recv_buf);
+	if (ret < 0 && errno != EAGAIN) {
+		session_quit(session);
+		return 0;
+	}
+
+	handle_messages(session);
+
+	/* Unable to make progress, stop reading until resumed */
+	if (!CIRC_SPACE(&session->recv_buf))
+		session_pause(session);
+
+	return 0;
+}
+
+static void session_resume(struct session *session)
+{
+	if (session->quit)
+		return;
+
+	if (!session->in_watched) {
+		watch_add_readfd(session->in_fd, handle_input, session);
+		session->in_watched = true;
+	}
+
+	fastboot_stage_pump(session);
+	handle_messages(session);
+}
+
+static struct session *session_new(int in_fd, int out_fd, int err_fd,
+				   int shim_fd, const char *username)
+{
+	struct session *session;
+	void **ctx;
+	int flags;
+
+	session = calloc(1, sizeof(*session));
+	if (!session)
+		err(1, "failed to allocate session");
+
+	session->self = session;
+	session->in_fd = in_fd;
+	session->out_fd = out_fd;
+	session->err_fd = err_fd;
+	session->shim_fd = shim_fd;
+	session->fastboot_payload_fd = -1;
+	session->max_frame = UINT16_MAX;
+	session->start_time = session_now_us();
+	list_init(&session->throttled_readers);
+
+	session->username = strdup(username);
+	if (!session->username)
+		err(1, "failed to allocate session");
+
+	flags = fcntl(in_fd, F_GETFL, 0);
+	fcntl(in_fd, F_SETFL, flags | O_NONBLOCK);
+
+	flags = fcntl(out_fd, F_GETFL, 0);
+	fcntl(out_fd, F_SETFL, flags | O_NONBLOCK);
+
+	flags = fcntl(err_fd, F_GETFL, 0);
+	fcntl(err_fd, F_SETFL, flags | O_NONBLOCK);
+
+	ctx = watch_set_context(&session->self);
+	watch_add_readfd(in_fd, handle_input, session);
+	watch_set_context(ctx);
+
+	session->in_watched = true;
+
+	return session;
+}
+
+/*
+ * Tear down a daemon session. The device is released, but its drivers remain
+ * open, ready for the next session.
+ */
+static void session_close(void *data)
+{
+	struct session *session = data;
+	struct device *device = session->device;
+	void **ctx;
+	size_t i;
+
+	if (session->fastboot_cache_writer)
+		image_cache_abort(session->fastboot_cache_writer);
+	fastboot_stage_free(session);
+
+	if (device) {
+		syslog(LOG_INFO, "user %s releasing board %s",
+		       session->username, device->board);
+
+		device->session = NULL;
+
+		ctx = watch_set_context(&device->session);
+		/* An interrupted flash fails as the device is powered off */
+		if (session->fastboot_flashing && !session->fastboot_flash_status)
+			device_flash_finish(device, fastboot_flash_done);
+		device_release(device);
+		watch_set_context(ctx);
+	}
+
+	output_unthrottle(session);
+
+	for (i = 0; i < session->select_count; i++)
+		board_lock_release(session->select_locks[i]);
+
+	session_pause(session);
+	watch_del_writefd(session->out_fd);
+	watch_del_writefd(session->err_fd);
+	watch_del_readfd(session->shim_fd);
+
+	close(session->in_fd);
+	close(session->out_fd);
+	close(session->err_fd);
+	close(session->shim_fd);
+
+	circ_release(&session->recv_buf);
+	circ_release(&session->err_buf);
+	if (session->fastboot_payload_fd >= 0)
+		close(session->fastboot_payload_fd);
+	free(session->select_param);
+	free(session->select_devices);
+	free(session->select_locks);
+	free(session->output_buf);
+	free(session->username);
+	free(session);
+}
+
+/*
+ * End the session, deferred to a timer in daemon mode so that the session
+ * isn't freed while its handlers are running.
+ */
+static void session_quit(struct session *session)
+{
+	if (session->quit)
+		return;
+
+	session->quit = true;
+
+	if (!daemon_mode) {
+		watch_quit();
+		return;
+	}
+
+	session->close_timer = watch_timer_add(0, session_close, session);
+}
+
+static int session_shim_hangup(int fd, void *data)
+{
+	struct session *session = data;
+	char buf[16];
+	ssize_t n;
+
+	n = read(fd, buf, sizeof(buf));
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	watch_del_readfd(fd);
+	session_quit(session);
+
+	return 0;
+}
+
+/*
+ * Shims running as the daemon's own user speak for whoever ssh let in, as
+ * identified by CDBA_USER, just like a standalone server would. Shims of other
+ * users, let in through the group of the socket's directory, are named by
+ * their account.
+ */
+static const char *daemon_peer_user(int fd, const char *claimed)
+{
+	socklen_t len = sizeof(struct ucred);
+	struct passwd *pw;
+	struct ucred cred;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		warn("failed to get credentials of session request");
+		return NULL;
+	}
+
+	if (cred.uid == geteuid())
+		return claimed;
+
+	pw = getpwuid(cred.uid);
+	if (!pw) {
+		warnx("session request from unknown uid %u", cred.uid);
+		return NULL;
+	}
+
+	return pw->pw_name;
+}
+
+/*
+ * The shim sends the name of the user, followed by a NUL, with stdin, stdout
+ * and stderr of the ssh session passed as SCM_RIGHTS.
+ */
+static int daemon_handshake(int fd, void *data)
+{
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct session *session;
+	char username[256];
+	struct iovec iov = {
+		.iov_base = username,
+		.iov_len = sizeof(username),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	int fds[3] = { -1, -1, -1 };
+	const char *user = NULL;
+	ssize_t n;
+	void **ctx;
+	int passed;
+	int i;
+
+	memset(cbuf, 0, sizeof(cbuf));
+
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	/* The control buffer is left untouched if recvmsg() failed */
+	if (n < 0)
+		msg.msg_controllen = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		if (cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+		} else {
+			/* Don't leak what came with a short or truncated message */
+			for (i = 0; CMSG_LEN((i + 1) * sizeof(int)) <= cmsg->cmsg_len; i++) {
+				memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				close(passed);
+			}
+		}
+	}
+
+	watch_del_readfd(fd);
+
+	if (n > 0 && memchr(username, '\0', n))
+		user = daemon_peer_user(fd, username);
+
+	if (!user || fds[0] < 0 || (msg.msg_flags & MSG_CTRUNC)) {
+		warnx("malformed session request");
+		if (fds[0] >= 0) {
+			close(fds[0]);
+			close(fds[1]);
+			close(fds[2]);
+		}
+		close(fd);
+		return 0;
+	}
+
+	session = session_new(fds[0], fds[1], fds[2], fd, user);
+
+	ctx = watch_set_context(&session->self);
+	watch_add_readfd(fd, session_shim_hangup, session);
+	watch_set_context(ctx);
+
+	return 0;
+}
+
+static int daemon_accept(int fd, void *data)
+{
+	int conn;
+
+	conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (conn < 0)
+		return 0;
+
+	watch_add_readfd(conn, daemon_handshake, NULL);
+
+	return 0;
+}
+
+/*
+ * Only those who can write to the directory of the socket can take its place,
+ * so it must belong to the daemon's user and not be accessible to others.
+ */
+static bool socket_dir_trusted(const char *path, bool owned)
+{
+	char *copy = strdup(path);
+	struct stat sb;
+	bool ret;
+
+	if (!copy)
+		err(1, "failed to allocate socket path");
+
+	ret = !lstat(dirname(copy), &sb) && S_ISDIR(sb.st_mode) &&
+	      !(sb.st_mode & S_IRWXO) && (!owned || sb.st_uid == geteuid());
+
+	free(copy);
+
+	return ret;
+}
+
+static void daemon_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char *dir;
+	mode_t mask;
+	int ret;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "socket path too long");
+
+	dir = strdup(path);
+	if (!dir)
+		err(1, "failed to allocate socket path");
+
+	if (mkdir(dirname(dir), 0770) < 0 && errno != EEXIST)
+		err(1, "failed to create %s", dir);
+
+	if (!socket_dir_trusted(path, true))
+		errx(1, "%s must be a directory owned by the server's user and not accessible to others",
+		     dir);
+
+	free(dir);
+
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		err(1, "failed to create socket");
+
+	/* Replace a stale socket, but refuse to take over from a live daemon */
+	if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		errx(1, "cdba-server already running on %s", path);
+
+	close(fd);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		err(1, "failed to create socket");
+
+	/* Created accessible to the user and group only, see daemon_peer_user() */
+	mask = umask(0117);
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0)
+		err(1, "failed to bind %s", path);
+
+	if (listen(fd, 16) < 0)
+		err(1, "failed to listen on %s", path);
+
+	watch_add_readfd(fd, daemon_accept, NULL);
+}
+
+/*
+ * Hand stdin, stdout and stderr over to the daemon, then wait for it to end
+ * the session. Returns if no daemon is listening on @path.
+ */
+static void shim_run(const char *path, const char *username)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char cbuf[CMSG_SPACE(3 * sizeof(int))] = {};
+	const int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	struct iovec iov = {
+		.iov_base = (void *)username,
+		.iov_len = strlen(username) + 1,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	char buf[16];
+	ssize_t n;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return;
+
+	/* Don't hand the session to whoever managed to create the socket */
+	if (!socket_dir_trusted(path, false)) {
+		warnx("directory of %s is accessible to others, not using it", path);
+		return;
+	}
+
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg)
+		errx(1, "failed to build session request");
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, 0) < 0)
+		err(1, "failed to hand over session");
+
+	/* The session ends when the daemon closes the connection */
+	do {
+		n = read(fd, buf, sizeof(buf));
+	} while (n > 0 || (n < 0 && errno == EINTR));
+
+	exit(0);
+}
+
+static void sigpipe_handler(int signo)
+{
+	watch_quit();
+}
+
+static void atexit_handler(void)
+{
+	syslog(LOG_INFO, "exiting");
+}
+
+static void usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s [-c | -d] [-s <socket>]\n", __progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *socket_path = CDBA_SOCKET_PATH;
+	struct session *session;
+	const char *username;
+	bool shim = false;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "cds:")) != -1) {
+		switch (opt) {
+		case 'c':
+			shim = true;
+			break;
+		case 'd':
+			daemon_mode = true;
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	fprintf(stderr, "Starting cdba server\n");
+
+	username = getenv("CDBA_USER");
+	if (!username)
+		username = getenv("USER");
+	if (!username)
+		username = "nobody";
+
+	if (shim && !daemon_mode)
+		shim_run(socket_path, username);
+
+	openlog("cdba-server", LOG_PID, LOG_DAEMON);
+	atexit(atexit_handler);
+
+	ret = device_parser(".cdba");
+	if (ret) {
+		ret = device_parser("/etc/cdba");
+		if (ret) {
+			fprintf(stderr, "device parser: unable to open config file\n");
+			exit(1);
+		}
+	}
+
+	if (daemon_mode) {
+		/* Failed writes are handled per session */
+		signal(SIGPIPE, SIG_IGN);
+
+		daemon_listen(socket_path);
+
+		return watch_main_loop(NULL) < 0;
+	}
+
+	signal(SIGPIPE, sigpipe_handler);
 
-	flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-	fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+	session = session_new(STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1,
+			      username);
 
 	watch_run();
 
@@ -251,8 +1897,8 @@ int main(int argc, char **argv)
 		dup2(ret, STDERR_FILENO);
 	}
 
-	if (selected_device)
-		device_close(selected_device);
+	if (session->device)
+		device_close(session->device);
 
 	return 0;
 }
@@ -8,5 +8,7 @@
 
 void cdba_send_buf(int type, size_t len, const void *buf);
 #define cdba_send(type) cdba_send_buf(type, 0, NULL)
+bool cdba_output_throttle(int fd, int (*cb)(int, void*), void *data);
+void cdba_boot_phase(int phase, uint64_t value);
 
 #endif
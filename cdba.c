@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <alloca.h>
 #include <err.h>
@@ -23,6 +24,7 @@
 #include "cdba.h"
 #include "circ_buf.h"
 #include "list.h"
+#include "sha256.h"
 
 static bool quit;
 static bool fastboot_repeat;
@@ -33,6 +35,28 @@ static int status_fd = -1;
 
 static const char *fastboot_file;
 
+/* Images to flash, given as -f <partition>:<image>, before booting */
+struct flash_image {
+	const char *partition;
+	const char *path;
+};
+
+static struct flash_image *flash_images;
+static unsigned int flash_count;
+static unsigned int flash_sent;
+static unsigned int flash_acked;
+static bool flash_failed;
+
+/* Fastboot showed up before the board selection, and the version, was known */
+static bool board_selected;
+static bool fastboot_deferred;
+
+/*
+ * Fastboot showing up is taken care of by the server, the boot image having
+ * been uploaded ahead or the board told to continue as planned
+ */
+static bool fastboot_prepared;
+
 static struct termios *tty_unbuffer(void)
 {
 	static struct termios orig_tios;
@@ -123,31 +147,138 @@ static int fork_ssh(const char *host, const char *cmd, int *pipes)
 	return 0;
 }
 
+/* Maximum payload of a frame, as negotiated with the server */
+static size_t max_frame = UINT16_MAX;
+
+/* Protocol version of the server, 0 if it didn't negotiate */
+static uint8_t server_version;
+
+/* Remainder of a partially written message, flushed before sending more */
+static char *tx_pending;
+static size_t tx_pending_len;
+
+/* Stop reading input of the user once this much is waiting to be sent */
+#define TX_PENDING_MAX	(CDBA_MAX_FRAME_SIZE + 64 * 1024)
+
+static int cdba_flush(int fd)
+{
+	ssize_t n;
+
+	if (!tx_pending_len)
+		return 0;
+
+	n = write(fd, tx_pending, tx_pending_len);
+	if (n < 0)
+		return n;
+
+	tx_pending_len -= n;
+	memmove(tx_pending, tx_pending + n, tx_pending_len);
+
+	if (tx_pending_len) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return 0;
+}
+
 #define cdba_send(fd, type) cdba_send_buf(fd, type, 0, NULL)
 static int cdba_send_buf(int fd, int type, size_t len, const void *buf)
 {
+	ssize_t n;
 	int ret;
 
+	struct msg_long long_msg = {
+		.type = type | MSG_LONG,
+		.len = len
+	};
 	struct msg msg = {
 		.type = type,
 		.len = len
 	};
+	struct iovec iov[2] = {
+		{ .iov_base = &msg, .iov_len = sizeof(msg) },
+		{ .iov_base = (void *)buf, .iov_len = len },
+	};
+
+	if (len > max_frame)
+		errx(1, "message of %zu bytes exceeds maximum frame size", len);
+
+	if (len > UINT16_MAX) {
+		iov[0].iov_base = &long_msg;
+		iov[0].iov_len = sizeof(long_msg);
+	}
 
-	ret = write(fd, &msg, sizeof(msg));
+	ret = cdba_flush(fd);
 	if (ret < 0)
 		return ret;
 
+	/* A single writev() keeps header and payload together on the pipe */
+	n = writev(fd, iov, 2);
+	if (n < 0)
+		return n;
+
+	/* Hold on to the remainder, messages must not be interleaved */
+	if (n < iov[0].iov_len + len) {
+		tx_pending = realloc(tx_pending, iov[0].iov_len + len - n);
+		if (!tx_pending)
+			err(1, "failed to allocate transmit buffer");
+
+		if (n < iov[0].iov_len) {
+			memcpy(tx_pending, (char *)iov[0].iov_base + n, iov[0].iov_len - n);
+			memcpy(tx_pending + iov[0].iov_len - n, buf, len);
+		} else {
+			memcpy(tx_pending, (const char *)buf + n - iov[0].iov_len,
+			       iov[0].iov_len + len - n);
+		}
+
+		tx_pending_len = iov[0].iov_len + len - n;
+	}
+
+	return 0;
+}
+
+/*
+ * Send a message, or append it to the remainder of a partially written one,
+ * rather than failing as cdba_send_buf() does while the pipe is congested.
+ */
+#define cdba_queue(fd, type) cdba_queue_buf(fd, type, 0, NULL)
+static int cdba_queue_buf(int fd, int type, size_t len, const void *buf)
+{
+	struct msg msg = {
+		.type = type,
+		.len = len
+	};
+	char *p;
+	int ret;
+
+	if (!tx_pending_len) {
+		ret = cdba_send_buf(fd, type, len, buf);
+		if (ret == 0 || errno != EAGAIN)
+			return ret;
+	}
+
+	p = realloc(tx_pending, tx_pending_len + sizeof(msg) + len);
+	if (!p)
+		err(1, "failed to allocate transmit buffer");
+
+	memcpy(p + tx_pending_len, &msg, sizeof(msg));
 	if (len)
-		ret = write(fd, buf, len);
+		memcpy(p + tx_pending_len + sizeof(msg), buf, len);
 
-	return ret < 0 ? ret : 0;
+	tx_pending = p;
+	tx_pending_len += sizeof(msg) + len;
+
+	return 0;
 }
 
 static int tty_callback(int *ssh_fds)
 {
 	static const char ctrl_a = 0x1;
 	static bool special;
-	char buf[32];
+	char out[4096];
+	char buf[4096];
+	size_t len = 0;
 	ssize_t k;
 	ssize_t n;
 
@@ -155,43 +286,55 @@ static int tty_callback(int *ssh_fds)
 	if (n < 0)
 		return n;
 
+	/* Plain input is gathered in @out and sent as one message */
 	for (k = 0; k < n; k++) {
 		if (buf[k] == ctrl_a) {
 			special = true;
 		} else if (special) {
+			special = false;
+
+			if (buf[k] == 'a') {
+				out[len++] = ctrl_a;
+				continue;
+			}
+
+			/* Send preceding input before acting on the command */
+			if (len) {
+				cdba_queue_buf(ssh_fds[0], MSG_CONSOLE, len, out);
+				len = 0;
+			}
+
 			switch (buf[k]) {
 			case 'q':
 				quit = true;
 				break;
 			case 'P':
-				cdba_send(ssh_fds[0], MSG_POWER_ON);
+				cdba_queue(ssh_fds[0], MSG_POWER_ON);
 				break;
 			case 'p':
-				cdba_send(ssh_fds[0], MSG_POWER_OFF);
+				cdba_queue(ssh_fds[0], MSG_POWER_OFF);
 				break;
 			case 's':
-				cdba_send(ssh_fds[0], MSG_STATUS_UPDATE);
+				cdba_queue(ssh_fds[0], MSG_STATUS_UPDATE);
 				break;
 			case 'V':
-				cdba_send(ssh_fds[0], MSG_VBUS_ON);
+				cdba_queue(ssh_fds[0], MSG_VBUS_ON);
 				break;
 			case 'v':
-				cdba_send(ssh_fds[0], MSG_VBUS_OFF);
-				break;
-			case 'a':
-				cdba_send_buf(ssh_fds[0], MSG_CONSOLE, 1, &ctrl_a);
+				cdba_queue(ssh_fds[0], MSG_VBUS_OFF);
 				break;
 			case 'B':
-				cdba_send(ssh_fds[0], MSG_SEND_BREAK);
+				cdba_queue(ssh_fds[0], MSG_SEND_BREAK);
 				break;
 			}
-
-			special = false;
 		} else {
-			cdba_send_buf(ssh_fds[0], MSG_CONSOLE, 1, buf + k);
+			out[len++] = buf[k];
 		}
 	}
 
+	if (len)
+		cdba_queue_buf(ssh_fds[0], MSG_CONSOLE, len, out);
+
 	return 0;
 }
 
@@ -260,20 +403,88 @@ struct select_board {
 	const char *board;
 };
 
+/* Board or pool requested by the user */
+static const char *requested_board;
+
+static void session_plan_prepare(struct msg_session_plan *plan);
+static void session_plan_digest(void);
+
 static void select_board_fn(struct work *work, int ssh_stdin)
 {
 	struct select_board *board = container_of(work, struct select_board, work);
+	struct msg_select_board_proto proto = {
+		.version = CDBA_PROTOCOL_VERSION,
+		.max_frame = CDBA_MAX_FRAME_SIZE,
+	};
+	struct msg_session_plan plan = {};
+	size_t len = strlen(board->board) + 1;
+	char *buf;
 	int ret;
 
+	session_plan_prepare(&plan);
+
+	/* Offer protocol negotiation after the board name, followed by the plan */
+	buf = alloca(len + sizeof(proto) + sizeof(plan));
+	memcpy(buf, board->board, len);
+	memcpy(buf + len, &proto, sizeof(proto));
+	memcpy(buf + len + sizeof(proto), &plan, sizeof(plan));
+
 	ret = cdba_send_buf(ssh_stdin, MSG_SELECT_BOARD,
-			    strlen(board->board) + 1,
-			    board->board);
+			    len + sizeof(proto) + sizeof(plan), buf);
 	if (ret < 0)
 		err(1, "failed to send power on request");
 
+	/* Hash the image while the server selects, and waits for, the board */
+	session_plan_digest();
+
 	free(work);
 }
 
+static void handle_select_board(const void *data, size_t len)
+{
+	struct msg_select_board_proto proto;
+	const char *selected;
+
+	/* Older servers don't negotiate, stick to struct msg framing */
+	if (len < sizeof(proto))
+		return;
+
+	memcpy(&proto, data, sizeof(proto));
+
+	server_version = proto.version;
+	max_frame = MIN(proto.max_frame, CDBA_MAX_FRAME_SIZE);
+
+	selected = (const char *)data + sizeof(proto);
+	len -= sizeof(proto);
+
+	/* Report the board picked from the requested pool */
+	if (len && strnlen(selected, len) < len && strcmp(selected, requested_board))
+		fprintf(stderr, "selected board %s\n", selected);
+}
+
+static void handle_boot_phase(const void *data, size_t len)
+{
+	struct msg_boot_phase msg;
+
+	if (len < sizeof(msg))
+		return;
+
+	memcpy(&msg, data, sizeof(msg));
+
+	if (msg.phase == BOOT_PHASE_DOWNLOAD_DONE) {
+		fprintf(stderr, "%s at %llu.%03llus, %llu kB/s\n",
+			boot_phase_name(msg.phase),
+			(unsigned long long)msg.time / 1000000,
+			(unsigned long long)msg.time / 1000 % 1000,
+			(unsigned long long)msg.value / 1024);
+	} else {
+		fprintf(stderr, "%s at %llu.%03llus\n",
+			boot_phase_name(msg.phase),
+			(unsigned long long)msg.time / 1000000,
+			(unsigned long long)msg.time / 1000 % 1000);
+	}
+}
+
 static void request_select_board(const char *board)
 {
 	struct select_board *work;
@@ -281,6 +492,7 @@ static void request_select_board(const char *board)
 	work = malloc(sizeof(*work));
 	work->work.fn = select_board_fn;
 	work->board = board;
+	requested_board = board;
 
 	list_add(&work_items, &work->work.node);
 }
@@ -333,25 +545,73 @@ static void request_fastboot_continue(void)
 	list_add(&work_items, &work.node);
 }
 
+/* Upload of the boot image, or if @partition is set an image to be flashed */
 struct fastboot_download_work {
 	struct work work;
 
-	void *data;
+	const char *path;
+	const char *partition;
+
+	int fd;
+	bool size_sent;
 	size_t offset;
 	size_t size;
 };
 
+/* Chunk size used unless larger frames have been negotiated */
+#define FASTBOOT_CHUNK_SIZE	2048
+
+static void request_fastboot_flash(void);
+
 static void fastboot_work_fn(struct work *_work, int ssh_stdin)
 {
 	struct fastboot_download_work *work = container_of(_work, struct fastboot_download_work, work);
+	static char buf[CDBA_MAX_FRAME_SIZE];
+	struct msg_fastboot_flash flash = {};
+	size_t chunk_size = FASTBOOT_CHUNK_SIZE;
+	uint32_t size;
 	ssize_t left;
+	ssize_t n;
 	int ret;
 
-	left = MIN(2048, work->size - work->offset);
+	/* Servers predating negotiation take the image without its size */
+	if (!server_version && !work->partition)
+		work->size_sent = true;
 
-	ret = cdba_send_buf(ssh_stdin, MSG_FASTBOOT_DOWNLOAD,
-			    left,
-			    (char *)work->data + work->offset);
+	if (!work->size_sent) {
+		if (work->partition) {
+			flash.size = work->size;
+			strncpy(flash.partition, work->partition,
+				sizeof(flash.partition) - 1);
+
+			ret = cdba_send_buf(ssh_stdin, MSG_FASTBOOT_FLASH,
+					    sizeof(flash), &flash);
+		} else {
+			size = work->size;
+
+			ret = cdba_send_buf(ssh_stdin, MSG_FASTBOOT_DOWNLOAD_SIZE,
+					    sizeof(size), &size);
+		}
+		if (ret < 0 && errno == EAGAIN) {
+			list_add(&work_items, &_work->node);
+			return;
+		} else if (ret < 0) {
+			err(1, "failed to write fastboot message");
+		}
+
+		work->size_sent = true;
+	}
+
+	if (max_frame > UINT16_MAX)
+		chunk_size = max_frame;
+
+	left = MIN(chunk_size, work->size - work->offset);
+
+	n = pread(work->fd, buf, left, work->offset);
+	if (n != left)
+		err(1, "failed to read \"%s\"", work->path);
+
+	ret = cdba_send_buf(ssh_stdin, MSG_FASTBOOT_DOWNLOAD, left, buf);
 	if (ret < 0 && errno == EAGAIN) {
 		list_add(&work_items, &_work->node);
 		return;
@@ -362,13 +622,82 @@ static void fastboot_work_fn(struct work *_work, int ssh_stdin)
 	work->offset += left;
 
 	/* We've sent the entire image, and a zero length packet */
-	if (!left)
+	if (!left) {
+		/* The server holds the next image until this one is written */
+		if (work->partition && flash_sent < flash_count)
+			request_fastboot_flash();
+
+		close(work->fd);
 		free(work);
-	else
+	} else {
 		list_add(&work_items, &_work->node);
+	}
 }
 
-static void request_fastboot_files(void)
+static struct fastboot_download_work *fastboot_pending_download;
+
+/* Image looked up as part of the session plan, until the server's version is known */
+static struct fastboot_download_work *fastboot_planned_download;
+
+/* Digest of the boot image, valid for as long as the file is unchanged */
+static struct msg_fastboot_cache_lookup fastboot_digest;
+static struct stat fastboot_digest_sb;
+static bool fastboot_digested;
+
+/*
+ * The boot image is hashed once, as the session is planned, and the digest
+ * reused for the cache lookups of later boots unless the file has changed.
+ */
+static const struct msg_fastboot_cache_lookup *
+fastboot_download_digest(struct fastboot_download_work *work)
+{
+	struct stat *prev = &fastboot_digest_sb;
+	struct sha256_ctx sha;
+	struct stat sb;
+	char buf[65536];
+	size_t offset;
+	ssize_t n;
+
+	if (fstat(work->fd, &sb) < 0)
+		err(1, "failed to stat \"%s\"", fastboot_file);
+
+	if (fastboot_digested && sb.st_dev == prev->st_dev &&
+	    sb.st_ino == prev->st_ino && sb.st_size == prev->st_size &&
+	    sb.st_mtim.tv_sec == prev->st_mtim.tv_sec &&
+	    sb.st_mtim.tv_nsec == prev->st_mtim.tv_nsec)
+		return &fastboot_digest;
+
+	sha256_init(&sha);
+	for (offset = 0; offset < work->size; offset += n) {
+		n = pread(work->fd, buf, sizeof(buf), offset);
+		if (n <= 0)
+			err(1, "failed to read \"%s\"", fastboot_file);
+
+		sha256_update(&sha, buf, n);
+	}
+	sha256_final(&sha, fastboot_digest.sha256);
+
+	fastboot_digest.size = work->size;
+	fastboot_digest_sb = sb;
+	fastboot_digested = true;
+
+	return &fastboot_digest;
+}
+
+static void fastboot_cache_lookup_fn(struct work *_work, int ssh_stdin)
+{
+	const struct msg_fastboot_cache_lookup *lookup;
+	int ret;
+
+	lookup = fastboot_download_digest(fastboot_pending_download);
+
+	ret = cdba_send_buf(ssh_stdin, MSG_FASTBOOT_CACHE_LOOKUP,
+			    sizeof(*lookup), lookup);
+	if (ret < 0)
+		err(1, "failed to send fastboot cache lookup");
+}
+
+static struct fastboot_download_work *fastboot_download_new(void)
 {
 	struct fastboot_download_work *work;
 	struct stat sb;
@@ -376,21 +705,174 @@ static void request_fastboot_files(void)
 
 	work = calloc(1, sizeof(*work));
 	work->work.fn = fastboot_work_fn;
+	work->path = fastboot_file;
 
 	fd = open(fastboot_file, O_RDONLY);
 	if (fd < 0)
 		err(1, "failed to open \"%s\"", fastboot_file);
 
 	fstat(fd, &sb);
+	if (sb.st_size > UINT32_MAX)
+		errx(1, "\"%s\" is too large for fastboot", fastboot_file);
 
+	work->fd = fd;
+	work->size = sb.st_size;
+
+	return work;
+}
+
+static void request_fastboot_files(void)
+{
+	static struct work lookup_work = { fastboot_cache_lookup_fn };
+	struct fastboot_download_work *work;
+
+	/* Planned for a server which turned out not to support it */
+	work = fastboot_planned_download;
+	if (work)
+		fastboot_planned_download = NULL;
+	else
+		work = fastboot_download_new();
+
+	/* Servers predating negotiation have no image cache */
+	if (!server_version) {
+		list_add(&work_items, &work->work.node);
+		return;
+	}
+
+	/* Ask the server if it has the image cached before uploading it */
+	fastboot_pending_download = work;
+	list_add(&work_items, &lookup_work.node);
+}
+
+static void handle_fastboot_cache_lookup(const void *data, size_t len)
+{
+	struct fastboot_download_work *work = fastboot_pending_download;
+	const uint8_t *hit = data;
+
+	if (!work)
+		return;
+
+	fastboot_pending_download = NULL;
+
+	if (len && *hit) {
+		close(work->fd);
+		free(work);
+	} else {
+		list_add(&work_items, &work->work.node);
+	}
+}
+
+static void session_plan_prepare(struct msg_session_plan *plan)
+{
+	if (status_fd >= 0)
+		plan->flags |= SESSION_PLAN_STATUS_UPDATE;
+
+	plan->flags |= SESSION_PLAN_POWER_ON;
+
+	/* Booting waits for the partitions to be flashed */
+	if (flash_count)
+		return;
+
+	/* Looked up once the board is selected, see select_board_fn() */
+	if (fastboot_file) {
+		fastboot_planned_download = fastboot_download_new();
+	} else if (fastboot_continue) {
+		plan->flags |= SESSION_PLAN_CONTINUE;
+	}
+}
+
+static void session_plan_digest(void)
+{
+	if (fastboot_planned_download)
+		fastboot_download_digest(fastboot_planned_download);
+}
+
+/* The server has carried out the plan, pick up from where it left off */
+static void handle_session_plan(void)
+{
+	if (fastboot_planned_download) {
+		/* Upload the image while the board is powering on */
+		request_fastboot_files();
+		fastboot_prepared = true;
+	} else if (fastboot_continue && !flash_count) {
+		fastboot_continue = false;
+		fastboot_prepared = true;
+	}
+}
+
+static void request_fastboot_flash(void)
+{
+	struct flash_image *image = &flash_images[flash_sent++];
+	struct fastboot_download_work *work;
+	struct stat sb;
+	int fd;
+
+	if (server_version < 3)
+		errx(1, "server doesn't support flashing partitions");
+
+	fd = open(image->path, O_RDONLY);
+	if (fd < 0)
+		err(1, "failed to open \"%s\"", image->path);
+
+	fstat(fd, &sb);
+
+	work = calloc(1, sizeof(*work));
+	work->work.fn = fastboot_work_fn;
+	work->path = image->path;
+	work->partition = image->partition;
+	work->fd = fd;
 	work->size = sb.st_size;
-	work->data = malloc(work->size);
-	read(fd, work->data, work->size);
-	close(fd);
 
 	list_add(&work_items, &work->work.node);
 }
 
+static void handle_fastboot_flash(const void *data, size_t len)
+{
+	const uint8_t *failed = data;
+	const char *partition;
+
+	if (flash_acked == flash_count)
+		return;
+
+	partition = flash_images[flash_acked++].partition;
+
+	if (!len || *failed) {
+		fprintf(stderr, "failed to flash %s\n", partition);
+		flash_failed = true;
+		quit = true;
+		return;
+	}
+
+	if (flash_acked < flash_count)
+		return;
+
+	/* All images are written, proceed with booting */
+	if (fastboot_file) {
+		request_fastboot_files();
+	} else {
+		request_fastboot_continue();
+		fastboot_continue = false;
+	}
+}
+
+static void handle_fastboot_present(void)
+{
+	if (flash_count && !flash_sent) {
+		request_fastboot_flash();
+	} else if (flash_acked < flash_count) {
+		/* Booting proceeds once all images are flashed */
+	} else if (fastboot_continue) {
+		request_fastboot_continue();
+		fastboot_continue = false;
+	} else if (fastboot_prepared) {
+		fastboot_prepared = false;
+	} else if (!fastboot_done || fastboot_repeat) {
+		request_fastboot_files();
+	} else {
+		quit = true;
+	}
+}
+
 static void handle_status_update(const void *data, size_t len)
 {
 	if (status_fd < 0)
@@ -408,7 +890,6 @@ static void status_enable_fn(struct work *work, int ssh_stdin)
 
 static void status_pipe_open(const char *path)
 {
-	struct work *work;
 	int ret;
 	int fd;
 
@@ -421,8 +902,16 @@ static void status_pipe_open(const char *path)
 		err(1, "failed to open fifo %s", path);
 
 	status_fd = fd;
+}
+
+/* Status updates are enabled by the session plan of newer servers */
+static void request_status_enable(void)
+{
+	struct work *work;
+
+	if (status_fd < 0)
+		return;
 
-	/* Queue a MSG_STATUS_UPDATE request */
 	work = malloc(sizeof(*work));
 	work->fn = status_enable_fn;
 
@@ -483,32 +972,100 @@ static void handle_console(const void *data, size_t len)
 
 static bool auto_power_on;
 
-static int handle_message(struct circ_buf *buf)
+/* Delay, in seconds, between powering off and on during power cycles */
+#define POWER_CYCLE_DELAY	2
+
+static bool power_on_pending;
+static struct timeval power_on_tv;
+
+/**
+ * msg_peek() - parse the header of the next message
+ * @buf:	receive buffer
+ * @type:	message type
+ * @len:	payload length
+ *
+ * Return: size of the header, or 0 if the message isn't fully received
+ */
+static size_t msg_peek(struct circ_buf *buf, int *type, size_t *len)
 {
-	struct msg *msg;
-	struct msg hdr;
-	size_t n;
+	struct msg_long *long_hdr;
+	struct msg *hdr;
+	size_t hdr_len;
 
-	for (;;) {
-		n = circ_peak(buf, &hdr, sizeof(hdr));
-		if (n != sizeof(hdr))
+	if (CIRC_AVAIL(buf) < sizeof(*hdr))
+		return 0;
+
+	hdr = circ_data(buf);
+	if (hdr->type & MSG_LONG) {
+		if (CIRC_AVAIL(buf) < sizeof(*long_hdr))
 			return 0;
 
-		if (CIRC_AVAIL(buf) < sizeof(*msg) + hdr.len)
+		long_hdr = circ_data(buf);
+		*type = long_hdr->type & ~MSG_LONG;
+		*len = long_hdr->len;
+		hdr_len = sizeof(*long_hdr);
+	} else {
+		*type = hdr->type;
+		*len = hdr->len;
+		hdr_len = sizeof(*hdr);
+	}
+
+	if (*len > max_frame)
+		errx(1, "message of %zu bytes exceeds maximum frame size", *len);
+
+	/* Make room for the entire message */
+	circ_reserve(buf, hdr_len + *len);
+
+	if (CIRC_AVAIL(buf) < hdr_len + *len)
+		return 0;
+
+	return hdr_len;
+}
+
+static int handle_message(struct circ_buf *buf)
+{
+	size_t hdr_len;
+	char *data;
+	size_t len;
+	int type;
+
+	for (;;) {
+		hdr_len = msg_peek(buf, &type, &len);
+		if (!hdr_len)
 			return 0;
 
-		// fprintf(stderr, "avail: %zd hdr.len: %d\n", CIRC_AVAIL(buf), hdr.len);
+		// fprintf(stderr, "avail: %zd len: %zu\n", CIRC_AVAIL(buf), len);
 
-		msg = malloc(sizeof(*msg) + hdr.len);
-		circ_read(buf, msg, sizeof(*msg) + hdr.len);
+		/* Consumed up front, the data remains valid until the next fill */
+		data = (char *)circ_data(buf) + hdr_len;
+		circ_consume(buf, hdr_len + len);
 
-		switch (msg->type) {
+		switch (type) {
 		case MSG_SELECT_BOARD:
 			// printf("======================================== MSG_SELECT_BOARD\n");
-			request_power_on();
+			handle_select_board(data, len);
+			board_selected = true;
+
+			if (server_version >= 5) {
+				handle_session_plan();
+			} else {
+				request_status_enable();
+				request_power_on();
+
+				/* Upload the image while the board is powering on */
+				if (server_version >= 4 && fastboot_file && !flash_count) {
+					request_fastboot_files();
+					fastboot_prepared = true;
+				}
+			}
+
+			if (fastboot_deferred) {
+				fastboot_deferred = false;
+				handle_fastboot_present();
+			}
 			break;
 		case MSG_CONSOLE:
-			handle_console(msg->data, msg->len);
+			handle_console(data, len);
 			break;
 		case MSG_HARDRESET:
 			break;
@@ -518,21 +1075,19 @@ static int handle_message(struct circ_buf *buf)
 		case MSG_POWER_OFF:
 			// printf("======================================== MSG_POWER_OFF\n");
 			if (auto_power_on) {
-				sleep(2);
-				request_power_on();
+				/* Power on again once the board has powered down */
+				gettimeofday(&power_on_tv, NULL);
+				power_on_tv.tv_sec += POWER_CYCLE_DELAY;
+				power_on_pending = true;
 			}
 			break;
 		case MSG_FASTBOOT_PRESENT:
-			if (*(uint8_t*)msg->data) {
+			if (*(uint8_t*)data) {
 				// printf("======================================== MSG_FASTBOOT_PRESENT(on)\n");
-				if (fastboot_continue) {
-					request_fastboot_continue();
-					fastboot_continue = false;
-				} else if (!fastboot_done || fastboot_repeat) {
-					request_fastboot_files();
-				} else {
-					quit = true;
-				}
+				if (board_selected)
+					handle_fastboot_present();
+				else
+					fastboot_deferred = true;
 			} else {
 				fastboot_done = true;
 				// printf("======================================== MSG_FASTBOOT_PRESENT(off)\n");
@@ -545,24 +1100,31 @@ static int handle_message(struct circ_buf *buf)
 			// printf("======================================== MSG_FASTBOOT_BOOT\n");
 			break;
 		case MSG_STATUS_UPDATE:
-			handle_status_update(msg->data, msg->len);
+			handle_status_update(data, len);
 			break;
 		case MSG_LIST_DEVICES:
-			handle_list_devices(msg->data, msg->len);
+			handle_list_devices(data, len);
 			break;
 		case MSG_BOARD_INFO:
-			handle_board_info(msg->data, msg->len);
+			handle_board_info(data, len);
 			return -1;
 			break;
 		case MSG_FASTBOOT_CONTINUE:
 			// printf("======================================== MSG_FASTBOOT_CONTINUE\n");
 			break;
+		case MSG_FASTBOOT_CACHE_LOOKUP:
+			handle_fastboot_cache_lookup(data, len);
+			break;
+		case MSG_BOOT_PHASE:
+			handle_boot_phase(data, len);
+			break;
+		case MSG_FASTBOOT_FLASH:
+			handle_fastboot_flash(data, len);
+			break;
 		default:
-			fprintf(stderr, "unk %d len %d\n", msg->type, msg->len);
+			fprintf(stderr, "unk %d len %zu\n", type, len);
 			return -1;
 		}
-
-		free(msg);
 	}
 
 	return 0;
@@ -585,7 +1147,8 @@ static void usage(void)
 	extern const char *__progname;
 
 	fprintf(stderr, "usage: %s -b <board> -h <host> [-t <timeout>] "
-			"[-T <inactivity-timeout>] <boot.img>\n",
+			"[-T <inactivity-timeout>] [-f <partition>:<image>]... "
+			"[<boot.img>]\n",
 			__progname);
 	fprintf(stderr, "usage: %s -i -b <board> -h <host>\n",
 			__progname);
@@ -594,6 +1157,32 @@ static void usage(void)
 	exit(1);
 }
 
+static void flash_add(const char *arg)
+{
+	struct msg_fastboot_flash flash;
+	struct flash_image *image;
+	const char *path;
+	struct stat sb;
+
+	path = strchr(arg, ':');
+	if (!path || path == arg || path - arg >= (int)sizeof(flash.partition))
+		errx(1, "expected <partition>:<image>, got \"%s\"", arg);
+
+	path++;
+	if (stat(path, &sb))
+		err(1, "unable to read \"%s\"", path);
+	else if (!S_ISREG(sb.st_mode))
+		errx(1, "\"%s\" is not a regular file", path);
+
+	flash_images = realloc(flash_images, (flash_count + 1) * sizeof(*flash_images));
+	if (!flash_images)
+		err(1, "failed to allocate flash list");
+
+	image = &flash_images[flash_count++];
+	image->partition = strndup(arg, path - arg - 1);
+	image->path = path;
+}
+
 enum {
 	CDBA_BOOT,
 	CDBA_LIST,
@@ -612,9 +1201,10 @@ int main(int argc, char **argv)
 	int timeout_total = 600;
 	struct work *next;
 	struct work *work;
-	struct circ_buf recv_buf = { };
+	static struct circ_buf recv_buf;
 	const char *board = NULL;
 	const char *host = NULL;
+	struct timeval delta;
 	struct timeval now;
 	struct timeval tv;
 	struct stat sb;
@@ -628,7 +1218,7 @@ int main(int argc, char **argv)
 	int opt;
 	int ret;
 
-	while ((opt = getopt(argc, argv, "b:c:C:h:ilRt:S:s:T:")) != -1) {
+	while ((opt = getopt(argc, argv, "b:c:C:f:h:ilRt:S:s:T:")) != -1) {
 		switch (opt) {
 		case 'b':
 			board = optarg;
@@ -639,6 +1229,9 @@ int main(int argc, char **argv)
 		case 'c':
 			power_cycles = atoi(optarg);
 			break;
+		case 'f':
+			flash_add(optarg);
+			break;
 		case 'h':
 			host = optarg;
 			break;
@@ -735,14 +1328,15 @@ int main(int argc, char **argv)
 		FD_SET(ssh_fds[2], &rfds);
 		nfds = MAX(ssh_fds[1], ssh_fds[2]);
 
-		if (orig_tios) {
+		/* Leave input in the tty while the pipe is congested */
+		if (orig_tios && tx_pending_len < TX_PENDING_MAX) {
 			FD_SET(STDIN_FILENO, &rfds);
 
 			nfds = MAX(nfds, STDIN_FILENO);
 		}
 
 		FD_ZERO(&wfds);
-		if (!list_empty(&work_items))
+		if (!list_empty(&work_items) || tx_pending_len)
 			FD_SET(ssh_fds[0], &wfds);
 
 		gettimeofday(&now, NULL);
@@ -752,14 +1346,29 @@ int main(int argc, char **argv)
 			timersub(&timeout_total_tv, &now, &tv);
 		}
 
+		/* Wake up in time for a pending power on */
+		if (power_on_pending) {
+			if (timercmp(&power_on_tv, &now, <))
+				timerclear(&delta);
+			else
+				timersub(&power_on_tv, &now, &delta);
+
+			if (timercmp(&delta, &tv, <))
+				tv = delta;
+		}
+
 		ret = select(nfds + 1, &rfds, &wfds, NULL, &tv);
 #if 0
 		printf("select: %d (%c%c%c)\n", ret, FD_ISSET(STDIN_FILENO, &rfds) ? 'X' : '-',
 						     FD_ISSET(ssh_fds[1], &rfds) ? 'X' : '-',
 						     FD_ISSET(ssh_fds[2], &rfds) ? 'X' : '-');
 #endif
+		gettimeofday(&now, NULL);
 		if (ret < 0) {
 			err(1, "select");
+		} else if (power_on_pending && !timercmp(&now, &power_on_tv, <)) {
+			power_on_pending = false;
+			request_power_on();
 		} else if (ret == 0) {
 			if (timeout_inactivity && timercmp(&timeout_inactivity_tv, &timeout_total_tv, <))
 				warnx("timeout due to inactivity");
@@ -808,11 +1417,15 @@ int main(int argc, char **argv)
 				timeout_inactivity_tv = get_timeout(timeout_inactivity);
 		}
 
-		if (FD_ISSET(ssh_fds[0], &wfds)) {
+		if (FD_ISSET(ssh_fds[0], &wfds) && !cdba_flush(ssh_fds[0])) {
 			list_for_each_entry_safe(work, next, &work_items, node) {
 				list_del(&work->node);
 
 				work->fn(work, ssh_fds[0]);
+
+				/* Wait for the pipe to drain before sending more */
+				if (tx_pending_len)
+					break;
 			}
 		}
 	}
@@ -831,5 +1444,8 @@ int main(int argc, char **argv)
 	if (reached_timeout)
 		return fastboot_done ? 110 : 2;
 
+	if (flash_failed)
+		return 1;
+
 	return (quit || received_power_off) ? 0 : 1;
 }
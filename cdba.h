@@ -14,6 +14,41 @@ struct msg {
 	uint8_t data[];
 } __packed;
 
+/*
+ * Messages with payloads larger than UINT16_MAX are sent with MSG_LONG set in
+ * the type, followed by a 32-bit length. These may only be used once both
+ * peers have negotiated a protocol version and maximum frame size.
+ */
+#define MSG_LONG	0x80
+
+struct msg_long {
+	uint8_t type;
+	uint32_t len;
+	uint8_t data[];
+} __packed;
+
+/*
+ * Version 2 adds MSG_BOOT_PHASE, which is only sent to clients that negotiated
+ * version 2 or later. Version 3 adds MSG_FASTBOOT_FLASH. Version 4 servers
+ * stage a boot image uploaded before fastboot shows up, and download it to the
+ * device once it does. Version 5 adds struct msg_session_plan.
+ */
+#define CDBA_PROTOCOL_VERSION	5
+#define CDBA_MAX_FRAME_SIZE	(256 * 1024)
+
+/*
+ * Appended by the client after the NUL-terminated board name in
+ * MSG_SELECT_BOARD, the server replies with the agreed upon version and
+ * maximum frame size, followed by the NUL-terminated name of the selected
+ * board, which differs from the requested one when a pool was requested.
+ * Older servers ignore the trailing data and reply with an empty message, in
+ * which case only struct msg framing is used.
+ */
+struct msg_select_board_proto {
+	uint8_t version;
+	uint32_t max_frame;
+} __packed;
+
 enum {
 	MSG_SELECT_BOARD = 1,
 	MSG_CONSOLE,
@@ -31,6 +66,102 @@ enum {
 	MSG_LIST_DEVICES,
 	MSG_BOARD_INFO,
 	MSG_FASTBOOT_CONTINUE,
+	MSG_FASTBOOT_DOWNLOAD_SIZE,
+	MSG_FASTBOOT_CACHE_LOOKUP,
+	MSG_BOOT_PHASE,
+	MSG_FASTBOOT_FLASH,
 };
 
+/*
+ * Sent by the client ahead of an image download, the server replies with a
+ * single byte MSG_FASTBOOT_CACHE_LOOKUP, which is non-zero if the image was
+ * found in its cache and is being booted without further upload.
+ */
+struct msg_fastboot_cache_lookup {
+	uint32_t size;
+	uint8_t sha256[32];
+} __packed;
+
+#define SESSION_PLAN_STATUS_UPDATE	0x01
+#define SESSION_PLAN_POWER_ON		0x02
+#define SESSION_PLAN_CACHE_LOOKUP	0x04
+#define SESSION_PLAN_CONTINUE		0x08
+
+/*
+ * Appended by the client after struct msg_select_board_proto, to have the
+ * server carry out the steps of the session that don't depend on replies from
+ * the client as soon as the board is selected. Following the MSG_SELECT_BOARD
+ * reply the server enables status updates, powers on the board and looks up
+ * @image in its cache, as requested by @flags, and replies to each as if it had
+ * been requested separately. With SESSION_PLAN_CONTINUE the board is told to
+ * continue as soon as fastboot shows up. Older servers ignore the plan.
+ */
+struct msg_session_plan {
+	uint8_t flags;
+	struct msg_fastboot_cache_lookup image;
+} __packed;
+
+/*
+ * Sent by the client to flash the image of @size bytes that follows, as
+ * MSG_FASTBOOT_DOWNLOAD messages terminated by an empty one, to the NUL
+ * terminated @partition. Images exceeding the device's max-download-size are
+ * split by the server. Once the image is written the server replies with a
+ * single byte MSG_FASTBOOT_FLASH, which is non-zero if flashing failed.
+ */
+struct msg_fastboot_flash {
+	uint64_t size;
+	char partition[64];
+} __packed;
+
+enum {
+	BOOT_PHASE_LOCK_ACQUIRED,
+	BOOT_PHASE_CONTROLLER_OPENED,
+	BOOT_PHASE_POWER_ON,
+	BOOT_PHASE_FASTBOOT_ENUMERATED,
+	BOOT_PHASE_DOWNLOAD_START,
+	BOOT_PHASE_DOWNLOAD_DONE,
+	BOOT_PHASE_BOOT,
+	BOOT_PHASE_CONSOLE,
+	BOOT_PHASE_POWER_OFF,
+};
+
+/*
+ * Sent by the server as the session reaches each phase of a boot. @time is
+ * the time, in microseconds, since the session was started, measured on
+ * CLOCK_MONOTONIC. @value is the size of the image for
+ * BOOT_PHASE_DOWNLOAD_START and the download throughput, in bytes per second,
+ * for BOOT_PHASE_DOWNLOAD_DONE.
+ */
+struct msg_boot_phase {
+	uint8_t phase;
+	uint64_t time;
+	uint64_t value;
+} __packed;
+
+static inline const char *boot_phase_name(int phase)
+{
+	switch (phase) {
+	case BOOT_PHASE_LOCK_ACQUIRED:
+		return "lock acquired";
+	case BOOT_PHASE_CONTROLLER_OPENED:
+		return "controller opened";
+	case BOOT_PHASE_POWER_ON:
+		return "power on";
+	case BOOT_PHASE_FASTBOOT_ENUMERATED:
+		return "fastboot enumerated";
+	case BOOT_PHASE_DOWNLOAD_START:
+		return "download started";
+	case BOOT_PHASE_DOWNLOAD_DONE:
+		return "download finished";
+	case BOOT_PHASE_BOOT:
+		return "boot acknowledged";
+	case BOOT_PHASE_CONSOLE:
+		return "first console output";
+	case BOOT_PHASE_POWER_OFF:
+		return "power off requested";
+	default:
+		return "unknown phase";
+	}
+}
+
 #endif
@@ -4,14 +4,82 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
-
+#define _GNU_SOURCE /* for memfd_create */
+#include <sys/mman.h>
+#include <err.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "circ_buf.h"
 
+/* Map @size bytes of memory twice, back to back */
+static char *circ_map(size_t size)
+{
+	char *base;
+	void *ptr;
+	int fd;
+
+	fd = memfd_create("circ_buf", MFD_CLOEXEC);
+	if (fd < 0)
+		err(1, "failed to create ring buffer");
+
+	if (ftruncate(fd, size) < 0)
+		err(1, "failed to size ring buffer");
+
+	/* Reserve the address space for both mappings */
+	base = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		err(1, "failed to map ring buffer");
+
+	ptr = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	if (ptr == MAP_FAILED)
+		err(1, "failed to map ring buffer");
+
+	ptr = mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	if (ptr == MAP_FAILED)
+		err(1, "failed to map ring buffer");
+
+	close(fd);
+
+	return base;
+}
+
+/**
+ * circ_reserve() - grow circular buffer to hold at least @len bytes
+ * @circ:	circ_buf object to grow
+ * @len:	number of bytes the buffer needs to hold
+ *
+ * Available data is retained, but pointers previously returned by circ_data()
+ * are invalidated if the buffer is grown.
+ */
+void circ_reserve(struct circ_buf *circ, size_t len)
+{
+	size_t avail = CIRC_AVAIL(circ);
+	size_t size = CIRC_BUF_SIZE;
+	char *buf;
+
+	if (circ->buf && len <= circ->size)
+		return;
+
+	while (size < len)
+		size *= 2;
+
+	buf = circ_map(size);
+
+	if (circ->buf) {
+		memcpy(buf, circ_data(circ), avail);
+		munmap(circ->buf, circ->size * 2);
+	}
+
+	circ->buf = buf;
+	circ->size = size;
+	circ->head = avail;
+	circ->tail = 0;
+}
+
 /**
  * circ_fill() - read data into circular buffer
  * @fd:		non-blocking file descriptor to read
@@ -24,55 +92,61 @@ ssize_t circ_fill(int fd, struct circ_buf *circ)
 	ssize_t space;
 	ssize_t n = 0;
 
+	circ_reserve(circ, CIRC_BUF_SIZE);
+
 	do {
-		space = CIRC_SPACE_TO_END(circ);
+		space = CIRC_SPACE(circ);
 		if (!space) {
 			errno = EAGAIN;
 			return -1;
 		}
 
-		n = read(fd, circ->buf + circ->head, space);
+		n = read(fd, circ->buf + (circ->head & (circ->size - 1)), space);
 		if (n == 0) {
 			errno = EPIPE;
 			return -1;
 		} else if (n < 0)
 			return -1;
 
-		circ->head = (circ->head + n) & (CIRC_BUF_SIZE - 1);
+		circ->head += n;
 	} while (n != space);
 
 	return 0;
 }
 
-size_t circ_peak(struct circ_buf *circ, void *buf, size_t len)
+/**
+ * circ_data() - access data in circular buffer
+ * @circ:	circ_buf object to access
+ *
+ * Return: pointer to the CIRC_AVAIL() bytes of data, contiguous in memory,
+ * valid until the next circ_fill() or circ_reserve()
+ */
+void *circ_data(struct circ_buf *circ)
 {
-	size_t tail = circ->tail;
-	char *p = buf;
-
-	while (len--) {
-		if (tail == circ->head)
-			return 0;
-
-		*p++ = circ->buf[tail];
-
-		tail = (tail + 1) & (CIRC_BUF_SIZE - 1);
-	}
-
-	return p - (char *)buf;
+	return circ->buf + (circ->tail & (circ->size - 1));
 }
 
-size_t circ_read(struct circ_buf *circ, void *buf, size_t len)
+/**
+ * circ_consume() - drop data from the circular buffer
+ * @circ:	circ_buf object to consume data from
+ * @len:	number of bytes to drop
+ */
+void circ_consume(struct circ_buf *circ, size_t len)
 {
-	char *p = buf;
-
-	while (len--) {
-		if (circ->tail == circ->head)
-			return 0;
-
-		*p++ = circ->buf[circ->tail];
+	circ->tail += MIN(len, CIRC_AVAIL(circ));
+}
 
-		circ->tail = (circ->tail + 1) & (CIRC_BUF_SIZE - 1);
-	}
+/**
+ * circ_release() - free the memory of the circular buffer
+ * @circ:	circ_buf object to release
+ */
+void circ_release(struct circ_buf *circ)
+{
+	if (circ->buf)
+		munmap(circ->buf, circ->size * 2);
 
-	return p - (char *)buf;
+	circ->buf = NULL;
+	circ->size = 0;
+	circ->head = 0;
+	circ->tail = 0;
 }
@@ -13,21 +13,28 @@
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #endif
 
-#define CIRC_BUF_SIZE 16384
+/* Initial size of the buffer, grown on demand by circ_reserve() */
+#define CIRC_BUF_SIZE (64 * 1024)
 
+/*
+ * The buffer is mapped twice, back to back, so that the available data always
+ * can be accessed contiguously from circ_data(). @head and @tail are free
+ * running and masked when used to index @buf.
+ */
 struct circ_buf {
-	char buf[CIRC_BUF_SIZE];
+	char *buf;
+	size_t size;
 	size_t head;
 	size_t tail;
 };
 
-#define CIRC_AVAIL(circ) (((circ)->head - (circ)->tail) & (CIRC_BUF_SIZE - 1))
-#define CIRC_SPACE(circ) (((circ)->tail - (circ)->head - 1) & (CIRC_BUF_SIZE - 1))
-
-#define CIRC_SPACE_TO_END(circ) MIN(CIRC_SPACE(circ), CIRC_BUF_SIZE - (circ)->head)
+#define CIRC_AVAIL(circ) ((circ)->head - (circ)->tail)
+#define CIRC_SPACE(circ) ((circ)->size - CIRC_AVAIL(circ))
 
 ssize_t circ_fill(int fd, struct circ_buf *circ);
-size_t circ_peak(struct circ_buf *circ, void *buf, size_t len);
-size_t circ_read(struct circ_buf *circ, void *buf, size_t len);
+void circ_reserve(struct circ_buf *circ, size_t len);
+void *circ_data(struct circ_buf *circ);
+void circ_consume(struct circ_buf *circ, size_t len);
+void circ_release(struct circ_buf *circ);
 
 #endif
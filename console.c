@@ -8,6 +8,8 @@
 #include <sys/stat.h>
 
 #include <err.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -19,19 +21,33 @@
 struct console {
 	int console_fd;
 	struct termios console_tios;
+	bool hung_up;
 };
 
 static int console_data(int fd, void *data)
 {
+	struct device *device = data;
+	struct console *console = device->console;
 	char buf[128];
 	ssize_t n;
 
 	n = read(fd, buf, sizeof(buf));
-	if (n < 0)
-		return n;
-
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	/* Stop reading a hung up tty, rather than spinning on it */
+	if (n <= 0) {
+		warnx("console %s hung up", device->console_dev);
+		watch_del_readfd(fd);
+		console->hung_up = true;
+		return 0;
+	}
+
+	cdba_boot_phase(BOOT_PHASE_CONSOLE, 0);
 	cdba_send_buf(MSG_CONSOLE, n, buf);
 
+	cdba_output_throttle(fd, console_data, data);
+
 	return 0;
 }
 
@@ -49,6 +65,18 @@ static void *console_open(struct device *device)
 	return console;
 }
 
+/* Give a console that hung up in an earlier session another chance */
+static void console_acquire(struct device *device)
+{
+	struct console *console = device->console;
+
+	if (!console->hung_up)
+		return;
+
+	console->hung_up = false;
+	watch_add_readfd(console->console_fd, console_data, device);
+}
+
 static int console_write(struct device *device, const void *buf, size_t len)
 {
 	struct console *console = device->console;
@@ -67,4 +95,5 @@ const struct console_ops console_ops = {
 	.open = console_open,
 	.write = console_write,
 	.send_break = console_send_break,
+	.acquire = console_acquire,
 };
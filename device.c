@@ -4,8 +4,6 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
-#include <sys/file.h>
-#include <sys/stat.h>
 
 #include <assert.h>
 #include <err.h>
@@ -16,7 +14,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <time.h>
 
+#include "board_lock.h"
 #include "cdba-server.h"
 #include "device.h"
 #include "fastboot.h"
@@ -46,41 +46,6 @@ void device_add(struct device *device)
 	list_add(&devices, &device->node);
 }
 
-static void device_lock(struct device *device)
-{
-	char lock[PATH_MAX];
-	int fd;
-	int n;
-
-	n = snprintf(lock, sizeof(lock), "/tmp/cdba-%s.lock", device->board);
-	if (n >= (int)sizeof(lock))
-		errx(1, "failed to build lockfile path");
-
-	fd = open(lock, O_RDONLY | O_CREAT, 0666);
-	if (fd >= 0)
-		close(fd);
-
-	fd = open(lock, O_RDONLY | O_CLOEXEC);
-	if (fd < 0)
-		err(1, "failed to open lockfile %s", lock);
-
-	while (1) {
-		char c;
-
-		n = flock(fd, LOCK_EX | LOCK_NB);
-		if (!n)
-			return;
-
-		warnx("board is in use, waiting...");
-
-		sleep(3);
-
-		/* check that connection isn't gone */
-		if (read(STDIN_FILENO, &c, 1) == 0)
-			errx(1, "connection is gone");
-	}
-}
-
 static bool device_check_access(struct device *device,
 				const char *username)
 {
@@ -102,8 +67,14 @@ static bool device_check_access(struct device *device,
 
 static int device_power_off(struct device *device);
 
-struct device *device_open(const char *board,
-			   const char *username)
+/**
+ * device_lookup() - find a board the user has access to
+ * @board:	name of the board
+ * @username:	user requesting the board
+ *
+ * Return: the device, or NULL if not found or access is denied
+ */
+struct device *device_lookup(const char *board, const char *username)
 {
 	struct device *device;
 
@@ -122,23 +93,70 @@ found:
 		return NULL;
 	}
 
-	syslog(LOG_INFO, "user %s opening board %s", username, board);
+	return device;
+}
 
-	assert(device->console_ops);
-	assert(device->console_ops->open);
-	assert(device->console_ops->write);
+/**
+ * device_pool_next() - iterate over the boards of a pool
+ * @pool:	name of the pool
+ * @username:	user requesting a board
+ * @prev:	previous board of the pool, or NULL to start from the first
+ *
+ * Return: the next board of @pool the user has access to, or NULL
+ */
+struct device *device_pool_next(const char *pool, const char *username,
+				struct device *prev)
+{
+	struct device *device;
 
-	device_lock(device);
+	device = prev ? list_entry_next(prev, node) :
+			list_entry_first(&devices, struct device, node);
 
-	if (device_has_control(device, open)) {
-		device->cdb = device_control(device, open);
-		if (!device->cdb)
-			errx(1, "failed to open device controller");
+	for (; &device->node != &devices; device = list_entry_next(device, node)) {
+		if (device->pool && !strcmp(device->pool, pool) &&
+		    device_check_access(device, username))
+			return device;
 	}
 
-	device->console = device_console(device, open);
-	if (!device->console)
-		errx(1, "failed to open device console");
+	return NULL;
+}
+
+/**
+ * device_acquire() - prepare a locked device for a new session
+ * @device:	device to acquire
+ * @lock:	held lock of the device, released with the device
+ *
+ * The device's drivers are opened the first time it's acquired, and are kept
+ * open when the device is released again. Watches and timers of the drivers
+ * use the device's session as context.
+ */
+void device_acquire(struct device *device, struct board_lock *lock)
+{
+	void **ctx;
+
+	device->lock = lock;
+
+	ctx = watch_set_context(&device->session);
+
+	if (!device->opened) {
+		assert(device->console_ops);
+		assert(device->console_ops->open);
+		assert(device->console_ops->write);
+
+		if (device_has_control(device, open)) {
+			device->cdb = device_control(device, open);
+			if (!device->cdb)
+				errx(1, "failed to open device controller");
+		}
+
+		device->console = device_console(device, open);
+		if (!device->console)
+			errx(1, "failed to open device console");
+
+		device->opened = true;
+	} else if (device_has_console(device, acquire)) {
+		device_console(device, acquire);
+	}
 
 	/*
 	 * Power off before opening fastboot. Otherwise if the device is
@@ -149,24 +167,120 @@ found:
 	 * */
 	if (device->power_always_on) {
 		device_power_off(device);
-		sleep(2);
+		device_settle(device, 2000);
 	}
 
 	if (device->usb_always_on)
 		device_usb(device, true);
 
+	watch_set_context(ctx);
+}
+
+struct device *device_open(const char *board,
+			   const char *username)
+{
+	struct board_lock *lock = NULL;
+	struct device *device;
+	struct device *dev;
+
+	/* Take the first free board of a pool, or queue up for the first */
+	device = device_pool_next(board, username, NULL);
+	for (dev = device; dev; dev = device_pool_next(board, username, dev)) {
+		lock = board_lock_try(dev->board, username);
+		if (lock) {
+			device = dev;
+			break;
+		}
+	}
+
+	if (!device)
+		device = device_lookup(board, username);
+	if (!device)
+		return NULL;
+
+	syslog(LOG_INFO, "user %s opening board %s", username, device->board);
+
+	if (!lock)
+		lock = board_lock_wait(device->board, username);
+	if (!lock)
+		return NULL;
+
+	device_acquire(device, lock);
+
 	return device;
 }
 
+/*
+ * Control changes made between device_batch_begin() and device_batch_end()
+ * are applied at once, for drivers supporting it, e.g. in a single USB
+ * transaction for GPIOs on the same FTDI interface.
+ */
+static void device_batch_begin(struct device *device)
+{
+	device->control_batch++;
+}
+
+static void device_flush(struct device *device)
+{
+	if (!device->control_batch && device_has_control(device, flush))
+		device_control(device, flush);
+}
+
+static void device_batch_end(struct device *device)
+{
+	device->control_batch--;
+	device_flush(device);
+}
+
 static void device_impl_power(struct device *device, bool on)
 {
 	device_control(device, power, on);
+	device_flush(device);
 }
 
 static void device_key(struct device *device, int key, bool asserted)
 {
-	if (device_has_control(device, key))
+	if (device_has_control(device, key)) {
 		device_control(device, key, key, asserted);
+		device_flush(device);
+	}
+}
+
+static uint64_t device_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * device_settle() - keep the device powered off for a while
+ * @device:	device that was just powered off
+ * @delay_ms:	default delay, overridden by the board's "power_off_delay"
+ *
+ * Powering on the device and opening fastboot are deferred until the delay
+ * has passed, giving the board time to power down without blocking.
+ */
+void device_settle(struct device *device, unsigned int delay_ms)
+{
+	uint64_t until;
+
+	if (device->power_off_delay >= 0)
+		delay_ms = device->power_off_delay;
+
+	until = device_now_ms() + delay_ms;
+	if (until > device->settle_until)
+		device->settle_until = until;
+}
+
+/* Returns the number of milliseconds the device should remain powered off */
+static unsigned int device_settle_remaining(struct device *device)
+{
+	uint64_t now = device_now_ms();
+
+	return now < device->settle_until ? device->settle_until - now : 0;
 }
 
 enum {
@@ -178,32 +292,63 @@ enum {
 	DEVICE_STATE_RUNNING,
 };
 
+static void device_tick(void *data);
+
+/*
+ * Hold the fastboot key until the board's fastboot interface shows up, with
+ * fastboot_key_timeout as upper bound.
+ */
+static void device_hold_fastboot_key(struct device *device)
+{
+	unsigned int timeout = device->fastboot_key_timeout * 1000;
+
+	device->state = DEVICE_STATE_RELEASE_FASTBOOT;
+	device->tick_timer = watch_timer_add(device->fastboot_enumerated ? 0 : timeout,
+					     device_tick, device);
+}
+
 static void device_tick(void *data)
 {
 	struct device *device = data;
+	unsigned int remaining;
+
+	device->tick_timer = NULL;
 
 	switch (device->state) {
 	case DEVICE_STATE_START:
+		/* Give the board time to power down */
+		remaining = device_settle_remaining(device);
+		if (remaining) {
+			device->tick_timer = watch_timer_add(remaining, device_tick, device);
+			break;
+		}
+
 		/* Make sure power key is not engaged */
+		device_batch_begin(device);
 		if (device->fastboot_key_timeout)
 			device_key(device, DEVICE_KEY_FASTBOOT, true);
 		if (device->has_power_key)
 			device_key(device, DEVICE_KEY_POWER, false);
+		device_batch_end(device);
 
 		device->state = DEVICE_STATE_CONNECT;
-		watch_timer_add(10, device_tick, device);
+		device->tick_timer = watch_timer_add(10, device_tick, device);
 		break;
 	case DEVICE_STATE_CONNECT:
 		/* Connect power and USB */
+		device_batch_begin(device);
 		device_impl_power(device, true);
 		device_usb(device, true);
+		device_batch_end(device);
+
+		device->power_on_time = device_now_ms();
+		cdba_boot_phase(BOOT_PHASE_POWER_ON, 0);
 
 		if (device->has_power_key) {
 			device->state = DEVICE_STATE_PRESS;
-			watch_timer_add(250, device_tick, device);
+			device->tick_timer = watch_timer_add(250, device_tick, device);
 		} else if (device->fastboot_key_timeout) {
-			device->state = DEVICE_STATE_RELEASE_FASTBOOT;
-			watch_timer_add(device->fastboot_key_timeout * 1000, device_tick, device);
+			device_hold_fastboot_key(device);
 		} else {
 			device->state = DEVICE_STATE_RUNNING;
 		}
@@ -213,15 +358,14 @@ static void device_tick(void *data)
 		device_key(device, DEVICE_KEY_POWER, true);
 
 		device->state = DEVICE_STATE_RELEASE_PWR;
-		watch_timer_add(100, device_tick, device);
+		device->tick_timer = watch_timer_add(100, device_tick, device);
 		break;
 	case DEVICE_STATE_RELEASE_PWR:
 		/* Release power key */
 		device_key(device, DEVICE_KEY_POWER, false);
 
 		if (device->fastboot_key_timeout) {
-			device->state = DEVICE_STATE_RELEASE_FASTBOOT;
-			watch_timer_add(device->fastboot_key_timeout * 1000, device_tick, device);
+			device_hold_fastboot_key(device);
 		} else {
 			device->state = DEVICE_STATE_RUNNING;
 		}
@@ -243,6 +387,11 @@ static int device_power_on(struct device *device)
 	if (!device || !device_has_control(device, power))
 		return 0;
 
+	watch_timer_cancel(device->tick_timer);
+
+	device->fastboot_enumerated = false;
+	device->power_on_time = 0;
+
 	device->state = DEVICE_STATE_START;
 	device_tick(device);
 
@@ -254,7 +403,12 @@ static int device_power_off(struct device *device)
 	if (!device || !device_has_control(device, power))
 		return 0;
 
-	device_control(device, power, false);
+	/* Abort any ongoing power on sequence */
+	watch_timer_cancel(device->tick_timer);
+	device->tick_timer = NULL;
+
+	device_impl_power(device, false);
+	device_settle(device, 0);
 
 	return 0;
 }
@@ -285,8 +439,10 @@ void device_usb(struct device *device, bool on)
 {
 	if (device->ppps_path)
 		ppps_power(device, on);
-	else if (device_has_control(device, usb))
+	else if (device_has_control(device, usb)) {
 		device_control(device, usb, on);
+		device_flush(device);
+	}
 }
 
 int device_write(struct device *device, const void *buf, size_t len)
@@ -297,10 +453,127 @@ int device_write(struct device *device, const void *buf, size_t len)
 	return device_console(device, write, buf, len);
 }
 
+/* Release the fastboot key as soon as the board's fastboot interface appears */
+static void device_fastboot_enumerated(struct device *device)
+{
+	if (device->power_on_time) {
+		device->fastboot_time = device_now_ms() - device->power_on_time;
+		device->fastboot_time_avg = device->fastboot_time_avg ?
+			(device->fastboot_time_avg * 3 + device->fastboot_time) / 4 :
+			device->fastboot_time;
+		device->power_on_time = 0;
+
+		syslog(LOG_INFO, "board %s reached fastboot in %u ms (average %u ms)",
+		       device->board, device->fastboot_time, device->fastboot_time_avg);
+	}
+
+	device->fastboot_enumerated = true;
+
+	if (device->state == DEVICE_STATE_RELEASE_FASTBOOT) {
+		watch_timer_cancel(device->tick_timer);
+		device_tick(device);
+	}
+}
+
+static struct device *device_from_fastboot(struct fastboot *fb)
+{
+	struct device *device;
+
+	list_for_each_entry(device, &devices, node) {
+		if (device->fastboot == fb)
+			return device;
+	}
+
+	return NULL;
+}
+
+/*
+ * The fastboot callbacks pass through the device, which needs to know when
+ * fastboot shows up, before reaching the operations given to
+ * device_fastboot_open().
+ */
+static void device_fastboot_opened(struct fastboot *fb, void *data)
+{
+	struct device *device = data;
+
+	device_fastboot_enumerated(device);
+
+	if (device->fastboot_ops->opened)
+		device->fastboot_ops->opened(fb, NULL);
+}
+
+static void device_fastboot_disconnect(void *data)
+{
+	struct device *device = data;
+
+	device->fastboot_enumerated = false;
+
+	if (device->fastboot_ops->disconnect)
+		device->fastboot_ops->disconnect(NULL);
+}
+
+static void device_fastboot_info(struct fastboot *fb, const void *buf, size_t len)
+{
+	struct device *device = device_from_fastboot(fb);
+
+	if (device && device->fastboot_ops->info)
+		device->fastboot_ops->info(fb, buf, len);
+}
+
+static void device_fastboot_writable(struct fastboot *fb, void *data)
+{
+	struct device *device = data;
+
+	if (device->fastboot_ops->writable)
+		device->fastboot_ops->writable(fb, NULL);
+}
+
+static struct fastboot_ops device_fastboot_ops = {
+	.opened = device_fastboot_opened,
+	.disconnect = device_fastboot_disconnect,
+	.info = device_fastboot_info,
+	.writable = device_fastboot_writable,
+};
+
+static void device_fastboot_open_deferred(void *data)
+{
+	struct device *device = data;
+
+	device->fastboot_timer = NULL;
+	device->fastboot = fastboot_open(device->fastboot_transport, device->serial,
+					 &device_fastboot_ops, device);
+}
+
 void device_fastboot_open(struct device *device,
 			  struct fastboot_ops *fastboot_ops)
 {
-	device->fastboot = fastboot_open(device->serial, fastboot_ops, NULL);
+	unsigned int remaining;
+	void **ctx;
+
+	device->fastboot_ops = fastboot_ops;
+
+	/* Kept open across sessions, report a device already present */
+	if (device->fastboot) {
+		if (fastboot_is_present(device->fastboot))
+			fastboot_ops->opened(device->fastboot, NULL);
+		return;
+	}
+
+	if (device->fastboot_timer)
+		return;
+
+	ctx = watch_set_context(&device->session);
+
+	/* Let a board left in fastboot disappear before looking for it */
+	remaining = device_settle_remaining(device);
+	if (remaining)
+		device->fastboot_timer = watch_timer_add(remaining, device_fastboot_open_deferred, device);
+	else
+		device->fastboot = fastboot_open(device->fastboot_transport,
+						 device->serial,
+						 &device_fastboot_ops, device);
+
+	watch_set_context(ctx);
 }
 
 void device_fastboot_boot(struct device *device)
@@ -331,18 +604,169 @@ void device_fastboot_flash_reboot(struct device *device)
 	fastboot_reboot(device->fastboot);
 }
 
-void device_boot(struct device *device, const void *data, size_t len)
+/**
+ * device_boot_start() - prepare for booting a streamed payload
+ * @device:	device to boot
+ * @len:	total size of the payload
+ *
+ * Return: 0 on success, negative on failure
+ */
+int device_boot_start(struct device *device, size_t len)
 {
+	if (!device->fastboot) {
+		fprintf(stderr, "fastboot not opened\n");
+		return -1;
+	}
+
 	warnx("booting the board...");
 	if (device->set_active)
 		fastboot_set_active(device->fastboot, device->set_active);
-	fastboot_download(device->fastboot, data, len);
-	device->boot(device);
 
-	if (device->status_enabled && !device->usb_always_on) {
-		warnx("disabling USB, use ^A V to enable");
-		device_usb(device, false);
+	cdba_boot_phase(BOOT_PHASE_DOWNLOAD_START, len);
+
+	return fastboot_download_start(device->fastboot, len);
+}
+
+int device_boot_write(struct device *device, const void *data, size_t len)
+{
+	return fastboot_download_write(device->fastboot, data, len);
+}
+
+/**
+ * device_boot_ready() - check if more payload can be accepted without blocking
+ * @device:	device being booted
+ * @len:	size of the next piece of payload
+ *
+ * Return: true if device_boot_write() of @len bytes won't block, otherwise
+ * the fastboot writable callback is invoked once it won't
+ */
+bool device_boot_ready(struct device *device, size_t len)
+{
+	return fastboot_download_ready(device->fastboot, len);
+}
+
+static void device_boot_complete(struct fastboot *fb, void *data, int ret)
+{
+	struct device *device = data;
+
+	if (ret < 0) {
+		warnx("failed to download boot image");
+	} else {
+		cdba_boot_phase(BOOT_PHASE_DOWNLOAD_DONE, 0);
+		device->boot(device);
+		cdba_boot_phase(BOOT_PHASE_BOOT, 0);
+
+		if (device->status_enabled && !device->usb_always_on) {
+			warnx("disabling USB, use ^A V to enable");
+			device_usb(device, false);
+		}
 	}
+
+	if (device->boot_done)
+		device->boot_done(device, ret);
+}
+
+/**
+ * device_boot_finish() - complete the download and boot the device
+ * @device:	device being booted
+ * @done:	invoked once the device is booted, or NULL to wait for that
+ */
+void device_boot_finish(struct device *device,
+			void (*done)(struct device *, int))
+{
+	int ret;
+
+	device->boot_done = done;
+
+	if (done) {
+		fastboot_download_finish(device->fastboot, device_boot_complete, device);
+	} else {
+		ret = fastboot_download_finish(device->fastboot, NULL, NULL);
+		device_boot_complete(device->fastboot, device, ret);
+	}
+}
+
+void device_boot(struct device *device, const void *data, size_t len)
+{
+	if (device_boot_start(device, len) < 0)
+		return;
+
+	device_boot_write(device, data, len);
+	device_boot_finish(device, NULL);
+}
+
+/**
+ * device_flash_start() - prepare for flashing a streamed image
+ * @device:	device to flash
+ * @partition:	partition to write the image to
+ * @size:	total size of the image
+ *
+ * Return: 0 on success, negative on failure
+ */
+int device_flash_start(struct device *device, const char *partition,
+		       uint64_t size)
+{
+	if (!device->fastboot) {
+		fprintf(stderr, "fastboot not opened\n");
+		return -1;
+	}
+
+	warnx("flashing %s...", partition);
+
+	return fastboot_flash_start(device->fastboot, partition, size);
+}
+
+int device_flash_write(struct device *device, const void *data, size_t len)
+{
+	return fastboot_flash_write(device->fastboot, data, len);
+}
+
+/**
+ * device_flash_ready() - check if more of the image can be accepted
+ * @device:	device being flashed
+ * @len:	size of the next piece of the image
+ *
+ * Return: true if device_flash_write() of @len bytes won't block, otherwise
+ * the fastboot writable callback is invoked once it won't
+ */
+bool device_flash_ready(struct device *device, size_t len)
+{
+	return fastboot_flash_ready(device->fastboot, len);
+}
+
+/**
+ * device_flash_idle() - check if the previous image has been flashed
+ * @device:	device being flashed
+ *
+ * Return: true if another flash can be started, otherwise the fastboot
+ * writable callback is invoked once it can
+ */
+bool device_flash_idle(struct device *device)
+{
+	return !device->fastboot || fastboot_flash_idle(device->fastboot);
+}
+
+static void device_flash_complete(struct fastboot *fb, void *data, int ret)
+{
+	struct device *device = data;
+
+	if (ret < 0)
+		warnx("failed to flash image");
+
+	device->flash_done(device, ret);
+}
+
+/**
+ * device_flash_finish() - complete flashing of the streamed image
+ * @device:	device being flashed
+ * @done:	invoked once the image has been written
+ */
+void device_flash_finish(struct device *device,
+			 void (*done)(struct device *, int))
+{
+	device->flash_done = done;
+
+	fastboot_flash_finish(device->fastboot, device_flash_complete, device);
 }
 
 void device_send_break(struct device *device)
@@ -395,12 +819,31 @@ void device_info(const char *username, const void *data, size_t dlen)
 	cdba_send_buf(MSG_BOARD_INFO, len, description);
 }
 
-void device_close(struct device *dev)
+/**
+ * device_release() - end the session of a device
+ * @dev:	device to release
+ *
+ * The device is powered down, unless configured otherwise, and unlocked, but
+ * its drivers are kept open.
+ */
+void device_release(struct device *dev)
 {
+	device_batch_begin(dev);
 	if (!dev->usb_always_on)
 		device_usb(dev, false);
 	if (!dev->power_always_on)
 		device_power(dev, false);
+	device_batch_end(dev);
+
+	if (dev->lock) {
+		board_lock_release(dev->lock);
+		dev->lock = NULL;
+	}
+}
+
+void device_close(struct device *dev)
+{
+	device_release(dev);
 
 	if (device_has_control(dev, close))
 		device_control(dev, close);
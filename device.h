@@ -1,12 +1,16 @@
 #ifndef __DEVICE_H__
 #define __DEVICE_H__
 
+#include <stdint.h>
 #include <termios.h>
 #include "list.h"
 
 struct cdb_assist;
 struct fastboot;
 struct fastboot_ops;
+struct fastboot_transport;
+struct board_lock;
+struct watch_timer;
 struct device;
 struct device_parser;
 
@@ -18,6 +22,12 @@ struct control_ops {
 	void (*usb)(struct device *dev, bool on);
 	void (*key)(struct device *device, int key, bool asserted);
 	void (*status_enable)(struct device *dev);
+
+	/*
+	 * Drivers implementing flush may defer power, usb and key changes
+	 * until flush is called, to apply them all at once.
+	 */
+	void (*flush)(struct device *dev);
 };
 
 struct console_ops {
@@ -25,14 +35,19 @@ struct console_ops {
 	int (*write)(struct device *dev, const void *buf, size_t len);
 
 	void (*send_break)(struct device *dev);
+
+	/* Prepare the already opened console for a new session */
+	void (*acquire)(struct device *dev);
 };
 
 struct device {
 	char *board;
+	char *pool;
 	char *control_dev;
 	void *control_options;
 	char *console_dev;
 	char *name;
+	/* fastboot serial, or address of the device for fastboot_transport */
 	char *serial;
 	char *description;
 	char *ppps_path;
@@ -42,14 +57,29 @@ struct device {
 	bool tickle_mmc;
 	bool usb_always_on;
 	bool power_always_on;
+	const struct fastboot_transport *fastboot_transport;
 	struct fastboot *fastboot;
 	unsigned int fastboot_key_timeout;
+	int power_off_delay;
+	/* largest boot image held on to until fastboot shows up */
+	size_t stage_max_size;
+	uint64_t settle_until;
+	uint64_t power_on_time;
+	bool fastboot_enumerated;
+	/* time from power on until fastboot showed up, in ms */
+	unsigned int fastboot_time;
+	unsigned int fastboot_time_avg;
 	int state;
+	struct watch_timer *tick_timer;
+	struct watch_timer *fastboot_timer;
+	struct fastboot_ops *fastboot_ops;
 	bool has_power_key;
 
 	bool status_enabled;
 
 	void (*boot)(struct device *);
+	void (*boot_done)(struct device *, int);
+	void (*flash_done)(struct device *, int);
 
 	const struct control_ops *control_ops;
 	const struct console_ops *console_ops;
@@ -59,6 +89,15 @@ struct device {
 	void *cdb;
 	void *console;
 
+	bool opened;
+	struct board_lock *lock;
+
+	/* nesting of control changes to be applied at once */
+	unsigned int control_batch;
+
+	/* session using the device, context of the device's watches */
+	void *session;
+
 	char *status_cmd;
 
 	struct list_head node;
@@ -74,6 +113,11 @@ void device_add(struct device *device);
 
 struct device *device_open(const char *board,
 			   const char *username);
+struct device *device_lookup(const char *board, const char *username);
+struct device *device_pool_next(const char *pool, const char *username,
+				struct device *prev);
+void device_acquire(struct device *device, struct board_lock *lock);
+void device_release(struct device *dev);
 void device_close(struct device *dev);
 int device_power(struct device *device, bool on);
 
@@ -82,6 +126,19 @@ void device_usb(struct device *device, bool on);
 int device_write(struct device *device, const void *buf, size_t len);
 
 void device_boot(struct device *device, const void *data, size_t len);
+int device_boot_start(struct device *device, size_t len);
+int device_boot_write(struct device *device, const void *data, size_t len);
+bool device_boot_ready(struct device *device, size_t len);
+void device_boot_finish(struct device *device,
+			void (*done)(struct device *, int));
+
+int device_flash_start(struct device *device, const char *partition,
+		       uint64_t size);
+int device_flash_write(struct device *device, const void *data, size_t len);
+bool device_flash_ready(struct device *device, size_t len);
+bool device_flash_idle(struct device *device);
+void device_flash_finish(struct device *device,
+			 void (*done)(struct device *, int));
 
 void device_fastboot_open(struct device *device,
 			  struct fastboot_ops *fastboot_ops);
@@ -92,6 +149,7 @@ void device_list_devices(const char *username);
 void device_info(const char *username, const void *data, size_t dlen);
 void device_fastboot_continue(struct device *device);
 bool device_is_running(struct device *device);
+void device_settle(struct device *device, unsigned int delay_ms);
 
 enum {
 	DEVICE_KEY_FASTBOOT,
@@ -104,10 +162,13 @@ extern const struct control_ops conmux_ops;
 extern const struct control_ops ftdi_gpio_ops;
 extern const struct control_ops local_gpio_ops;
 extern const struct control_ops external_ops;
+extern const struct control_ops external_coprocess_ops;
 extern const struct control_ops qcomlt_dbg_ops;
 extern const struct control_ops laurent_ops;
+extern const struct control_ops mock_ops;
 
 extern const struct console_ops conmux_console_ops;
 extern const struct console_ops console_ops;
+extern const struct console_ops mock_console_ops;
 
 #endif
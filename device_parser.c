@@ -4,15 +4,22 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
+#include <err.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <yaml.h>
 
+#include "board_lock.h"
 #include "device.h"
 #include "device_parser.h"
+#include "fastboot.h"
+#include "image_cache.h"
 
 #define TOKEN_LENGTH	16384
 
+/* Default limit of the boot image staged ahead of fastboot */
+#define STAGE_MAX_SIZE	(512 * 1024 * 1024)
+
 struct device_parser {
 	yaml_parser_t parser;
 	yaml_event_t event;
@@ -54,6 +61,37 @@ bool device_parser_expect(struct device_parser *dp, int type,
 	exit(1);
 }
 
+/**
+ * device_parser_size() - parse a size, with an optional K, M or G suffix
+ * @value:	scalar to parse
+ *
+ * Return: size in bytes, exits on malformed values
+ */
+unsigned long long device_parser_size(const char *value)
+{
+	unsigned long long size;
+	char *end;
+
+	size = strtoull(value, &end, 0);
+	switch (*end) {
+	case 'G':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'M':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'K':
+		size *= 1024;
+		break;
+	case '\0':
+		break;
+	default:
+		errx(1, "device parser: invalid size \"%s\"", value);
+	}
+
+	return size;
+}
+
 static void set_control_ops(struct device *dev, const struct control_ops *ops)
 {
 	if (dev->control_ops) {
@@ -81,6 +119,8 @@ static void parse_board(struct device_parser *dp)
 	char key[TOKEN_LENGTH];
 
 	dev = calloc(1, sizeof(*dev));
+	dev->power_off_delay = -1;
+	dev->stage_max_size = STAGE_MAX_SIZE;
 
 	while (device_parser_accept(dp, YAML_SCALAR_EVENT, key, TOKEN_LENGTH)) {
 		if (!strcmp(key, "users")) {
@@ -120,12 +160,21 @@ static void parse_board(struct device_parser *dp)
 			if (dev->control_options)
 				set_control_ops(dev, &laurent_ops);
 			continue;
+		} else if (!strcmp(key, "mock")) {
+			/* mock handles both control and console */
+			dev->control_options = mock_ops.parse_options(dp);
+			dev->console_dev = strdup("mock");
+			set_control_ops(dev, &mock_ops);
+			set_console_ops(dev, &mock_console_ops);
+			continue;
 		}
 
 		device_parser_expect(dp, YAML_SCALAR_EVENT, value, TOKEN_LENGTH);
 
 		if (!strcmp(key, "board")) {
 			dev->board = strdup(value);
+		} else if (!strcmp(key, "pool")) {
+			dev->pool = strdup(value);
 		} else if (!strcmp(key, "name")) {
 			dev->name = strdup(value);
 		} else if (!strcmp(key, "cdba")) {
@@ -143,6 +192,9 @@ static void parse_board(struct device_parser *dp)
 		} else if (!strcmp(key, "external")) {
 			dev->control_dev = strdup(value);
 			set_control_ops(dev, &external_ops);
+		} else if (!strcmp(key, "external_coprocess")) {
+			dev->control_dev = strdup(value);
+			set_control_ops(dev, &external_coprocess_ops);
 		} else if (!strcmp(key, "qcomlt_debug_board")) {
 			dev->control_dev = strdup(value);
 			set_control_ops(dev, &qcomlt_dbg_ops);
@@ -154,6 +206,18 @@ static void parse_board(struct device_parser *dp)
 		} else if (!strcmp(key, "fastboot")) {
 			dev->serial = strdup(value);
 
+			if (!dev->boot)
+				dev->boot = device_fastboot_boot;
+		} else if (!strcmp(key, "fastboot_emulator")) {
+			dev->serial = strdup(value);
+			dev->fastboot_transport = &fastboot_emu_transport;
+
+			if (!dev->boot)
+				dev->boot = device_fastboot_boot;
+		} else if (!strcmp(key, "fastboot_tcp")) {
+			dev->serial = strdup(value);
+			dev->fastboot_transport = &fastboot_tcp_transport;
+
 			if (!dev->boot)
 				dev->boot = device_fastboot_boot;
 		} else if (!strcmp(key, "fastboot_set_active")) {
@@ -168,6 +232,10 @@ static void parse_board(struct device_parser *dp)
 			dev->description = strdup(value);
 		} else if (!strcmp(key, "fastboot_key_timeout")) {
 			dev->fastboot_key_timeout = strtoul(value, NULL, 10);
+		} else if (!strcmp(key, "stage_max_size")) {
+			dev->stage_max_size = device_parser_size(value);
+		} else if (!strcmp(key, "power_off_delay")) {
+			dev->power_off_delay = strtoul(value, NULL, 10);
 		} else if (!strcmp(key, "usb_always_on")) {
 			dev->usb_always_on = !strcmp(value, "true");
 		} else if (!strcmp(key, "ppps_path")) {
@@ -189,12 +257,16 @@ static void parse_board(struct device_parser *dp)
 		exit(1);
 	}
 
+	if (!dev->fastboot_transport)
+		dev->fastboot_transport = &fastboot_usb_transport;
+
 	device_add(dev);
 }
 
 int device_parser(const char *path)
 {
 	struct device_parser dp;
+	char value[TOKEN_LENGTH];
 	char key[TOKEN_LENGTH];
 	FILE *fh;
 
@@ -216,7 +288,18 @@ int device_parser(const char *path)
 	device_parser_expect(&dp, YAML_DOCUMENT_START_EVENT, NULL, 0);
 	device_parser_expect(&dp, YAML_MAPPING_START_EVENT, NULL, 0);
 
-	if (device_parser_accept(&dp, YAML_SCALAR_EVENT, key, TOKEN_LENGTH)) {
+	while (device_parser_accept(&dp, YAML_SCALAR_EVENT, key, TOKEN_LENGTH)) {
+		if (!strcmp(key, "image_cache")) {
+			image_cache_parse(&dp);
+			continue;
+		}
+
+		if (!strcmp(key, "lock_dir")) {
+			device_parser_expect(&dp, YAML_SCALAR_EVENT, value, TOKEN_LENGTH);
+			board_lock_set_dir(value);
+			continue;
+		}
+
 		device_parser_expect(&dp, YAML_SEQUENCE_START_EVENT, NULL, 0);
 
 		while (device_parser_accept(&dp, YAML_MAPPING_START_EVENT, NULL, 0)) {
@@ -8,6 +8,8 @@ int device_parser_accept(struct device_parser *dp, int type,
 bool device_parser_expect(struct device_parser *dp, int type,
 			  char *scalar,  size_t scalar_len);
 
+unsigned long long device_parser_size(const char *value);
+
 int device_parser(const char *path);
 
 #endif
@@ -48,7 +48,7 @@ static void *alpaca_open(struct device *dev)
 	else
 		alpaca_usb_device_power(alpaca, 0);
 
-	usleep(500000);
+	device_settle(dev, 500);
 
 	return alpaca;
 }
@@ -195,7 +195,9 @@ static int conmux_data(int fd, void *data)
 		fprintf(stderr, "Received EOF from conmux\n");
 		watch_quit();
 	} else {
+		cdba_boot_phase(BOOT_PHASE_CONSOLE, 0);
 		cdba_send_buf(MSG_CONSOLE, n, buf);
+		cdba_output_throttle(fd, conmux_data, data);
 	}
 
 	return 0;
@@ -3,21 +3,64 @@
  * All rights reserved.
  *
  * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * The external program is either invoked for each control operation, as:
+ *
+ *   <program> <board> <command> on|off
+ *
+ * where command is one of "power", "usb", "key-fastboot" or "key-power", or,
+ * with external_coprocess, started once as:
+ *
+ *   <program> <board> coprocess
+ *
+ * in which case it reads one "<command> on|off" line per operation from stdin,
+ * and answers each one, in order, with a line on stdout. The answer is "ok"
+ * on success, anything else is reported as an error. Commands are issued
+ * without waiting for the answers of the preceding ones, and the program is
+ * expected to exit once stdin is closed. As the device is closed, the program
+ * is given EXTERNAL_CLOSE_TIMEOUT_MS to answer and exit, before it's killed.
  */
 
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "cdba-server.h"
 #include "device.h"
+#include "watch.h"
+
+#define EXTERNAL_CLOSE_TIMEOUT_MS	5000
+#define EXTERNAL_EXIT_TIMEOUT_MS	1000
 
 struct external {
 	const char *path;
 	const char *board;
+
+	bool coprocess;
+	pid_t pid;
+	int fd;
+
+	/* answers not yet received from the co-process */
+	unsigned int outstanding;
+
+	char answer[256];
+	size_t answer_len;
+
+	/* commands not yet accepted by the co-process */
+	char queue[1024];
+	size_t queue_len;
 };
 
 static int external_helper(struct external *ext, const char *command, bool on)
@@ -51,6 +94,197 @@ static int external_helper(struct external *ext, const char *command, bool on)
 	return -1;
 }
 
+/* Reap the co-process, killing it if it doesn't exit in time */
+static void external_coprocess_reap(struct external *ext)
+{
+	struct pollfd pfd = { .events = POLLIN };
+
+	pfd.fd = syscall(SYS_pidfd_open, ext->pid, 0);
+	if (pfd.fd >= 0) {
+		poll(&pfd, 1, EXTERNAL_EXIT_TIMEOUT_MS);
+		close(pfd.fd);
+	}
+
+	if (waitpid(ext->pid, NULL, WNOHANG) == 0) {
+		warnx("%s didn't exit, killing it", ext->path);
+		kill(ext->pid, SIGKILL);
+		waitpid(ext->pid, NULL, 0);
+	}
+}
+
+static void external_coprocess_stop(struct external *ext)
+{
+	watch_del_readfd(ext->fd);
+	if (ext->queue_len)
+		watch_del_writefd(ext->fd);
+	close(ext->fd);
+	external_coprocess_reap(ext);
+
+	if (ext->outstanding)
+		warnx("%s exited without answering %u commands",
+		      ext->path, ext->outstanding);
+
+	ext->fd = -1;
+	ext->outstanding = 0;
+	ext->answer_len = 0;
+	ext->queue_len = 0;
+}
+
+static bool external_coprocess_answer(struct external *ext)
+{
+	char *answer = ext->answer;
+	size_t len;
+	char *eol;
+
+	eol = memchr(answer, '\n', ext->answer_len);
+	if (!eol)
+		return false;
+
+	*eol = '\0';
+	len = eol - answer + 1;
+
+	if (ext->outstanding)
+		ext->outstanding--;
+
+	if (strcmp(answer, "ok"))
+		warnx("%s: %s", ext->path, answer);
+
+	ext->answer_len -= len;
+	memmove(answer, answer + len, ext->answer_len);
+
+	return true;
+}
+
+static int external_coprocess_data(int fd, void *data)
+{
+	struct external *ext = data;
+	ssize_t n;
+
+	n = read(fd, ext->answer + ext->answer_len,
+		 sizeof(ext->answer) - ext->answer_len);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	if (n <= 0) {
+		external_coprocess_stop(ext);
+		return 0;
+	}
+
+	ext->answer_len += n;
+
+	while (external_coprocess_answer(ext))
+		;
+
+	/* Discard an overly long answer, rather than stalling */
+	if (ext->answer_len == sizeof(ext->answer)) {
+		warnx("%s: answer too long", ext->path);
+		ext->answer_len = 0;
+	}
+
+	return 0;
+}
+
+static int external_coprocess_start(struct external *ext)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+		warn("failed to create socket for %s", ext->path);
+		return -1;
+	}
+
+	pid = fork();
+	switch (pid) {
+	case 0:
+		dup2(fds[1], STDIN_FILENO);
+		dup2(fds[1], STDOUT_FILENO);
+		execlp(ext->path, ext->path, ext->board, "coprocess", NULL);
+		warn("failed to execute %s", ext->path);
+		_exit(1);
+	case -1:
+		warn("failed to fork %s", ext->path);
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	default:
+		break;
+	}
+
+	close(fds[1]);
+
+	/* Commands are queued, rather than waiting for the co-process */
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+	ext->pid = pid;
+	ext->fd = fds[0];
+
+	watch_add_readfd(ext->fd, external_coprocess_data, ext);
+
+	return 0;
+}
+
+static int external_coprocess_flush(int fd, void *data)
+{
+	struct external *ext = data;
+	ssize_t n;
+
+	n = send(fd, ext->queue, ext->queue_len, MSG_NOSIGNAL);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	if (n < 0) {
+		warn("failed to send command to %s", ext->path);
+		external_coprocess_stop(ext);
+		return 0;
+	}
+
+	ext->queue_len -= n;
+	memmove(ext->queue, ext->queue + n, ext->queue_len);
+
+	if (!ext->queue_len)
+		watch_del_writefd(fd);
+
+	return 0;
+}
+
+static int external_coprocess_command(struct external *ext, const char *command, bool on)
+{
+	char line[64];
+	int len;
+
+	/* Restart the co-process if it has exited */
+	if (ext->fd < 0 && external_coprocess_start(ext) < 0)
+		return -1;
+
+	len = snprintf(line, sizeof(line), "%s %s\n", command, on ? "on" : "off");
+
+	if (ext->queue_len + len > sizeof(ext->queue)) {
+		warnx("%s isn't accepting commands", ext->path);
+		return -1;
+	}
+
+	memcpy(ext->queue + ext->queue_len, line, len);
+	ext->queue_len += len;
+	ext->outstanding++;
+
+	/* Only the first queued command needs to arm the write watch */
+	if (ext->queue_len == (size_t)len) {
+		watch_add_writefd(ext->fd, external_coprocess_flush, ext);
+		external_coprocess_flush(ext->fd, ext);
+	}
+
+	return 0;
+}
+
+static int external_command(struct external *ext, const char *command, bool on)
+{
+	if (ext->coprocess)
+		return external_coprocess_command(ext, command, on);
+
+	return external_helper(ext, command, on);
+}
+
 static void *external_open(struct device *dev)
 {
 	struct external *ext;
@@ -61,22 +295,79 @@ static void *external_open(struct device *dev)
 
 	ext->path = dev->control_dev;
 	ext->board = dev->board;
+	ext->fd = -1;
+
+	return ext;
+}
+
+static void *external_coprocess_open(struct device *dev)
+{
+	struct external *ext;
+
+	ext = external_open(dev);
+	ext->coprocess = true;
+
+	if (external_coprocess_start(ext) < 0)
+		errx(1, "failed to start %s", ext->path);
 
 	return ext;
 }
 
+/*
+ * Wait for the answers to the outstanding commands, e.g. the final power off,
+ * for up to EXTERNAL_CLOSE_TIMEOUT_MS.
+ */
+static void external_coprocess_close(struct device *dev)
+{
+	struct external *ext = dev->cdb;
+	struct pollfd pfd = {};
+	struct timespec now;
+	struct timespec end;
+	bool shut = false;
+	int timeout;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += EXTERNAL_CLOSE_TIMEOUT_MS / 1000;
+
+	while (ext->fd >= 0) {
+		if (!ext->queue_len && !shut) {
+			shutdown(ext->fd, SHUT_WR);
+			shut = true;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = (end.tv_sec - now.tv_sec) * 1000 +
+			  (end.tv_nsec - now.tv_nsec) / 1000000;
+
+		pfd.fd = ext->fd;
+		pfd.events = POLLIN | (ext->queue_len ? POLLOUT : 0);
+		if (timeout <= 0 || poll(&pfd, 1, timeout) == 0) {
+			warnx("%s didn't answer in time, killing it", ext->path);
+			kill(ext->pid, SIGKILL);
+			external_coprocess_stop(ext);
+			break;
+		}
+
+		if (pfd.revents & POLLOUT)
+			external_coprocess_flush(ext->fd, ext);
+
+		if (ext->fd >= 0 && pfd.revents & ~POLLOUT)
+			external_coprocess_data(ext->fd, ext);
+	}
+}
+
 static int external_power(struct device *dev, bool on)
 {
 	struct external *ext = dev->cdb;
 
-	return external_helper(ext, "power", on);
+	return external_command(ext, "power", on);
 }
 
 static void external_usb(struct device *dev, bool on)
 {
 	struct external *ext = dev->cdb;
 
-	external_helper(ext, "usb", on);
+	external_command(ext, "usb", on);
 }
 
 static void external_key(struct device *dev, int key, bool asserted)
@@ -85,10 +376,10 @@ static void external_key(struct device *dev, int key, bool asserted)
 
 	switch (key) {
 	case DEVICE_KEY_FASTBOOT:
-		external_helper(ext, "key-fastboot", asserted);
+		external_command(ext, "key-fastboot", asserted);
 		break;
 	case DEVICE_KEY_POWER:
-		external_helper(ext, "key-power", asserted);
+		external_command(ext, "key-power", asserted);
 		break;
 	}
 }
@@ -99,3 +390,11 @@ const struct control_ops external_ops = {
 	.usb = external_usb,
 	.key = external_key,
 };
+
+const struct control_ops external_coprocess_ops = {
+	.open = external_coprocess_open,
+	.close = external_coprocess_close,
+	.power = external_power,
+	.usb = external_usb,
+	.key = external_key,
+};
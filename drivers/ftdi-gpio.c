@@ -21,6 +21,7 @@
 #include "cdba-server.h"
 #include "device.h"
 #include "device_parser.h"
+#include "list.h"
 
 #define TOKEN_LENGTH	16384
 #define FTDI_INTERFACE_COUNT	4
@@ -53,15 +54,32 @@ struct ftdi_gpio_options {
 	} gpios[GPIO_COUNT];
 };
 
+/*
+ * An opened FTDI interface, shared by the boards wired to it. Line changes
+ * are accumulated in @lines and written out in one transaction on flush.
+ */
+struct ftdi_gpio_interface {
+	char *description;
+	unsigned int index;
+
+	struct ftdi_context *context;
+	unsigned char lines;
+	bool dirty;
+
+	struct list_head node;
+};
+
+static struct list_head ftdi_gpio_interfaces = LIST_INIT(ftdi_gpio_interfaces);
+
 struct ftdi_gpio {
 	struct ftdi_gpio_options *options;
-	struct ftdi_context *interface[FTDI_INTERFACE_COUNT];
-	unsigned char gpio_lines[FTDI_INTERFACE_COUNT];
+	struct ftdi_gpio_interface *interface[FTDI_INTERFACE_COUNT];
 };
 
 static int ftdi_gpio_device_power(struct ftdi_gpio *ftdi_gpio, bool on);
 static void ftdi_gpio_device_usb(struct ftdi_gpio *ftdi_gpio, bool on);
 static int ftdi_gpio_toggle_io(struct ftdi_gpio *ftdi_gpio, unsigned int gpio, bool on);
+static int ftdi_gpio_flush_interfaces(struct ftdi_gpio *ftdi_gpio);
 
 /*
  * fdio_gpio parameter: <libftdi description>;[<interface>[;<gpios>...]]
@@ -240,10 +258,47 @@ void *ftdi_gpio_parse_options(struct device_parser *dp)
 	return options;
 }
 
+/* Open the given interface of the FTDI device, unless already opened */
+static struct ftdi_gpio_interface *ftdi_gpio_interface_open(const char *description,
+							    unsigned int index)
+{
+	struct ftdi_gpio_interface *interface;
+	int ret;
+
+	list_for_each_entry(interface, &ftdi_gpio_interfaces, node) {
+		if (!strcmp(interface->description, description) &&
+		    interface->index == index)
+			return interface;
+	}
+
+	interface = calloc(1, sizeof(*interface));
+	if (!interface)
+		err(1, "failed to allocate ftdi gpio interface");
+
+	interface->description = strdup(description);
+	interface->index = index;
+
+	if ((interface->context = ftdi_new()) == 0)
+		errx(1, "failed to allocate ftdi gpio struct");
+
+	ftdi_set_interface(interface->context, INTERFACE_A + index);
+
+	ret = ftdi_usb_open_string(interface->context, description);
+	if (ret < 0)
+		errx(1, "failed to open ftdi gpio device '%s' (%d)",
+		     description, ret);
+
+	ftdi_set_bitmode(interface->context, 0xFF, BITMODE_BITBANG);
+
+	list_add(&ftdi_gpio_interfaces, &interface->node);
+
+	return interface;
+}
+
 static void *ftdi_gpio_open(struct device *dev)
 {
 	struct ftdi_gpio *ftdi_gpio;
-	int i, ret;
+	int i;
 
 	ftdi_gpio = calloc(1, sizeof(*ftdi_gpio));
 
@@ -292,20 +347,9 @@ static void *ftdi_gpio_open(struct device *dev)
 		if (ftdi_gpio->interface[ftdi_interface])
 			continue;
 
-		if ((ftdi_gpio->interface[ftdi_interface] = ftdi_new()) == 0)
-			errx(1, "failed to allocate ftdi gpio struct");
-
-		ftdi_set_interface(ftdi_gpio->interface[ftdi_interface],
-				   INTERFACE_A + ftdi_interface);
-
-		ret = ftdi_usb_open_string(ftdi_gpio->interface[ftdi_interface],
-					   ftdi_gpio->options->ftdi.description);
-		if (ret < 0)
-			errx(1, "failed to open ftdi gpio device '%s' (%d)",
-			     ftdi_gpio->options->ftdi.description, ret);
-
-		ftdi_set_bitmode(ftdi_gpio->interface[ftdi_interface],
-				 0xFF, BITMODE_BITBANG);
+		ftdi_gpio->interface[ftdi_interface] =
+			ftdi_gpio_interface_open(ftdi_gpio->options->ftdi.description,
+						 ftdi_interface);
 	}
 
 	if (ftdi_gpio->options->gpios[GPIO_POWER_KEY].present)
@@ -321,20 +365,24 @@ static void *ftdi_gpio_open(struct device *dev)
 	else
 		ftdi_gpio_device_usb(ftdi_gpio, 0);
 
-	usleep(500000);
+	ftdi_gpio_flush_interfaces(ftdi_gpio);
+
+	device_settle(dev, 500);
 
 	return ftdi_gpio;
 }
 
+/* Update the line of @gpio, to be written out by ftdi_gpio_flush_interfaces() */
 static int ftdi_gpio_toggle_io(struct ftdi_gpio *ftdi_gpio, unsigned int gpio, bool on)
 {
-	unsigned int ftdi_interface;
+	struct ftdi_gpio_interface *interface;
+	unsigned char lines;
 	unsigned int bit;
 
 	if (!ftdi_gpio->options->gpios[gpio].present)
 		return -EINVAL;
 
-	ftdi_interface = ftdi_gpio->options->gpios[gpio].interface;
+	interface = ftdi_gpio->interface[ftdi_gpio->options->gpios[gpio].interface];
 
 	bit = ftdi_gpio->options->gpios[gpio].offset;
 
@@ -342,12 +390,41 @@ static int ftdi_gpio_toggle_io(struct ftdi_gpio *ftdi_gpio, unsigned int gpio, b
 		on = !on;
 
 	if (on)
-		ftdi_gpio->gpio_lines[ftdi_interface] |= (1 << bit);
+		lines = interface->lines | (1 << bit);
 	else
-		ftdi_gpio->gpio_lines[ftdi_interface] &= ~(1 << bit);
+		lines = interface->lines & ~(1 << bit);
 
-	return ftdi_write_data(ftdi_gpio->interface[ftdi_interface],
-			       &ftdi_gpio->gpio_lines[ftdi_interface], 1);
+	if (lines != interface->lines) {
+		interface->lines = lines;
+		interface->dirty = true;
+	}
+
+	return 0;
+}
+
+/* Write out the changed lines, in one transaction per interface */
+static int ftdi_gpio_flush_interfaces(struct ftdi_gpio *ftdi_gpio)
+{
+	struct ftdi_gpio_interface *interface;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < FTDI_INTERFACE_COUNT; i++) {
+		interface = ftdi_gpio->interface[i];
+		if (!interface || !interface->dirty)
+			continue;
+
+		if (ftdi_write_data(interface->context, &interface->lines, 1) < 0) {
+			warnx("failed to write ftdi gpio lines: %s",
+			      ftdi_get_error_string(interface->context));
+			ret = -EIO;
+			continue;
+		}
+
+		interface->dirty = false;
+	}
+
+	return ret;
 }
 
 static int ftdi_gpio_device_power(struct ftdi_gpio *ftdi_gpio, bool on)
@@ -388,10 +465,18 @@ static void ftdi_gpio_key(struct device *dev, int key, bool asserted)
 	}
 }
 
+static void ftdi_gpio_flush(struct device *dev)
+{
+	struct ftdi_gpio *ftdi_gpio = dev->cdb;
+
+	ftdi_gpio_flush_interfaces(ftdi_gpio);
+}
+
 const struct control_ops ftdi_gpio_ops = {
 	.parse_options = ftdi_gpio_parse_options,
 	.open = ftdi_gpio_open,
 	.power = ftdi_gpio_power,
 	.usb = ftdi_gpio_usb,
 	.key = ftdi_gpio_key,
+	.flush = ftdi_gpio_flush,
 };
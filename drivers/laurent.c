@@ -10,30 +10,73 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <err.h>
+#include <errno.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <yaml.h>
 
 #include "cdba-server.h"
 #include "device.h"
 #include "device_parser.h"
+#include "list.h"
+#include "watch.h"
 
 struct laurent_options {
 	const char *server;
+	const char *port;
 	const char *password;
 	unsigned int relay;
 };
 
+/* A relay command, kept until the controller has responded to it */
+struct laurent_request {
+	char *buf;
+	size_t len;
+	bool on;
+	uint64_t queued;
+
+	struct list_head node;
+};
+
+/*
+ * Commands are pipelined over a single persistent HTTP/1.1 connection, which
+ * is driven from the watch loop. Unanswered commands are sent again after
+ * reconnecting, as switching a relay is idempotent.
+ */
 struct laurent {
 	struct laurent_options *options;
 
-	struct addrinfo addr;
+	struct addrinfo *addrs;
+	struct addrinfo *addr;
+
+	int fd;
+	bool connected;
+	bool answered;
+	struct watch_timer *reconnect_timer;
+
+	/* requests in order, @written bytes of which are sent */
+	struct list_head requests;
+	size_t written;
+
+	char response[BUFSIZ];
+	size_t response_len;
 };
 
 #define DEFAULT_PASSWORD	"Laurent"
+#define DEFAULT_PORT	"80"
 #define TOKEN_LENGTH	128
 
+/* Delay, in ms, before reconnecting after failing to reach the controller */
+#define RECONNECT_DELAY	1000
+
+/* Time, in ms, after which commands are given up while unable to connect */
+#define REQUEST_TIMEOUT	10000
+
 void *laurent_parse_options(struct device_parser *dp)
 {
 	struct laurent_options *options;
@@ -42,6 +85,7 @@ void *laurent_parse_options(struct device_parser *dp)
 
 	options = calloc(1, sizeof(*options));
 	options->password = DEFAULT_PASSWORD;
+	options->port = DEFAULT_PORT;
 
 	device_parser_accept(dp, YAML_MAPPING_START_EVENT, NULL, 0);
 	while (device_parser_accept(dp, YAML_SCALAR_EVENT, key, TOKEN_LENGTH)) {
@@ -50,6 +94,8 @@ void *laurent_parse_options(struct device_parser *dp)
 
 		if (!strcmp(key, "server"))
 			options->server = strdup(value);
+		else if (!strcmp(key, "port"))
+			options->port = strdup(value);
 		else if (!strcmp(key, "password"))
 			options->password = strdup(value);
 		else if (!strcmp(key, "relay"))
@@ -66,49 +112,284 @@ void *laurent_parse_options(struct device_parser *dp)
 	return options;
 }
 
+static uint64_t laurent_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static void laurent_resolve(struct laurent *laurent)
 {
 	struct addrinfo hints = {};
-	struct addrinfo *result, *rp;
-
 	int ret;
 
 	hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
 	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE;
-	hints.ai_protocol = 0;
-	hints.ai_canonname = NULL;
-	hints.ai_addr = NULL;
-	hints.ai_next = NULL;
-
-	ret = getaddrinfo(laurent->options->server, "80", &hints, &result);
-	if (ret != 0) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
-		exit(EXIT_FAILURE);
+
+	ret = getaddrinfo(laurent->options->server, laurent->options->port,
+			  &hints, &laurent->addrs);
+	if (ret != 0)
+		errx(1, "failed to resolve %s: %s", laurent->options->server,
+		     gai_strerror(ret));
+
+	laurent->addr = laurent->addrs;
+}
+
+static void laurent_connect(struct laurent *laurent);
+
+static void laurent_disconnect(struct laurent *laurent)
+{
+	if (laurent->fd < 0)
+		return;
+
+	watch_del_readfd(laurent->fd);
+	watch_del_writefd(laurent->fd);
+	close(laurent->fd);
+
+	laurent->fd = -1;
+	laurent->connected = false;
+	laurent->answered = false;
+	laurent->written = 0;
+	laurent->response_len = 0;
+}
+
+static void laurent_complete(struct laurent *laurent, bool success)
+{
+	struct laurent_request *req;
+
+	req = list_entry_first(&laurent->requests, struct laurent_request, node);
+
+	if (success)
+		warnx("laurent relay %u turned %s in %llu ms",
+		      laurent->options->relay, req->on ? "on" : "off",
+		      (unsigned long long)(laurent_now_ms() - req->queued));
+	else
+		warnx("laurent relay %u failed to turn %s",
+		      laurent->options->relay, req->on ? "on" : "off");
+
+	laurent->written -= MIN(laurent->written, req->len);
+
+	list_del(&req->node);
+	free(req->buf);
+	free(req);
+}
+
+static void laurent_reconnect_timeout(void *data)
+{
+	struct laurent *laurent = data;
+
+	laurent->reconnect_timer = NULL;
+	laurent_connect(laurent);
+}
+
+/*
+ * Drop the connection, and reconnect if there are outstanding commands. Unless
+ * @immediate is set, the connection failed and the next address is tried
+ * after a delay.
+ */
+static void laurent_reset(struct laurent *laurent, bool immediate)
+{
+	struct laurent_request *req;
+	uint64_t now = laurent_now_ms();
+
+	laurent_disconnect(laurent);
+
+	if (immediate) {
+		if (!list_empty(&laurent->requests))
+			laurent_connect(laurent);
+		return;
+	}
+
+	while (!list_empty(&laurent->requests)) {
+		req = list_entry_first(&laurent->requests, struct laurent_request, node);
+		if (now - req->queued < REQUEST_TIMEOUT)
+			break;
+
+		laurent_complete(laurent, false);
+	}
+
+	if (list_empty(&laurent->requests))
+		return;
+
+	laurent->addr = laurent->addr->ai_next ? : laurent->addrs;
+
+	if (!laurent->reconnect_timer)
+		laurent->reconnect_timer = watch_timer_add(RECONNECT_DELAY,
+							   laurent_reconnect_timeout,
+							   laurent);
+}
+
+/*
+ * Return: true if a complete response was consumed, the connection is to be
+ * closed after the response if @close is set
+ */
+static bool laurent_parse_response(struct laurent *laurent, bool eof, bool *close)
+{
+	char *response = laurent->response;
+	size_t header_len;
+	size_t body_len;
+	char *length;
+	char *end;
+	bool success;
+
+	end = memmem(response, laurent->response_len, "\r\n\r\n", 4);
+	if (!end)
+		return false;
+
+	*end = '\0';
+	header_len = end - response + 4;
+
+	length = strcasestr(response, "\r\nContent-Length:");
+	if (length) {
+		body_len = strtoul(length + 17, NULL, 10);
+	} else if (eof) {
+		/* The body extends until the connection is closed */
+		body_len = laurent->response_len - header_len;
+	} else {
+		*end = '\r';
+		return false;
 	}
 
-	for (rp = result; rp != NULL; rp = rp->ai_next) {
-		int fd = socket(rp->ai_family, rp->ai_socktype,
-			    rp->ai_protocol);
-		if (fd == -1)
+	if (header_len + body_len > laurent->response_len) {
+		*end = '\r';
+		return false;
+	}
+
+	success = !strncmp(response, "HTTP/1.", 7) && !strncmp(response + 8, " 200", 4);
+	*close = !length || strcasestr(response, "\r\nConnection: close");
+
+	if (!list_empty(&laurent->requests))
+		laurent_complete(laurent, success);
+
+	laurent->answered = true;
+	laurent->response_len -= header_len + body_len;
+	memmove(response, response + header_len + body_len, laurent->response_len);
+
+	return true;
+}
+
+static int laurent_recv(int fd, void *data)
+{
+	struct laurent *laurent = data;
+	bool close = false;
+	ssize_t n;
+
+	n = recv(fd, laurent->response + laurent->response_len,
+		 sizeof(laurent->response) - laurent->response_len - 1, 0);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	if (n > 0)
+		laurent->response_len += n;
+
+	while (laurent_parse_response(laurent, n <= 0, &close) && !close)
+		;
+
+	/* Oversized responses are not expected from the controller */
+	if (laurent->response_len == sizeof(laurent->response) - 1) {
+		warnx("laurent: malformed response");
+		if (!list_empty(&laurent->requests))
+			laurent_complete(laurent, false);
+		laurent_reset(laurent, true);
+	} else if (n <= 0 || close) {
+		/*
+		 * Persistent connections are closed by the controller when
+		 * idle, or after a number of commands, but one closed without
+		 * any response is a failure
+		 */
+		if (!laurent->answered)
+			warnx("laurent: connection to %s closed without response",
+			      laurent->options->server);
+		laurent_reset(laurent, laurent->answered);
+	}
+
+	return 0;
+}
+
+static int laurent_send(int fd, void *data)
+{
+	struct laurent *laurent = data;
+	struct laurent_request *req;
+	size_t offset = 0;
+	socklen_t len;
+	ssize_t n;
+	int ret;
+
+	if (!laurent->connected) {
+		len = sizeof(ret);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &ret, &len);
+		if (ret) {
+			warnx("laurent: failed to connect to %s: %s",
+			      laurent->options->server, strerror(ret));
+			laurent_reset(laurent, false);
+			return 0;
+		}
+
+		laurent->connected = true;
+	}
+
+	list_for_each_entry(req, &laurent->requests, node) {
+		if (offset + req->len <= laurent->written) {
+			offset += req->len;
 			continue;
+		}
 
-		if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
-			close(fd);
-			break;
+		n = send(fd, req->buf + laurent->written - offset,
+			 offset + req->len - laurent->written, MSG_NOSIGNAL);
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		if (n < 0) {
+			if (!laurent->answered)
+				warn("laurent: failed to send");
+			laurent_reset(laurent, laurent->answered);
+			return 0;
 		}
 
-		close(fd);
+		laurent->written += n;
+		if (laurent->written < offset + req->len)
+			return 0;
+
+		offset += req->len;
 	}
 
-	if (rp == NULL)
-		errx(1, "Could not resolve / connect to the controller\n");
+	watch_del_writefd(fd);
 
-	laurent->addr = *rp;
-	laurent->addr.ai_addr = malloc(rp->ai_addrlen);
-	memcpy(laurent->addr.ai_addr, rp->ai_addr,rp->ai_addrlen);
+	return 0;
+}
 
-	freeaddrinfo(result);           /* No longer needed */
+static void laurent_connect(struct laurent *laurent)
+{
+	struct addrinfo *addr = laurent->addr;
+	int ret;
+	int fd;
+
+	if (laurent->fd >= 0 || laurent->reconnect_timer)
+		return;
+
+	fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    addr->ai_protocol);
+	if (fd < 0) {
+		warn("laurent: failed to open socket");
+		laurent_reset(laurent, false);
+		return;
+	}
+
+	ret = connect(fd, addr->ai_addr, addr->ai_addrlen);
+	if (ret < 0 && errno != EINPROGRESS) {
+		warn("laurent: failed to connect to %s", laurent->options->server);
+		close(fd);
+		laurent_reset(laurent, false);
+		return;
+	}
+
+	laurent->fd = fd;
+
+	/* Completion of the connection is signalled by the socket being writable */
+	watch_add_readfd(fd, laurent_recv, laurent);
+	watch_add_writefd(fd, laurent_send, laurent);
 }
 
 static void *laurent_open(struct device *dev)
@@ -118,6 +399,8 @@ static void *laurent_open(struct device *dev)
 	laurent = calloc(1, sizeof(*laurent));
 
 	laurent->options = dev->control_options;
+	laurent->fd = -1;
+	list_init(&laurent->requests);
 
 	laurent_resolve(laurent);
 
@@ -127,71 +410,96 @@ static void *laurent_open(struct device *dev)
 static int laurent_power(struct device *dev, bool on)
 {
 	struct laurent *laurent = dev->cdb;
-	char buf[BUFSIZ];
-	int fd, ret, len, off;
-
-	fd = socket(laurent->addr.ai_family, laurent->addr.ai_socktype,
-		    laurent->addr.ai_protocol);
-	if (fd == -1) {
-		warn("failed to open socket\n");
-		return -1;
-	}
+	struct laurent_request *req;
+	int ret;
 
-	ret = connect(fd, laurent->addr.ai_addr, laurent->addr.ai_addrlen);
-	if (ret == -1) {
-		warn("failed to connect\n");
-		goto err;
-	}
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		err(1, "failed to allocate laurent request");
 
-	len = snprintf(buf, sizeof(buf), "GET /cmd.cgi?psw=%s&cmd=REL,%u,%d HTTP/1.0\r\n\r\n",
+	ret = asprintf(&req->buf,
+		       "GET /cmd.cgi?psw=%s&cmd=REL,%u,%d HTTP/1.1\r\n"
+		       "Host: %s\r\n"
+		       "Connection: keep-alive\r\n"
+		       "\r\n",
 		       laurent->options->password,
 		       laurent->options->relay,
-		       on);
-	if (len < 0) {
-		warn("asprintf failed\n");
-		goto err;
-	}
+		       on,
+		       laurent->options->server);
+	if (ret < 0)
+		err(1, "failed to allocate laurent request");
 
-	for (off = 0; off != len; ) {
-		ret = send(fd, buf + off, len - off, 0);
-		if (ret == -1) {
-			warn("failed to send\n");
-			goto err;
-		}
+	req->len = ret;
+	req->on = on;
+	req->queued = laurent_now_ms();
 
-		off += ret;
-	}
+	list_add(&laurent->requests, &req->node);
 
-	/* Dump controller response to stderr */
-	while (true) {
-		ret = recv(fd, buf, sizeof(buf), 0);
-		if (ret == -1) {
-			warn("failed to recv\n");
-			goto err;
-		}
+	if (laurent->connected)
+		watch_add_writefd(laurent->fd, laurent_send, laurent);
+	else
+		laurent_connect(laurent);
 
-		if (!ret)
+	return 0;
+}
+
+/*
+ * Wait for outstanding commands, e.g. the final power off, to complete as the
+ * watch loop is no longer running once the device is closed
+ */
+static void laurent_close(struct device *dev)
+{
+	struct laurent *laurent = dev->cdb;
+	uint64_t timeout = laurent_now_ms() + REQUEST_TIMEOUT;
+	struct laurent_request *req;
+	struct pollfd pfd;
+	size_t pending;
+	uint64_t now;
+
+	while (!list_empty(&laurent->requests)) {
+		now = laurent_now_ms();
+		if (now >= timeout) {
+			warnx("laurent: timeout waiting for relay %u",
+			      laurent->options->relay);
 			break;
+		}
 
-		write(STDERR_FILENO, buf, ret);
-	}
+		/* The reconnect timer isn't run without the watch loop */
+		if (laurent->fd < 0) {
+			if (laurent->reconnect_timer) {
+				watch_timer_cancel(laurent->reconnect_timer);
+				laurent->reconnect_timer = NULL;
+				usleep(RECONNECT_DELAY * 1000);
+			}
 
-	write(STDERR_FILENO, "\n", 1);
+			laurent_connect(laurent);
+			continue;
+		}
 
-	shutdown(fd, SHUT_RDWR);
-	close(fd);
+		pending = 0;
+		list_for_each_entry(req, &laurent->requests, node)
+			pending += req->len;
 
-	return 0;
+		pfd.fd = laurent->fd;
+		pfd.events = POLLIN;
+		if (!laurent->connected || laurent->written < pending)
+			pfd.events |= POLLOUT;
 
-err:
-	shutdown(fd, SHUT_RDWR);
-	close(fd);
+		if (poll(&pfd, 1, MIN(timeout - now, RECONNECT_DELAY)) <= 0)
+			continue;
+
+		if (pfd.revents & POLLOUT)
+			laurent_send(laurent->fd, laurent);
+		if (laurent->fd >= 0 && pfd.revents & (POLLIN | POLLHUP | POLLERR))
+			laurent_recv(laurent->fd, laurent);
+	}
 
-	return -1;
+	laurent_disconnect(laurent);
 }
 
 const struct control_ops laurent_ops = {
 	.parse_options = laurent_parse_options,
 	.open = laurent_open,
+	.close = laurent_close,
 	.power = laurent_power,
 };
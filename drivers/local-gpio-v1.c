@@ -64,7 +64,20 @@ int local_gpio_init(struct local_gpio *local_gpio)
 	return 0;
 }
 
-int local_gpio_set_value(struct local_gpio *local_gpio, unsigned int gpio, bool on)
+/* Lines are requested individually, so these are set one by one */
+int local_gpio_set_values(struct local_gpio *local_gpio, unsigned int mask)
 {
-	return gpiod_line_set_value(local_gpio->gpios[gpio].line, on);
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < GPIO_COUNT; ++i) {
+		if (!(mask & (1 << i)))
+			continue;
+
+		if (gpiod_line_set_value(local_gpio->gpios[i].line,
+					 local_gpio->gpios[i].value) < 0)
+			ret = -1;
+	}
+
+	return ret;
 }
@@ -21,37 +21,39 @@
 
 #include <gpiod.h>
 
-int local_gpio_init(struct local_gpio *local_gpio)
+/* Request all configured lines of the chip of @gpio at once */
+static int local_gpio_request_chip(struct local_gpio *local_gpio, int gpio,
+				   struct gpiod_request_config *req_cfg)
 {
-	struct gpiod_request_config *req_cfg;
+	struct gpiod_line_request *request;
+	struct gpiod_line_config *line_cfg;
+	const char *chip = local_gpio->options->gpios[gpio].chip;
+	char *gpiochip_path;
 	int i;
 
-	req_cfg = gpiod_request_config_new();
-	if (!req_cfg) {
-		err(1, "Unable to allocate request config");
+	if (asprintf(&gpiochip_path, "/dev/%s", chip) < 0)
+		return -1;
+
+	local_gpio->gpios[gpio].chip = gpiod_chip_open(gpiochip_path);
+	free(gpiochip_path);
+	if (!local_gpio->gpios[gpio].chip) {
+		err(1, "Unable to open gpiochip '%s'", chip);
 		return -1;
 	}
-	gpiod_request_config_set_consumer(req_cfg, "cdba");
 
-	for (i = 0; i < GPIO_COUNT; ++i) {
+	line_cfg = gpiod_line_config_new();
+	if (!line_cfg) {
+		err(1, "Unable to allocate gpio line settings");
+		return -1;
+	}
+
+	for (i = gpio; i < GPIO_COUNT; ++i) {
 		struct gpiod_line_settings *line_settings;
-		struct gpiod_line_config *line_cfg;
-		char *gpiochip_path;
 
-		if (!local_gpio->options->gpios[i].present)
+		if (!local_gpio->options->gpios[i].present ||
+		    strcmp(local_gpio->options->gpios[i].chip, chip))
 			continue;
 
-		if (asprintf(&gpiochip_path, "/dev/%s", local_gpio->options->gpios[i].chip) < 0) {
-			free(local_gpio);
-			return -1;
-		}
-
-		local_gpio->gpios[i].chip = gpiod_chip_open(gpiochip_path);
-		if (!local_gpio->gpios[i].chip) {
-			err(1, "Unable to open gpiochip '%s'", local_gpio->options->gpios[i].chip);
-			return -1;
-		}
-
 		line_settings = gpiod_line_settings_new();
 		if (!line_settings) {
 			err(1, "Unable to allocate gpio line settings");
@@ -70,11 +72,6 @@ int local_gpio_init(struct local_gpio *local_gpio)
 			return -1;
 		}
 
-		line_cfg = gpiod_line_config_new();
-		if (!line_cfg) {
-			err(1, "Unable to allocate gpio line settings");
-			return -1;
-		}
 		if (gpiod_line_config_add_line_settings(line_cfg,
 							&local_gpio->options->gpios[i].offset, 1,
 							line_settings) < 0) {
@@ -82,23 +79,92 @@ int local_gpio_init(struct local_gpio *local_gpio)
 			return -1;
 		}
 
-		local_gpio->gpios[i].line = gpiod_chip_request_lines(local_gpio->gpios[i].chip,
-								     req_cfg, line_cfg);
+		gpiod_line_settings_free(line_settings);
+	}
+
+	request = gpiod_chip_request_lines(local_gpio->gpios[gpio].chip,
+					   req_cfg, line_cfg);
+	if (!request) {
+		err(1, "Unable to request gpios of '%s'", chip);
+		return -1;
+	}
+
+	gpiod_line_config_free(line_cfg);
+
+	/* The lines of the chip share the chip and request */
+	for (i = gpio; i < GPIO_COUNT; ++i) {
+		if (!local_gpio->options->gpios[i].present ||
+		    strcmp(local_gpio->options->gpios[i].chip, chip))
+			continue;
+
+		local_gpio->gpios[i].chip = local_gpio->gpios[gpio].chip;
+		local_gpio->gpios[i].line = request;
+	}
 
-		if (!local_gpio->gpios[i].line) {
-			err(1, "Unable to request gpio %d offset %u",
-			    i, local_gpio->options->gpios[i].offset);
+	return 0;
+}
+
+int local_gpio_init(struct local_gpio *local_gpio)
+{
+	struct gpiod_request_config *req_cfg;
+	int i;
+
+	req_cfg = gpiod_request_config_new();
+	if (!req_cfg) {
+		err(1, "Unable to allocate request config");
+		return -1;
+	}
+	gpiod_request_config_set_consumer(req_cfg, "cdba");
+
+	for (i = 0; i < GPIO_COUNT; ++i) {
+		if (!local_gpio->options->gpios[i].present)
+			continue;
+
+		/* Skip if already requested along with another line of the chip */
+		if (local_gpio->gpios[i].line)
+			continue;
+
+		if (local_gpio_request_chip(local_gpio, i, req_cfg) < 0)
 			return -1;
-		}
 	}
 
+	gpiod_request_config_free(req_cfg);
+
 	return 0;
 }
 
-int local_gpio_set_value(struct local_gpio *local_gpio, unsigned int gpio, bool on)
+/* Lines of the same chip are set at once */
+int local_gpio_set_values(struct local_gpio *local_gpio, unsigned int mask)
 {
-	return gpiod_line_request_set_value(local_gpio->gpios[gpio].line,
-					    local_gpio->options->gpios[gpio].offset,
-					    on ? GPIOD_LINE_VALUE_ACTIVE
-					       : GPIOD_LINE_VALUE_INACTIVE);
+	enum gpiod_line_value values[GPIO_COUNT];
+	unsigned int offsets[GPIO_COUNT];
+	void *request;
+	size_t count;
+	int ret = 0;
+	int i, j;
+
+	for (i = 0; i < GPIO_COUNT; ++i) {
+		if (!(mask & (1 << i)))
+			continue;
+
+		request = local_gpio->gpios[i].line;
+		count = 0;
+
+		for (j = i; j < GPIO_COUNT; ++j) {
+			if (!(mask & (1 << j)) || local_gpio->gpios[j].line != request)
+				continue;
+
+			offsets[count] = local_gpio->options->gpios[j].offset;
+			values[count] = local_gpio->gpios[j].value ? GPIOD_LINE_VALUE_ACTIVE
+								    : GPIOD_LINE_VALUE_INACTIVE;
+			count++;
+
+			mask &= ~(1 << j);
+		}
+
+		if (gpiod_line_request_set_values_subset(request, count, offsets, values) < 0)
+			ret = -1;
+	}
+
+	return ret;
 }
@@ -23,6 +23,7 @@
 
 static int local_gpio_device_power(struct local_gpio *local_gpio, bool on);
 static void local_gpio_device_usb(struct local_gpio *local_gpio, bool on);
+static void local_gpio_flush_values(struct local_gpio *local_gpio);
 
 void *local_gpio_parse_options(struct device_parser *dp)
 {
@@ -100,22 +101,36 @@ static void *local_gpio_open(struct device *dev)
 	else
 		local_gpio_device_usb(local_gpio, 0);
 
-	usleep(500000);
+	local_gpio_flush_values(local_gpio);
+
+	device_settle(dev, 500);
 
 	return local_gpio;
 }
 
+/* Update the value of @gpio, to be applied by local_gpio_flush_values() */
 static int local_gpio_toggle_io(struct local_gpio *local_gpio, unsigned int gpio, bool on)
 {
 	if (!local_gpio->options->gpios[gpio].present)
 		return -EINVAL;
 
-	if (local_gpio_set_value(local_gpio, gpio, on) < 0)
-		warn("%s:%d unable to set value", __func__, __LINE__);
+	local_gpio->gpios[gpio].value = on;
+	local_gpio->dirty |= 1 << gpio;
 
 	return 0;
 }
 
+static void local_gpio_flush_values(struct local_gpio *local_gpio)
+{
+	if (!local_gpio->dirty)
+		return;
+
+	if (local_gpio_set_values(local_gpio, local_gpio->dirty) < 0)
+		warn("%s:%d unable to set values", __func__, __LINE__);
+
+	local_gpio->dirty = 0;
+}
+
 static int local_gpio_device_power(struct local_gpio *local_gpio, bool on)
 {
 	return local_gpio_toggle_io(local_gpio, GPIO_POWER, on);
@@ -154,10 +169,18 @@ static void local_gpio_key(struct device *dev, int key, bool asserted)
 	}
 }
 
+static void local_gpio_flush(struct device *dev)
+{
+	struct local_gpio *local_gpio = dev->cdb;
+
+	local_gpio_flush_values(local_gpio);
+}
+
 const struct control_ops local_gpio_ops = {
 	.parse_options = local_gpio_parse_options,
 	.open = local_gpio_open,
 	.power = local_gpio_power,
 	.usb = local_gpio_usb,
 	.key = local_gpio_key,
+	.flush = local_gpio_flush,
 };
@@ -30,10 +30,14 @@ struct local_gpio {
 	struct {
 		void *chip;
 		void *line;
+		bool value;
 	} gpios[GPIO_COUNT];
+
+	/* mask of gpios whose value is yet to be applied */
+	unsigned int dirty;
 };
 
 int local_gpio_init(struct local_gpio *local_gpio);
-int local_gpio_set_value(struct local_gpio *local_gpio, unsigned int gpio, bool on);
+int local_gpio_set_values(struct local_gpio *local_gpio, unsigned int mask);
 
 #endif /* _LOCAL_GPIO_H_ */
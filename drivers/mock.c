@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2024, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Mock board, for exercising and benchmarking cdba without hardware.
+ *
+ * The console is a pty, on which a boot log is replayed once the board is
+ * powered on, followed by "flood" bytes of generated output, at "rate" bytes
+ * per second. Input from the client is echoed back while powered on, and
+ * synthetic status samples are sent once status updates are enabled.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <yaml.h>
+
+#include "cdba-server.h"
+#include "device.h"
+#include "device_parser.h"
+#include "status.h"
+#include "watch.h"
+
+#define TOKEN_LENGTH	16384
+
+/* Interval, in ms, at which rate limited output is produced */
+#define MOCK_OUTPUT_INTERVAL	10
+
+struct mock_options {
+	const char *boot_log;
+	unsigned int boot_delay;
+	unsigned int rate;
+	size_t flood;
+	unsigned int status_interval;
+};
+
+struct mock {
+	struct mock_options *options;
+
+	int master_fd;
+
+	bool power;
+	bool usb;
+	bool keys[2];
+
+	char *boot_log;
+	size_t boot_log_len;
+
+	/* output produced since power on, and time of power on in ms */
+	size_t output_pos;
+	uint64_t output_start;
+	struct watch_timer *output_timer;
+	bool output_watched;
+
+	struct watch_timer *status_timer;
+};
+
+static const char mock_default_boot_log[] =
+	"\r\nmock bootloader\r\n"
+	"Booting mock kernel...\r\n"
+	"[    0.000000] Linux version mock\r\n"
+	"[    0.100000] cdba mock board\r\n"
+	"\r\nmock login: ";
+
+void *mock_parse_options(struct device_parser *dp)
+{
+	struct mock_options *options;
+	char value[TOKEN_LENGTH];
+	char key[TOKEN_LENGTH];
+
+	options = calloc(1, sizeof(*options));
+	options->boot_delay = 100;
+	options->status_interval = 1000;
+
+	/* "mock: true" selects the defaults */
+	if (device_parser_accept(dp, YAML_SCALAR_EVENT, value, TOKEN_LENGTH))
+		return options;
+
+	device_parser_expect(dp, YAML_MAPPING_START_EVENT, NULL, 0);
+
+	while (device_parser_accept(dp, YAML_SCALAR_EVENT, key, TOKEN_LENGTH)) {
+		if (!device_parser_accept(dp, YAML_SCALAR_EVENT, value, TOKEN_LENGTH))
+			errx(1, "%s: expected value for \"%s\"", __func__, key);
+
+		if (!strcmp(key, "boot_log"))
+			options->boot_log = strdup(value);
+		else if (!strcmp(key, "boot_delay"))
+			options->boot_delay = strtoul(value, NULL, 0);
+		else if (!strcmp(key, "rate"))
+			options->rate = strtoul(value, NULL, 0);
+		else if (!strcmp(key, "flood"))
+			options->flood = strtoull(value, NULL, 0);
+		else if (!strcmp(key, "status_interval"))
+			options->status_interval = strtoul(value, NULL, 0);
+		else
+			errx(1, "%s: unknown option \"%s\"", __func__, key);
+	}
+
+	device_parser_expect(dp, YAML_MAPPING_END_EVENT, NULL, 0);
+
+	return options;
+}
+
+static uint64_t mock_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void mock_load_boot_log(struct mock *mock)
+{
+	const char *path = mock->options->boot_log;
+	size_t size = 0;
+	FILE *fp;
+	size_t n;
+
+	if (!path) {
+		mock->boot_log = strdup(mock_default_boot_log);
+		mock->boot_log_len = strlen(mock->boot_log);
+		return;
+	}
+
+	fp = fopen(path, "r");
+	if (!fp)
+		err(1, "failed to open mock boot log %s", path);
+
+	do {
+		size += BUFSIZ;
+		mock->boot_log = realloc(mock->boot_log, size);
+		if (!mock->boot_log)
+			err(1, "failed to allocate mock boot log");
+
+		n = fread(mock->boot_log + mock->boot_log_len, 1,
+			  size - mock->boot_log_len, fp);
+		mock->boot_log_len += n;
+	} while (mock->boot_log_len == size);
+
+	fclose(fp);
+}
+
+/*
+ * Fill @buf with the console output from @pos on, the boot log followed by
+ * numbered lines of flood.
+ *
+ * Return: number of bytes filled in
+ */
+static size_t mock_generate(struct mock *mock, size_t pos, char *buf, size_t len)
+{
+	size_t total = mock->boot_log_len + mock->options->flood;
+	size_t line_len;
+	size_t offset;
+	size_t count = 0;
+	size_t n;
+	char line[64];
+
+	len = MIN(len, total - pos);
+
+	if (pos < mock->boot_log_len) {
+		count = MIN(len, mock->boot_log_len - pos);
+		memcpy(buf, mock->boot_log + pos, count);
+	}
+
+	/* Flood lines are of fixed length, so any position can be generated */
+	line_len = snprintf(line, sizeof(line), "mock flood line %012zu\r\n", (size_t)0);
+	while (count < len) {
+		offset = pos + count - mock->boot_log_len;
+
+		snprintf(line, sizeof(line), "mock flood line %012zu\r\n",
+			 offset / line_len);
+
+		n = MIN(len - count, line_len - offset % line_len);
+		memcpy(buf + count, line + offset % line_len, n);
+		count += n;
+	}
+
+	return count;
+}
+
+static int mock_output_writable(int fd, void *data);
+static void mock_output_timeout(void *data);
+
+static void mock_output(struct mock *mock)
+{
+	size_t total = mock->boot_log_len + mock->options->flood;
+	size_t allowed = SIZE_MAX;
+	uint64_t elapsed;
+	char buf[4096];
+	ssize_t n;
+	size_t len;
+
+	while (mock->power && mock->output_pos < total) {
+		if (mock->options->rate) {
+			elapsed = mock_now_ms() - mock->output_start;
+			allowed = elapsed * mock->options->rate / 1000 - mock->output_pos;
+			if (!allowed) {
+				mock->output_timer = watch_timer_add(MOCK_OUTPUT_INTERVAL,
+								     mock_output_timeout,
+								     mock);
+				break;
+			}
+		}
+
+		len = mock_generate(mock, mock->output_pos, buf, MIN(sizeof(buf), allowed));
+
+		n = write(mock->master_fd, buf, len);
+		if (n < 0 && errno == EAGAIN) {
+			/* wait for the console to catch up */
+			watch_add_writefd(mock->master_fd, mock_output_writable, mock);
+			mock->output_watched = true;
+			return;
+		} else if (n < 0) {
+			warn("failed to write mock console");
+			break;
+		}
+
+		mock->output_pos += n;
+	}
+
+	if (mock->output_watched) {
+		watch_del_writefd(mock->master_fd);
+		mock->output_watched = false;
+	}
+}
+
+static int mock_output_writable(int fd, void *data)
+{
+	mock_output(data);
+
+	return 0;
+}
+
+static void mock_output_timeout(void *data)
+{
+	struct mock *mock = data;
+
+	mock->output_timer = NULL;
+	mock_output(mock);
+}
+
+static void mock_output_stop(struct mock *mock)
+{
+	watch_timer_cancel(mock->output_timer);
+	mock->output_timer = NULL;
+
+	if (mock->output_watched) {
+		watch_del_writefd(mock->master_fd);
+		mock->output_watched = false;
+	}
+}
+
+static void mock_boot(void *data)
+{
+	struct mock *mock = data;
+
+	mock->output_timer = NULL;
+	mock->output_pos = 0;
+	mock->output_start = mock_now_ms();
+
+	mock_output(mock);
+}
+
+/* Echo input from the client while the board is powered */
+static int mock_input(int fd, void *data)
+{
+	struct mock *mock = data;
+	char buf[128];
+	ssize_t n;
+
+	n = read(fd, buf, sizeof(buf));
+	if (n <= 0)
+		return 0;
+
+	if (mock->power)
+		write(fd, buf, n);
+
+	return 0;
+}
+
+static void *mock_open(struct device *dev)
+{
+	struct mock *mock;
+
+	mock = calloc(1, sizeof(*mock));
+	mock->options = dev->control_options;
+	mock->master_fd = -1;
+
+	mock_load_boot_log(mock);
+
+	return mock;
+}
+
+static int mock_power(struct device *dev, bool on)
+{
+	struct mock *mock = dev->cdb;
+
+	if (on == mock->power)
+		return 0;
+
+	mock->power = on;
+
+	mock_output_stop(mock);
+	if (on)
+		mock->output_timer = watch_timer_add(mock->options->boot_delay,
+						     mock_boot, mock);
+
+	return 0;
+}
+
+static void mock_usb(struct device *dev, bool on)
+{
+	struct mock *mock = dev->cdb;
+
+	mock->usb = on;
+}
+
+static void mock_key(struct device *dev, int key, bool asserted)
+{
+	struct mock *mock = dev->cdb;
+
+	if (key < 0 || key >= (int)(sizeof(mock->keys) / sizeof(mock->keys[0])))
+		return;
+
+	mock->keys[key] = asserted;
+}
+
+static void mock_status(void *data)
+{
+	struct mock *mock = data;
+	struct status_value dc[] = {
+		{
+			.unit = STATUS_MV,
+			.value = 12000 + rand() % 100,
+		},
+		{
+			.unit = STATUS_MA,
+			.value = mock->power ? 400 + rand() % 200 : 0,
+		},
+		{}
+	};
+	struct status_value usb[] = {
+		{
+			.unit = STATUS_MV,
+			.value = mock->usb ? 5000 + rand() % 50 : 0,
+		},
+		{}
+	};
+
+	status_send_values("dc", dc);
+	status_send_values("usb", usb);
+
+	mock->status_timer = watch_timer_add(mock->options->status_interval,
+					     mock_status, mock);
+}
+
+static void mock_status_enable(struct device *dev)
+{
+	struct mock *mock = dev->cdb;
+
+	if (!mock->status_timer)
+		mock->status_timer = watch_timer_add(mock->options->status_interval,
+						     mock_status, mock);
+}
+
+const struct control_ops mock_ops = {
+	.parse_options = mock_parse_options,
+	.open = mock_open,
+	.power = mock_power,
+	.usb = mock_usb,
+	.key = mock_key,
+	.status_enable = mock_status_enable,
+};
+
+/* The console is the regular tty console, attached to the slave of a pty */
+static void *mock_console_open(struct device *dev)
+{
+	struct mock *mock = dev->cdb;
+	int slave_fd;
+
+	if (!mock)
+		errx(1, "mock console requires the mock controller");
+
+	if (openpty(&mock->master_fd, &slave_fd, NULL, NULL, NULL) < 0)
+		err(1, "failed to allocate mock console");
+
+	fcntl(mock->master_fd, F_SETFL, O_NONBLOCK);
+	fcntl(mock->master_fd, F_SETFD, FD_CLOEXEC);
+
+	free(dev->console_dev);
+	dev->console_dev = strdup(ttyname(slave_fd));
+
+	watch_add_readfd(mock->master_fd, mock_input, mock);
+
+	dev->console = console_ops.open(dev);
+	close(slave_fd);
+
+	return dev->console;
+}
+
+static int mock_console_write(struct device *dev, const void *buf, size_t len)
+{
+	return console_ops.write(dev, buf, len);
+}
+
+static void mock_console_send_break(struct device *dev)
+{
+	console_ops.send_break(dev);
+}
+
+const struct console_ops mock_console_ops = {
+	.open = mock_console_open,
+	.write = mock_console_write,
+	.send_break = mock_console_send_break,
+};
@@ -41,6 +41,8 @@ struct qcomlt_dbg {
 	enum qcomlt_parse_state parse_state;
 	unsigned long mv;
 	unsigned long ma;
+
+	struct watch_timer *status_timer;
 };
 
 static void *qcomlt_dbg_open(struct device *dev)
@@ -196,7 +198,7 @@ static void qcomlt_dbg_request_status(void *data)
 
 	write(dbg->fd, "s", 1);
 
-	watch_timer_add(200, qcomlt_dbg_request_status, dbg);
+	dbg->status_timer = watch_timer_add(200, qcomlt_dbg_request_status, dbg);
 }
 
 static void qcomlt_dbg_status_enable(struct device *dev)
@@ -204,7 +206,10 @@ static void qcomlt_dbg_status_enable(struct device *dev)
 	struct qcomlt_dbg *dbg = dev->cdb;
 
 	watch_add_readfd(dbg->fd, qcomlt_dbg_ctrl_data, dbg);
-	watch_timer_add(200, qcomlt_dbg_request_status, dbg);
+
+	/* Don't start a second poll loop if enabled again */
+	watch_timer_cancel(dbg->status_timer);
+	dbg->status_timer = watch_timer_add(200, qcomlt_dbg_request_status, dbg);
 }
 
 const struct control_ops qcomlt_dbg_ops = {
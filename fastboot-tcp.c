@@ -0,0 +1,730 @@
+/*
+ * Copyright (c) 2024, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Fastboot over TCP, as implemented by network attached boards, and over unix
+ * sockets for fastboot emulators such as cdba-fastboot-emu.
+ *
+ * After connecting, both ends exchange "FB" followed by their two digit
+ * protocol version, and each packet of the usb transport is then preceded by
+ * its length, as 64-bit big endian. The device is considered present while
+ * the connection is established.
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cdba-server.h"
+#include "fastboot.h"
+#include "watch.h"
+
+#define FASTBOOT_TCP_PORT		"5554"
+#define FASTBOOT_TCP_HANDSHAKE		"FB01"
+#define FASTBOOT_TCP_HEADER		8
+
+/* Interval, in ms, at which the device is looked for while absent */
+#define FASTBOOT_TCP_POLL_INTERVAL	250
+
+/* Time, in ms, to wait for the device to answer or accept data */
+#define FASTBOOT_TCP_TIMEOUT		10000
+
+/* Downloads are queued as FASTBOOT_TCP_CHUNKS packets of FASTBOOT_TCP_CHUNK */
+#define FASTBOOT_TCP_CHUNK	(64*1024)
+#define FASTBOOT_TCP_CHUNKS	8
+
+struct fastboot_tcp {
+	struct fastboot *fb;
+	const char *address;
+
+	struct addrinfo *addrs;
+	struct addrinfo *addr;
+	/* @addrs are from getaddrinfo(), rather than the emulator's socket */
+	bool resolved;
+	int resolve_error;
+
+	int fd;
+	bool connected;
+	char handshake[4];
+	size_t handshake_len;
+	struct watch_timer *connect_timer;
+
+	/*
+	 * Queue of payload packets, with their headers, from head, followed by
+	 * the one being filled, if not all are queued
+	 */
+	char *chunks[FASTBOOT_TCP_CHUNKS];
+	size_t chunk_len[FASTBOOT_TCP_CHUNKS];
+	unsigned int head;
+	unsigned int queued;
+	size_t sent;
+	size_t fill_len;
+
+	int error;
+	bool watching;
+	bool finishing;
+
+	/* a response is to be passed to fastboot_transport_response() */
+	bool reading;
+};
+
+static void fastboot_tcp_connect(void *data);
+static int fastboot_tcp_resolve(struct fastboot_tcp *tcp);
+
+static void fastboot_tcp_unwatch(struct fastboot_tcp *tcp)
+{
+	if (!tcp->watching)
+		return;
+
+	watch_del_writefd(tcp->fd);
+	tcp->watching = false;
+}
+
+/* Resolve the name again, as e.g. a power cycle may change the DHCP lease */
+static void fastboot_tcp_forget(struct fastboot_tcp *tcp)
+{
+	if (!tcp->resolved)
+		return;
+
+	freeaddrinfo(tcp->addrs);
+	tcp->addrs = NULL;
+	tcp->addr = NULL;
+	tcp->resolved = false;
+}
+
+/* Close the connection and look for the device again, on the next address */
+static void fastboot_tcp_retry(struct fastboot_tcp *tcp)
+{
+	if (tcp->fd >= 0) {
+		watch_del_readfd(tcp->fd);
+		close(tcp->fd);
+		tcp->fd = -1;
+	}
+
+	if (tcp->addr)
+		tcp->addr = tcp->addr->ai_next;
+
+	/* All addresses failed, start over */
+	if (!tcp->addr) {
+		fastboot_tcp_forget(tcp);
+		tcp->addr = tcp->addrs;
+	}
+
+	tcp->connect_timer = watch_timer_add(FASTBOOT_TCP_POLL_INTERVAL,
+					     fastboot_tcp_connect, tcp);
+}
+
+static void fastboot_tcp_disconnect(struct fastboot_tcp *tcp)
+{
+	fastboot_tcp_unwatch(tcp);
+
+	tcp->connected = false;
+	tcp->queued = 0;
+	tcp->fill_len = 0;
+	tcp->error = -ENODEV;
+	tcp->finishing = false;
+	tcp->reading = false;
+
+	fastboot_transport_disconnect(tcp->fb);
+
+	fastboot_tcp_forget(tcp);
+	fastboot_tcp_retry(tcp);
+}
+
+static int fastboot_tcp_read(void *data, void *buf, size_t len);
+
+/*
+ * Responses are read synchronously, unless asked for by read_async, so data
+ * showing up otherwise is unexpected and a hangup is the device going away.
+ */
+static int fastboot_tcp_hangup(int fd, void *data)
+{
+	struct fastboot_tcp *tcp = data;
+	char buf[64];
+	ssize_t n;
+	int len;
+
+	if (tcp->reading && recv(fd, buf, 1, MSG_PEEK) > 0) {
+		tcp->reading = false;
+
+		len = fastboot_tcp_read(tcp, buf, sizeof(buf));
+		fastboot_transport_response(tcp->fb, buf, len);
+		return 0;
+	}
+
+	n = recv(fd, buf, sizeof(buf), 0);
+	if (n > 0) {
+		warnx("discarding unsolicited data from fastboot device %s",
+		      tcp->address);
+		return 0;
+	} else if (n < 0 && errno == EAGAIN) {
+		return 0;
+	}
+
+	fastboot_tcp_disconnect(tcp);
+
+	return 0;
+}
+
+static int fastboot_tcp_handshake(int fd, void *data)
+{
+	struct fastboot_tcp *tcp = data;
+	ssize_t n;
+
+	n = recv(fd, tcp->handshake + tcp->handshake_len,
+		 sizeof(tcp->handshake) - tcp->handshake_len, 0);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	if (n <= 0) {
+		fastboot_tcp_retry(tcp);
+		return 0;
+	}
+
+	tcp->handshake_len += n;
+	if (tcp->handshake_len < sizeof(tcp->handshake))
+		return 0;
+
+	if (memcmp(tcp->handshake, "FB", 2) ||
+	    strtoul(tcp->handshake + 2, NULL, 10) < 1) {
+		warnx("unexpected fastboot handshake from %s", tcp->address);
+		fastboot_tcp_retry(tcp);
+		return 0;
+	}
+
+	watch_del_readfd(fd);
+	watch_add_readfd(fd, fastboot_tcp_hangup, tcp);
+
+	tcp->connected = true;
+	fastboot_transport_opened(tcp->fb);
+
+	return 0;
+}
+
+static int fastboot_tcp_connected(int fd, void *data)
+{
+	struct fastboot_tcp *tcp = data;
+	socklen_t len = sizeof(int);
+	int one = 1;
+	int error;
+
+	watch_del_writefd(fd);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+		close(fd);
+		tcp->fd = -1;
+		fastboot_tcp_retry(tcp);
+		return 0;
+	}
+
+	if (tcp->addr->ai_family != AF_UNIX)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (send(fd, FASTBOOT_TCP_HANDSHAKE, 4, MSG_NOSIGNAL) != 4) {
+		close(fd);
+		tcp->fd = -1;
+		fastboot_tcp_retry(tcp);
+		return 0;
+	}
+
+	tcp->handshake_len = 0;
+	watch_add_readfd(fd, fastboot_tcp_handshake, tcp);
+
+	return 0;
+}
+
+static void fastboot_tcp_connect(void *data)
+{
+	struct fastboot_tcp *tcp = data;
+	struct addrinfo *addr = tcp->addr;
+	int ret;
+	int fd;
+
+	tcp->connect_timer = NULL;
+
+	/* Name resolution is retried, as e.g. DHCP may not have caught up yet */
+	if (!addr) {
+		if (fastboot_tcp_resolve(tcp) < 0) {
+			tcp->connect_timer = watch_timer_add(FASTBOOT_TCP_POLL_INTERVAL,
+							     fastboot_tcp_connect, tcp);
+			return;
+		}
+
+		addr = tcp->addr;
+	}
+
+	fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    addr->ai_protocol);
+	if (fd < 0) {
+		warn("failed to create fastboot socket for %s", tcp->address);
+		fastboot_tcp_retry(tcp);
+		return;
+	}
+
+	tcp->fd = fd;
+
+	ret = connect(fd, addr->ai_addr, addr->ai_addrlen);
+	if (ret < 0 && errno != EINPROGRESS) {
+		close(fd);
+		tcp->fd = -1;
+		fastboot_tcp_retry(tcp);
+		return;
+	}
+
+	watch_add_writefd(fd, fastboot_tcp_connected, tcp);
+}
+
+static int fastboot_tcp_resolve(struct fastboot_tcp *tcp)
+{
+	struct addrinfo hints = {0};
+	const char *port = FASTBOOT_TCP_PORT;
+	char *address;
+	char *host;
+	char *p;
+	int ret;
+
+	address = strdup(tcp->address);
+	if (!address)
+		err(1, "failed to allocate fastboot address");
+
+	host = address;
+
+	/* host, host:port, [address] or [address]:port */
+	p = strrchr(host, ':');
+	if (p && (host[0] != '[' || p[-1] == ']')) {
+		*p = '\0';
+		port = p + 1;
+	}
+
+	if (host[0] == '[') {
+		host++;
+		p = strchr(host, ']');
+		if (p)
+			*p = '\0';
+	}
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	ret = getaddrinfo(host, port, &hints, &tcp->addrs);
+	free(address);
+	if (ret != 0) {
+		/* Only report changes, rather than every attempt */
+		if (ret != tcp->resolve_error)
+			warnx("failed to resolve %s: %s", tcp->address, gai_strerror(ret));
+		tcp->resolve_error = ret;
+		tcp->addrs = NULL;
+		return -1;
+	}
+
+	tcp->resolve_error = 0;
+	tcp->resolved = true;
+	tcp->addr = tcp->addrs;
+
+	return 0;
+}
+
+static struct fastboot_tcp *fastboot_tcp_alloc(struct fastboot *fb,
+					       const char *address)
+{
+	struct fastboot_tcp *tcp;
+
+	tcp = calloc(1, sizeof(*tcp));
+	if (!tcp)
+		err(1, "failed to allocate fastboot tcp structure");
+
+	tcp->fb = fb;
+	tcp->address = address;
+	tcp->fd = -1;
+
+	return tcp;
+}
+
+static void *fastboot_tcp_open(struct fastboot *fb, const char *address)
+{
+	struct fastboot_tcp *tcp;
+
+	tcp = fastboot_tcp_alloc(fb, address);
+
+	fastboot_tcp_connect(tcp);
+
+	return tcp;
+}
+
+static void *fastboot_emu_open(struct fastboot *fb, const char *path)
+{
+	struct sockaddr_un *addr_un;
+	struct fastboot_tcp *tcp;
+
+	tcp = fastboot_tcp_alloc(fb, path);
+
+	tcp->addrs = calloc(1, sizeof(*tcp->addrs));
+	addr_un = calloc(1, sizeof(*addr_un));
+	if (!tcp->addrs || !addr_un)
+		err(1, "failed to allocate fastboot emulator address");
+
+	addr_un->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr_un->sun_path))
+		errx(1, "fastboot emulator socket path too long: %s", path);
+	strcpy(addr_un->sun_path, path);
+
+	tcp->addrs->ai_family = AF_UNIX;
+	tcp->addrs->ai_addr = (struct sockaddr *)addr_un;
+	tcp->addrs->ai_addrlen = sizeof(*addr_un);
+	tcp->addr = tcp->addrs;
+
+	fastboot_tcp_connect(tcp);
+
+	return tcp;
+}
+
+/* Wait for the socket to become readable or writable */
+static int fastboot_tcp_wait(struct fastboot_tcp *tcp, short events)
+{
+	struct pollfd pfd = {
+		.fd = tcp->fd,
+		.events = events,
+	};
+
+	if (poll(&pfd, 1, FASTBOOT_TCP_TIMEOUT) <= 0) {
+		warnx("timeout waiting for fastboot device %s", tcp->address);
+		return -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+static int fastboot_tcp_recv(struct fastboot_tcp *tcp, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+	int ret;
+
+	while (len) {
+		ret = fastboot_tcp_wait(tcp, POLLIN);
+		if (ret < 0)
+			return ret;
+
+		n = recv(tcp->fd, p, len, 0);
+		if (n < 0 && errno == EAGAIN)
+			continue;
+
+		if (n <= 0) {
+			warnx("failed to receive from fastboot device %s", tcp->address);
+			return -ENXIO;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int fastboot_tcp_send(struct fastboot_tcp *tcp, const void *buf,
+			     size_t len, int flags)
+{
+	const char *p = buf;
+	ssize_t n;
+	int ret;
+
+	while (len) {
+		n = send(tcp->fd, p, len, MSG_NOSIGNAL | flags);
+		if (n < 0 && errno == EAGAIN) {
+			ret = fastboot_tcp_wait(tcp, POLLOUT);
+			if (ret < 0)
+				return ret;
+
+			continue;
+		}
+
+		if (n < 0) {
+			warn("failed to send to fastboot device %s", tcp->address);
+			return -errno;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int fastboot_tcp_read(void *data, void *buf, size_t len)
+{
+	struct fastboot_tcp *tcp = data;
+	uint64_t header;
+	uint64_t size;
+	char discard[64];
+	size_t xfer;
+	int ret;
+
+	if (!tcp->connected) {
+		warnx("fastboot device %s not connected", tcp->address);
+		return -ENXIO;
+	}
+
+	ret = fastboot_tcp_recv(tcp, &header, sizeof(header));
+	if (ret < 0)
+		return ret;
+
+	size = be64toh(header);
+	xfer = MIN(size, len);
+
+	ret = fastboot_tcp_recv(tcp, buf, xfer);
+	if (ret < 0)
+		return ret;
+
+	/* Drop whatever doesn't fit, to stay in sync with the packets */
+	for (size -= xfer; size; size -= MIN(size, sizeof(discard))) {
+		ret = fastboot_tcp_recv(tcp, discard, MIN(size, sizeof(discard)));
+		if (ret < 0)
+			return ret;
+	}
+
+	return xfer;
+}
+
+static int fastboot_tcp_write(void *data, const void *buf, size_t len)
+{
+	struct fastboot_tcp *tcp = data;
+	uint64_t header = htobe64(len);
+	int ret;
+
+	if (!tcp->connected) {
+		warnx("fastboot device %s not connected", tcp->address);
+		return -1;
+	}
+
+	ret = fastboot_tcp_send(tcp, &header, sizeof(header), MSG_MORE);
+	if (ret < 0)
+		return -1;
+
+	ret = fastboot_tcp_send(tcp, buf, len, 0);
+	if (ret < 0)
+		return -1;
+
+	return len;
+}
+
+static int fastboot_tcp_read_async(void *data)
+{
+	struct fastboot_tcp *tcp = data;
+
+	if (!tcp->connected)
+		return -ENXIO;
+
+	tcp->reading = true;
+
+	return 0;
+}
+
+static int fastboot_tcp_writable(int fd, void *data);
+
+/* Send queued packets, without blocking unless @wait */
+static void fastboot_tcp_send_queued(struct fastboot_tcp *tcp, bool wait)
+{
+	size_t len;
+	ssize_t n;
+
+	while (tcp->queued && !tcp->error) {
+		len = tcp->chunk_len[tcp->head] - tcp->sent;
+
+		n = send(tcp->fd, tcp->chunks[tcp->head] + tcp->sent, len,
+			 MSG_NOSIGNAL);
+		if (n < 0 && errno == EAGAIN) {
+			if (!wait)
+				break;
+
+			tcp->error = fastboot_tcp_wait(tcp, POLLOUT);
+			continue;
+		}
+
+		if (n < 0) {
+			warn("failed to send download to fastboot device %s",
+			     tcp->address);
+			tcp->error = -errno;
+			break;
+		}
+
+		tcp->sent += n;
+		if (tcp->sent < tcp->chunk_len[tcp->head])
+			continue;
+
+		tcp->head = (tcp->head + 1) % FASTBOOT_TCP_CHUNKS;
+		tcp->queued--;
+		tcp->sent = 0;
+	}
+
+	if (tcp->error) {
+		tcp->queued = 0;
+		tcp->fill_len = 0;
+	}
+
+	if (!tcp->queued) {
+		fastboot_tcp_unwatch(tcp);
+	} else if (!tcp->watching) {
+		watch_add_writefd(tcp->fd, fastboot_tcp_writable, tcp);
+		tcp->watching = true;
+	}
+}
+
+static int fastboot_tcp_writable(int fd, void *data)
+{
+	struct fastboot_tcp *tcp = data;
+
+	fastboot_tcp_send_queued(tcp, false);
+
+	if (tcp->finishing && !tcp->queued) {
+		tcp->finishing = false;
+		fastboot_transport_drained(tcp->fb, tcp->error);
+	}
+
+	if (tcp->queued < FASTBOOT_TCP_CHUNKS)
+		fastboot_transport_writable(tcp->fb);
+
+	return 0;
+}
+
+static int fastboot_tcp_download_start(void *data)
+{
+	struct fastboot_tcp *tcp = data;
+	int i;
+
+	for (i = 0; i < FASTBOOT_TCP_CHUNKS; i++) {
+		if (tcp->chunks[i])
+			continue;
+
+		tcp->chunks[i] = malloc(FASTBOOT_TCP_HEADER + FASTBOOT_TCP_CHUNK);
+		if (!tcp->chunks[i])
+			err(1, "failed to allocate fastboot tcp buffers");
+	}
+
+	tcp->head = 0;
+	tcp->queued = 0;
+	tcp->sent = 0;
+	tcp->fill_len = 0;
+	tcp->error = 0;
+	tcp->finishing = false;
+
+	return 0;
+}
+
+static bool fastboot_tcp_download_ready(void *data, size_t len)
+{
+	struct fastboot_tcp *tcp = data;
+	size_t space;
+
+	if (!tcp->queued || tcp->error)
+		return true;
+
+	space = (FASTBOOT_TCP_CHUNKS - tcp->queued) * FASTBOOT_TCP_CHUNK - tcp->fill_len;
+
+	return space >= len;
+}
+
+/* Queue the packet being filled, prefixed by its length */
+static void fastboot_tcp_queue_fill(struct fastboot_tcp *tcp)
+{
+	unsigned int fill = (tcp->head + tcp->queued) % FASTBOOT_TCP_CHUNKS;
+	uint64_t header = htobe64(tcp->fill_len);
+
+	memcpy(tcp->chunks[fill], &header, sizeof(header));
+
+	tcp->chunk_len[fill] = FASTBOOT_TCP_HEADER + tcp->fill_len;
+	tcp->queued++;
+	tcp->fill_len = 0;
+}
+
+static int fastboot_tcp_download_write(void *data, const void *buf, size_t len)
+{
+	struct fastboot_tcp *tcp = data;
+	const char *p = buf;
+	unsigned int fill;
+	size_t xfer;
+
+	while (len > 0 && !tcp->error) {
+		/* All packets are queued, wait for the first to be sent */
+		if (tcp->queued == FASTBOOT_TCP_CHUNKS) {
+			fastboot_tcp_send_queued(tcp, true);
+			continue;
+		}
+
+		fill = (tcp->head + tcp->queued) % FASTBOOT_TCP_CHUNKS;
+		xfer = MIN(len, FASTBOOT_TCP_CHUNK - tcp->fill_len);
+
+		memcpy(tcp->chunks[fill] + FASTBOOT_TCP_HEADER + tcp->fill_len,
+		       p, xfer);
+		tcp->fill_len += xfer;
+
+		if (tcp->fill_len == FASTBOOT_TCP_CHUNK)
+			fastboot_tcp_queue_fill(tcp);
+
+		p += xfer;
+		len -= xfer;
+	}
+
+	fastboot_tcp_send_queued(tcp, false);
+
+	return tcp->error;
+}
+
+static int fastboot_tcp_download_finish(void *data, bool discard, bool wait)
+{
+	struct fastboot_tcp *tcp = data;
+
+	/* A partially sent packet has to be completed to stay in sync */
+	if (discard) {
+		tcp->queued = MIN(tcp->queued, tcp->sent ? 1 : 0);
+		tcp->fill_len = 0;
+	} else if (tcp->fill_len) {
+		fastboot_tcp_queue_fill(tcp);
+	}
+
+	fastboot_tcp_send_queued(tcp, false);
+
+	if (!wait && tcp->queued) {
+		tcp->finishing = true;
+		return -EINPROGRESS;
+	}
+
+	fastboot_tcp_send_queued(tcp, true);
+
+	return tcp->error;
+}
+
+const struct fastboot_transport fastboot_tcp_transport = {
+	.open = fastboot_tcp_open,
+	.read = fastboot_tcp_read,
+	.write = fastboot_tcp_write,
+	.read_async = fastboot_tcp_read_async,
+	.download_start = fastboot_tcp_download_start,
+	.download_ready = fastboot_tcp_download_ready,
+	.download_write = fastboot_tcp_download_write,
+	.download_finish = fastboot_tcp_download_finish,
+};
+
+const struct fastboot_transport fastboot_emu_transport = {
+	.open = fastboot_emu_open,
+	.read = fastboot_tcp_read,
+	.write = fastboot_tcp_write,
+	.read_async = fastboot_tcp_read_async,
+	.download_start = fastboot_tcp_download_start,
+	.download_ready = fastboot_tcp_download_ready,
+	.download_write = fastboot_tcp_download_write,
+	.download_finish = fastboot_tcp_download_finish,
+};
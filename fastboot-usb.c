@@ -0,0 +1,672 @@
+/*
+ * Copyright (c) 2016-2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <linux/usbdevice_fs.h>
+#include <linux/usb/ch9.h>
+
+#include <sys/ioctl.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libudev.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cdba-server.h"
+#include "fastboot.h"
+#include "watch.h"
+
+#define MAX_USBFS_BULK_SIZE (16*1024)
+
+/* Downloads are streamed using FASTBOOT_URB_COUNT asynchronous transfers */
+#define FASTBOOT_URB_SIZE	(64*1024)
+#define FASTBOOT_URB_COUNT	8
+
+struct fastboot_urb {
+	struct usbdevfs_urb urb;
+
+	void *buf;
+	size_t len;
+	bool busy;
+};
+
+struct fastboot_usb {
+	struct fastboot *fb;
+	const char *serial;
+
+	int fd;
+	unsigned ep_in;
+	unsigned ep_out;
+
+	char *dev_path;
+
+	struct udev_monitor *mon;
+
+	/* state of an ongoing streamed download */
+	struct fastboot_urb *urbs[FASTBOOT_URB_COUNT];
+	struct fastboot_urb *fill;
+	unsigned int urbs_busy;
+	int error;
+	bool watching;
+	bool finishing;
+
+	/* asynchronous read of a response, reaped along with the download */
+	struct fastboot_urb *response;
+	int response_len;
+	bool response_done;
+};
+
+static int fastboot_usb_read(void *data, void *buf, size_t len)
+{
+	struct usbdevfs_bulktransfer bulk = {0};
+	struct fastboot_usb *usb = data;
+	int n;
+
+	bulk.ep = usb->ep_in;
+	bulk.len = len;
+	bulk.data = buf;
+	bulk.timeout = 1000;
+
+	n = ioctl(usb->fd, USBDEVFS_BULK, &bulk);
+	if (n < 0) {
+		warn("failed to receive usb bulk transfer");
+		return -ENXIO;
+	}
+
+	return n;
+}
+
+static int fastboot_usb_write(void *data, const void *buf, size_t len)
+{
+	struct usbdevfs_bulktransfer bulk = {0};
+	struct fastboot_usb *usb = data;
+	size_t count = 0;
+	char *p = (char *)buf;
+	int n;
+
+	do {
+		bulk.ep = usb->ep_out;
+		bulk.len = MIN(len, MAX_USBFS_BULK_SIZE);
+		bulk.data = p;
+		bulk.timeout = 1000;
+
+		n = ioctl(usb->fd, USBDEVFS_BULK, &bulk);
+		if (n < 0) {
+			warn("failed to send usb bulk transfer");
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+		count += n;
+	} while (len > 0);
+
+	return count;
+}
+
+static int parse_usb_desc(int usbfd, unsigned *ep_in, unsigned *ep_out)
+{
+	const struct usb_interface_descriptor *ifc;
+	const struct usb_endpoint_descriptor *ept;
+	const struct usb_device_descriptor *dev;
+	const struct usb_config_descriptor *cfg;
+	const struct usb_descriptor_header *hdr;
+	unsigned type;
+	unsigned out;
+	unsigned in;
+	unsigned k;
+	unsigned l;
+	ssize_t n;
+	char *ptr;
+	char *end;
+	char desc[1024];
+	int ret;
+	int id;
+
+	n = read(usbfd, desc, sizeof(desc));
+	if (n < 0)
+		return n;
+
+	ptr = desc;
+	end = ptr + n;
+
+	dev = (void *)ptr;
+	ptr += dev->bLength;
+	if (ptr >= end || dev->bDescriptorType != USB_DT_DEVICE)
+		return -EINVAL;
+
+	cfg = (void *)ptr;
+	ptr += cfg->bLength;
+	if (ptr >= end || cfg->bDescriptorType != USB_DT_CONFIG)
+		return -EINVAL;
+
+	for (k = 0; k < cfg->bNumInterfaces; k++) {
+		if (ptr >= end)
+			return -EINVAL;
+
+		do {
+			ifc = (void *)ptr;
+			if (ifc->bLength < USB_DT_INTERFACE_SIZE)
+				return -EINVAL;
+
+			ptr += ifc->bLength;
+		} while (ptr < end && ifc->bDescriptorType != USB_DT_INTERFACE);
+
+		in = -1;
+		out = -1;
+
+		for (l = 0; l < ifc->bNumEndpoints; l++) {
+			if (ptr >= end)
+				return -EINVAL;
+
+			do {
+				ept = (void *)ptr;
+				if (ept->bLength < USB_DT_ENDPOINT_SIZE)
+					return -EINVAL;
+
+				ptr += ept->bLength;
+			} while (ptr < end && ept->bDescriptorType != USB_DT_ENDPOINT);
+
+			type = ept->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK;
+			if (type != USB_ENDPOINT_XFER_BULK)
+				continue;
+
+			if (ept->bEndpointAddress & USB_DIR_IN)
+				in = ept->bEndpointAddress;
+			else
+				out = ept->bEndpointAddress;
+
+			if (ptr >= end)
+				break;
+
+			hdr = (void *)ptr;
+			if (hdr->bDescriptorType == USB_DT_SS_ENDPOINT_COMP)
+				ptr += USB_DT_SS_EP_COMP_SIZE;
+		}
+
+		if (ifc->bInterfaceClass != 0xff)
+			continue;
+
+		if (ifc->bInterfaceSubClass != 0x42)
+			continue;
+
+		if (ifc->bInterfaceProtocol != 0x03)
+			continue;
+
+		id = ifc->bInterfaceNumber;
+		ret = ioctl(usbfd, USBDEVFS_CLAIMINTERFACE, &id);
+		if (ret < 0) {
+			warn("failed to claim interface");
+			continue;
+		}
+
+		*ep_in = in;
+		*ep_out = out;
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static int handle_fastboot_add(struct fastboot_usb *usb, struct udev_device *dev)
+{
+	const char *dev_path;
+	const char *dev_node;
+	unsigned ep_out;
+	unsigned ep_in;
+	int usbfd;
+	int ret;
+
+	dev_path = udev_device_get_devpath(dev);
+	dev_node = udev_device_get_devnode(dev);
+
+	usbfd = open(dev_node, O_RDWR);
+	if (usbfd < 0)
+		return usbfd;
+
+	ret = parse_usb_desc(usbfd, &ep_in, &ep_out);
+	if (ret < 0) {
+		close(usbfd);
+		return ret;
+	}
+
+	usb->ep_in = ep_in;
+	usb->ep_out = ep_out;
+	usb->fd = usbfd;
+	free(usb->dev_path);
+	usb->dev_path = strdup(dev_path);
+
+	fastboot_transport_opened(usb->fb);
+
+	return 0;
+}
+
+/* Forget about in-flight transfers, after the device failed to complete them */
+static void fastboot_urb_discard(struct fastboot_usb *usb, int error)
+{
+	int i;
+
+	for (i = 0; i < FASTBOOT_URB_COUNT; i++) {
+		if (usb->urbs[i])
+			usb->urbs[i]->busy = false;
+	}
+
+	usb->urbs_busy = 0;
+	usb->fill = NULL;
+	usb->error = error;
+
+	if (usb->response && usb->response->busy) {
+		usb->response->busy = false;
+		usb->response_len = error;
+		usb->response_done = true;
+	}
+}
+
+static void fastboot_urb_unwatch(struct fastboot_usb *usb)
+{
+	if (!usb->watching)
+		return;
+
+	watch_del_writefd(usb->fd);
+	usb->watching = false;
+}
+
+static int fastboot_urb_completion(int fd, void *data);
+
+static void fastboot_urb_watch(struct fastboot_usb *usb)
+{
+	if (usb->watching)
+		return;
+
+	watch_add_writefd(usb->fd, fastboot_urb_completion, usb);
+	usb->watching = true;
+}
+
+static int handle_udev_event(int fd, void *data)
+{
+	struct fastboot_usb *usb = data;
+	struct udev_device* dev;
+	const char *dev_path;
+	const char *action;
+	const char *serial;
+
+	dev = udev_monitor_receive_device(usb->mon);
+
+	action = udev_device_get_action(dev);
+	dev_path = udev_device_get_devpath(dev);
+
+	if (!action || !dev_path)
+		goto unref_dev;
+
+	if (!strcmp(action, "add")) {
+		serial = udev_device_get_sysattr_value(dev, "serial");
+		if (!serial || strcmp(serial, usb->serial))
+			goto unref_dev;
+
+		handle_fastboot_add(usb, dev);
+	} else if (!strcmp(action, "remove")) {
+		if (!usb->dev_path || strcmp(dev_path, usb->dev_path))
+			goto unref_dev;
+
+		/*
+		 * In-flight transfers are discarded with the file descriptor,
+		 * the download is failed as the disconnect is reported.
+		 */
+		fastboot_urb_unwatch(usb);
+		fastboot_urb_discard(usb, -ENODEV);
+		usb->finishing = false;
+		usb->response_done = false;
+
+		close(usb->fd);
+		usb->fd = -1;
+		free(usb->dev_path);
+		usb->dev_path = NULL;
+
+		fastboot_transport_disconnect(usb->fb);
+	}
+
+unref_dev:
+	udev_device_unref(dev);
+
+	return 0;
+}
+
+static void *fastboot_usb_open(struct fastboot *fb, const char *serial)
+{
+	struct fastboot_usb *usb;
+	struct udev* udev;
+	int fd;
+	struct udev_enumerate* udev_enum;
+	struct udev_list_entry* first, *item;
+
+	udev = udev_new();
+	if (!udev)
+		err(1, "udev_new() failed");
+
+	usb = calloc(1, sizeof(struct fastboot_usb));
+	if (!usb)
+		err(1, "failed to allocate fastboot structure");
+
+	usb->fb = fb;
+	usb->serial = serial;
+	usb->fd = -1;
+
+	usb->mon = udev_monitor_new_from_netlink(udev, "udev");
+	udev_monitor_filter_add_match_subsystem_devtype(usb->mon, "usb", NULL);
+	udev_monitor_enable_receiving(usb->mon);
+
+	fd = udev_monitor_get_fd(usb->mon);
+
+	watch_add_readfd(fd, handle_udev_event, usb);
+
+	udev_enum = udev_enumerate_new(udev);
+	udev_enumerate_add_match_subsystem(udev_enum, "usb");
+	udev_enumerate_add_match_sysattr(udev_enum, "serial", serial);
+	udev_enumerate_scan_devices(udev_enum);
+
+	first = udev_enumerate_get_list_entry(udev_enum);
+	udev_list_entry_foreach(item, first) {
+		const char *path;
+		struct udev_device *dev;
+
+		path = udev_list_entry_get_name(item);
+		dev = udev_device_new_from_syspath(udev, path);
+		handle_fastboot_add(usb, dev);
+	}
+
+	udev_enumerate_unref(udev_enum);
+
+	return usb;
+}
+
+static int fastboot_urb_submit(struct fastboot_usb *usb, struct fastboot_urb *urb)
+{
+	int ret;
+
+	memset(&urb->urb, 0, sizeof(urb->urb));
+	urb->urb.type = USBDEVFS_URB_TYPE_BULK;
+	urb->urb.endpoint = usb->ep_out;
+	urb->urb.buffer = urb->buf;
+	urb->urb.buffer_length = urb->len;
+	urb->urb.usercontext = urb;
+
+	ret = ioctl(usb->fd, USBDEVFS_SUBMITURB, &urb->urb);
+	if (ret < 0) {
+		warn("failed to submit usb bulk transfer");
+		usb->error = -errno;
+		return -1;
+	}
+
+	urb->busy = true;
+	usb->urbs_busy++;
+
+	return 0;
+}
+
+/**
+ * fastboot_urb_reap() - retire a completed transfer
+ * @usb:	usb transport context
+ * @wait:	block until a transfer has completed
+ *
+ * Return: 0 if a transfer was retired, -EAGAIN if none has completed, other
+ * negative errno on failure
+ */
+static int fastboot_urb_reap(struct fastboot_usb *usb, bool wait)
+{
+	struct usbdevfs_urb *usb_urb;
+	struct fastboot_urb *urb;
+	int ret;
+
+	ret = ioctl(usb->fd, wait ? USBDEVFS_REAPURB : USBDEVFS_REAPURBNDELAY, &usb_urb);
+	if (ret < 0)
+		return -errno;
+
+	urb = usb_urb->usercontext;
+	urb->busy = false;
+
+	if (urb == usb->response) {
+		usb->response_len = usb_urb->status < 0 ? usb_urb->status :
+				    usb_urb->actual_length;
+		usb->response_done = true;
+		return 0;
+	}
+
+	usb->urbs_busy--;
+
+	if (usb_urb->status < 0 || usb_urb->actual_length != (int)urb->len) {
+		warnx("usb bulk transfer failed: %d", usb_urb->status);
+		usb->error = usb_urb->status < 0 ? usb_urb->status : -EIO;
+	}
+
+	return 0;
+}
+
+static int fastboot_urb_completion(int fd, void *data)
+{
+	struct fastboot_usb *usb = data;
+	int ret;
+
+	do {
+		ret = fastboot_urb_reap(usb, false);
+	} while (!ret);
+
+	if (ret != -EAGAIN) {
+		warnx("failed to reap usb bulk transfer: %s", strerror(-ret));
+		fastboot_urb_discard(usb, ret);
+	}
+
+	if (usb->finishing && !usb->urbs_busy) {
+		usb->finishing = false;
+		fastboot_urb_unwatch(usb);
+
+		fastboot_transport_drained(usb->fb, usb->error);
+	} else if (ret != -EAGAIN) {
+		fastboot_urb_unwatch(usb);
+	}
+
+	if (usb->urbs_busy < FASTBOOT_URB_COUNT || usb->error)
+		fastboot_transport_writable(usb->fb);
+
+	/* Responses are only read asynchronously between downloads */
+	if (usb->response_done) {
+		usb->response_done = false;
+		if (!usb->urbs_busy)
+			fastboot_urb_unwatch(usb);
+
+		fastboot_transport_response(usb->fb, usb->response->buf,
+					    usb->response_len);
+	}
+
+	return 0;
+}
+
+static int fastboot_usb_read_async(void *data)
+{
+	struct fastboot_usb *usb = data;
+	struct fastboot_urb *urb = usb->response;
+
+	if (usb->fd < 0)
+		return -ENXIO;
+
+	if (!urb) {
+		urb = calloc(1, sizeof(*urb));
+		if (urb)
+			urb->buf = malloc(64);
+		if (!urb || !urb->buf)
+			err(1, "failed to allocate usb response buffer");
+
+		urb->len = 64;
+		usb->response = urb;
+	}
+
+	memset(&urb->urb, 0, sizeof(urb->urb));
+	urb->urb.type = USBDEVFS_URB_TYPE_BULK;
+	urb->urb.endpoint = usb->ep_in;
+	urb->urb.buffer = urb->buf;
+	urb->urb.buffer_length = urb->len;
+	urb->urb.usercontext = urb;
+
+	if (ioctl(usb->fd, USBDEVFS_SUBMITURB, &urb->urb) < 0) {
+		warn("failed to submit usb bulk transfer");
+		return -errno;
+	}
+
+	urb->busy = true;
+	usb->response_done = false;
+	fastboot_urb_watch(usb);
+
+	return 0;
+}
+
+static struct fastboot_urb *fastboot_urb_get(struct fastboot_usb *usb)
+{
+	int ret;
+	int i;
+
+	for (;;) {
+		for (i = 0; i < FASTBOOT_URB_COUNT; i++) {
+			if (!usb->urbs[i]->busy)
+				return usb->urbs[i];
+		}
+
+		/* All transfers are in flight, wait for one to complete */
+		ret = fastboot_urb_reap(usb, true);
+		if (ret < 0) {
+			fastboot_urb_discard(usb, ret);
+			return NULL;
+		}
+	}
+}
+
+static int fastboot_usb_download_start(void *data)
+{
+	struct fastboot_usb *usb = data;
+	int i;
+
+	for (i = 0; i < FASTBOOT_URB_COUNT; i++) {
+		if (usb->urbs[i])
+			continue;
+
+		usb->urbs[i] = calloc(1, sizeof(*usb->urbs[i]));
+		if (usb->urbs[i])
+			usb->urbs[i]->buf = malloc(FASTBOOT_URB_SIZE);
+		if (!usb->urbs[i] || !usb->urbs[i]->buf)
+			err(1, "failed to allocate usb transfer buffers");
+	}
+
+	usb->fill = NULL;
+	usb->error = 0;
+	usb->finishing = false;
+
+	fastboot_urb_watch(usb);
+
+	return 0;
+}
+
+static bool fastboot_usb_download_ready(void *data, size_t len)
+{
+	struct fastboot_usb *usb = data;
+	size_t space = 0;
+	int i;
+
+	if (!usb->urbs_busy || usb->error)
+		return true;
+
+	for (i = 0; i < FASTBOOT_URB_COUNT; i++) {
+		if (usb->urbs[i]->busy)
+			continue;
+
+		space += FASTBOOT_URB_SIZE;
+		if (usb->urbs[i] == usb->fill)
+			space -= usb->fill->len;
+	}
+
+	return space >= len;
+}
+
+/*
+ * Data is gathered in FASTBOOT_URB_SIZE chunks which are submitted without
+ * waiting for their completion, partial chunks are held back until filled, or
+ * until the download is finished, as a short packet would terminate the data
+ * phase prematurely.
+ */
+static int fastboot_usb_download_write(void *data, const void *buf, size_t len)
+{
+	struct fastboot_usb *usb = data;
+	const char *p = buf;
+	size_t xfer;
+	int ret;
+
+	while (len > 0 && !usb->error) {
+		if (!usb->fill) {
+			usb->fill = fastboot_urb_get(usb);
+			if (!usb->fill)
+				break;
+
+			usb->fill->len = 0;
+		}
+
+		xfer = MIN(len, FASTBOOT_URB_SIZE - usb->fill->len);
+
+		memcpy((char *)usb->fill->buf + usb->fill->len, p, xfer);
+		usb->fill->len += xfer;
+
+		if (usb->fill->len == FASTBOOT_URB_SIZE) {
+			ret = fastboot_urb_submit(usb, usb->fill);
+			if (ret < 0)
+				break;
+
+			usb->fill = NULL;
+		}
+
+		p += xfer;
+		len -= xfer;
+	}
+
+	return usb->error;
+}
+
+static int fastboot_usb_download_finish(void *data, bool discard, bool wait)
+{
+	struct fastboot_usb *usb = data;
+	int ret;
+
+	if (usb->fill && usb->fill->len && !discard && !usb->error)
+		fastboot_urb_submit(usb, usb->fill);
+	usb->fill = NULL;
+
+	if (!wait && usb->urbs_busy) {
+		usb->finishing = true;
+		return -EINPROGRESS;
+	}
+
+	while (usb->urbs_busy) {
+		ret = fastboot_urb_reap(usb, true);
+		if (ret < 0)
+			fastboot_urb_discard(usb, ret);
+	}
+
+	fastboot_urb_unwatch(usb);
+
+	return usb->error;
+}
+
+const struct fastboot_transport fastboot_usb_transport = {
+	.open = fastboot_usb_open,
+	.read = fastboot_usb_read,
+	.write = fastboot_usb_write,
+	.read_async = fastboot_usb_read_async,
+	.download_start = fastboot_usb_download_start,
+	.download_ready = fastboot_usb_download_ready,
+	.download_write = fastboot_usb_download_write,
+	.download_finish = fastboot_usb_download_finish,
+};
@@ -4,36 +4,28 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
-#include <linux/usbdevice_fs.h>
-#include <linux/usb/ch9.h>
-
-#include <sys/ioctl.h>
-
-#include <dirent.h>
+#include <endian.h>
 #include <err.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <libudev.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <time.h>
 
-#include "cdba-server.h"
+#include "cdba.h"
 #include "fastboot.h"
-#include "watch.h"
+#include "sparse.h"
 
-#define MAX_USBFS_BULK_SIZE (16*1024)
-
-struct fastboot {
-	const char *serial;
+/* Input buffered while the device writes a piece of a split image */
+#define FASTBOOT_FLASH_BUFFER	(64 * 1024 * 1024)
 
-	int fd;
-	unsigned ep_in;
-	unsigned ep_out;
+struct fastboot_flash;
 
-	const char *dev_path;
+struct fastboot {
+	const struct fastboot_transport *transport;
+	void *transport_data;
 
 	void *data;
 
@@ -41,7 +33,26 @@ struct fastboot {
 
 	int state;
 
-	struct udev_monitor *mon;
+	/* state of an ongoing streamed download */
+	size_t download_size;
+	size_t download_left;
+	int download_error;
+	bool download_stalled;
+	bool download_finishing;
+	bool download_padding;
+	struct timespec download_start;
+
+	void (*download_done)(struct fastboot *, void *, int);
+	void *download_done_data;
+
+	/* completion of a command whose response is read asynchronously */
+	void (*command_done)(struct fastboot *, void *, int);
+	void *command_done_data;
+
+	/* queried once per connection, 0 until then */
+	size_t max_download_size;
+
+	struct fastboot_flash *flash;
 };
 
 enum {
@@ -50,360 +61,1382 @@ enum {
 	FASTBOOT_STATE_CLOSED,
 };
 
+/*
+ * Parse the NUL-terminated response @status of @n bytes.
+ *
+ * Return: -EAGAIN for INFO, which is followed by another response, otherwise
+ * the outcome of the command
+ */
+static int fastboot_response(struct fastboot *fb, const char *status, int n,
+			     char *buf, size_t len)
+{
+	if (n < 0)
+		return -ENXIO;
+
+	if (n < 4) {
+		warnx("malformed response from fastboot");
+		return -1;
+	}
+
+	if (strncmp(status, "INFO", 4) == 0) {
+		fb->ops->info(fb, status + 4, n - 4);
+		return -EAGAIN;
+	} else if (strncmp(status, "OKAY", 4) == 0) {
+		if (buf) {
+			strncpy(buf, status + 4, len);
+			buf[len - 1] = '\0';
+		}
+		return n - 4;
+	} else if (strncmp(status, "FAIL", 4) == 0) {
+		fprintf(stderr, "%s\n", status + 4);
+		return -ENXIO;
+	} else if (strncmp(status, "DATA", 4) == 0) {
+		return strtol(status + 4, NULL, 16);
+	}
+
+	return -EAGAIN;
+}
+
 static int fastboot_read(struct fastboot *fb, char *buf, size_t len)
 {
-	struct usbdevfs_bulktransfer bulk = {0};
 	char status[65];
+	int ret;
 	int n;
 
-	for (;;) {
-		bulk.ep = fb->ep_in;
-		bulk.len = 64;
-		bulk.data = status;
-		bulk.timeout = 1000;
+	do {
+		n = fb->transport->read(fb->transport_data, status, 64);
+		if (n >= 0)
+			status[n] = '\0';
 
-		n = ioctl(fb->fd, USBDEVFS_BULK, &bulk);
-		if (n < 0) {
-			warn("failed to receive usb bulk transfer");
-			return -ENXIO;
-		}
+		ret = fastboot_response(fb, status, n, buf, len);
+	} while (ret == -EAGAIN);
 
-		status[n] = '\0';
+	return ret;
+}
 
-		if (n < 4) {
-			warn("malformed response from fastboot");
-			return -1;
-		}
+static int fastboot_write(struct fastboot *fb, const void *data, size_t len)
+{
+	return fb->transport->write(fb->transport_data, data, len);
+}
 
-		if (strncmp(status, "INFO", 4) == 0) {
-			fb->ops->info(fb, status + 4, n - 4);
-		} else if (strncmp(status, "OKAY", 4) == 0) {
-			if (buf) {
-				strncpy(buf, status + 4, len);
-				buf[len - 1] = '\0';
-			}
-			return n - 4;
-		} else if (strncmp(status, "FAIL", 4) == 0) {
-			fprintf(stderr, "%s\n", status + 4);
-			return -ENXIO;
-		} else if (strncmp(status, "DATA", 4) == 0) {
-			return strtol(status + 4, NULL, 16);
-		}
-	}
+/*
+ * Issue @cmd without waiting for the response, @done is invoked with the
+ * outcome once it is received.
+ */
+static int fastboot_command_start(struct fastboot *fb, const char *cmd,
+				  void (*done)(struct fastboot *, void *, int),
+				  void *data)
+{
+	int ret;
+
+	ret = fastboot_write(fb, cmd, strlen(cmd));
+	if (ret < 0)
+		return -ENXIO;
+
+	ret = fb->transport->read_async(fb->transport_data);
+	if (ret < 0)
+		return ret;
+
+	fb->command_done = done;
+	fb->command_done_data = data;
 
 	return 0;
 }
 
-static int fastboot_write(struct fastboot *fb, const void *data, size_t len)
+/**
+ * fastboot_transport_response() - deliver an asynchronously read response
+ * @fb:		fastboot context
+ * @buf:	response packet
+ * @len:	length of @buf, or negative errno if the read failed
+ */
+void fastboot_transport_response(struct fastboot *fb, const void *buf, int len)
 {
-	struct usbdevfs_bulktransfer bulk = {0};
-	size_t count = 0;
-	char *buf = (char *)data;
-	int n;
+	void (*done)(struct fastboot *, void *, int) = fb->command_done;
+	char status[65];
+	int ret;
 
-	do {
-		bulk.ep = fb->ep_out;
-		bulk.len = MIN(len, MAX_USBFS_BULK_SIZE);
-		bulk.data = buf;
-		bulk.timeout = 1000;
-
-		n = ioctl(fb->fd, USBDEVFS_BULK, &bulk);
-		if (n < 0) {
-			warn("failed to send usb bulk transfer");
-			return -1;
-		}
+	if (!done)
+		return;
+
+	if (len < 0) {
+		ret = len;
+	} else {
+		len = MIN(len, 64);
+		memcpy(status, buf, len);
+		status[len] = '\0';
+
+		ret = fastboot_response(fb, status, len, NULL, 0);
+	}
+
+	if (ret == -EAGAIN) {
+		ret = fb->transport->read_async(fb->transport_data);
+		if (!ret)
+			return;
+	}
+
+	fb->command_done = NULL;
+	done(fb, fb->command_done_data, ret);
+}
+
+/**
+ * fastboot_transport_opened() - report that the device showed up
+ * @fb:		fastboot context
+ */
+void fastboot_transport_opened(struct fastboot *fb)
+{
+	fb->state = FASTBOOT_STATE_OPENED;
+	fb->max_download_size = 0;
+
+	if (fb->ops && fb->ops->opened)
+		fb->ops->opened(fb, fb->data);
+}
+
+/**
+ * fastboot_transport_writable() - report that transfers have completed
+ * @fb:		fastboot context
+ *
+ * Wakes up the writer of a streamed download if it was told to wait by
+ * fastboot_download_ready().
+ */
+static void fastboot_download_pad(struct fastboot *fb);
+
+void fastboot_transport_writable(struct fastboot *fb)
+{
+	if (!fb->download_stalled)
+		return;
+
+	fb->download_stalled = false;
+
+	if (fb->download_padding) {
+		fastboot_download_pad(fb);
+		return;
+	}
+
+	if (fb->ops && fb->ops->writable)
+		fb->ops->writable(fb, fb->data);
+}
+
+static int fastboot_download_complete(struct fastboot *fb)
+{
+	struct timespec now;
+	double elapsed;
+	int ret;
+
+	ret = fb->download_error;
+	if (!ret)
+		ret = fastboot_read(fb, NULL, 0);
+	if (ret < 0)
+		return ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (double)(now.tv_sec - fb->download_start.tv_sec) +
+		  (double)(now.tv_nsec - fb->download_start.tv_nsec) / 1e9;
+
+	warnx("downloaded %zu bytes in %.2fs (%.1f MB/s)", fb->download_size,
+	      elapsed, (double)fb->download_size / elapsed / 1e6);
+
+	return ret;
+}
+
+/**
+ * fastboot_transport_drained() - report completion of the last transfers
+ * @fb:		fastboot context
+ * @error:	status of the transfers
+ *
+ * Completes the download left in flight by fastboot_download_finish().
+ */
+void fastboot_transport_drained(struct fastboot *fb, int error)
+{
+	int ret;
+
+	if (!fb->download_finishing)
+		return;
+
+	fb->download_finishing = false;
+
+	if (error && !fb->download_error)
+		fb->download_error = error;
+
+	ret = fastboot_download_complete(fb);
+	fb->download_done(fb, fb->download_done_data, ret);
+}
+
+/**
+ * fastboot_transport_disconnect() - report that the device went away
+ * @fb:		fastboot context
+ *
+ * An ongoing download is failed and whoever is waiting for it notified.
+ */
+void fastboot_transport_disconnect(struct fastboot *fb)
+{
+	fb->download_error = -ENODEV;
+
+	if (fb->download_finishing) {
+		fb->download_finishing = false;
+		fb->download_done(fb, fb->download_done_data, -ENODEV);
+	}
+
+	fastboot_transport_writable(fb);
+
+	/* A response still being waited for won't arrive */
+	fastboot_transport_response(fb, NULL, -ENODEV);
+
+	if (fb->ops && fb->ops->disconnect)
+		fb->ops->disconnect(fb->data);
+
+	fb->state = FASTBOOT_STATE_CLOSED;
+}
+
+/**
+ * fastboot_open() - start monitoring a fastboot device
+ * @transport:	transport used to reach the device
+ * @address:	address of the device for @transport, e.g. the usb serial
+ * @ops:	callbacks for device arrival and removal and for the download
+ * @data:	context passed to @ops
+ *
+ * Return: fastboot context
+ */
+struct fastboot *fastboot_open(const struct fastboot_transport *transport,
+			       const char *address,
+			       struct fastboot_ops *ops, void *data)
+{
+	struct fastboot *fb;
+
+	fb = calloc(1, sizeof(struct fastboot));
+	if (!fb)
+		err(1, "failed to allocate fastboot structure");
+
+	fb->transport = transport;
+	fb->ops = ops;
+	fb->data = data;
+
+	fb->state = FASTBOOT_STATE_START;
+
+	fb->transport_data = transport->open(fb, address);
+
+	return fb;
+}
 
-		buf += n;
-		len -= n;
-		count += n;
-	} while (len > 0);
+bool fastboot_is_present(struct fastboot *fb)
+{
+	return fb->state == FASTBOOT_STATE_OPENED;
+}
 
-	return count;
+int fastboot_getvar(struct fastboot *fb, const char *var, char *buf, size_t len)
+{
+	char cmd[128];
+	int n;
+
+	n = snprintf(cmd, sizeof(cmd), "getvar:%s", var);
+	fastboot_write(fb, cmd, n);
+
+	return fastboot_read(fb, buf, len);
 }
 
-static int parse_usb_desc(int usbfd, unsigned *ep_in, unsigned *ep_out)
+/**
+ * fastboot_download_start() - issue download command for a streamed payload
+ * @fb:		fastboot context
+ * @len:	total number of bytes that will be provided by the caller
+ *
+ * The payload is then fed in arbitrarily sized pieces using
+ * fastboot_download_write() and the transfer is completed by
+ * fastboot_download_finish().
+ *
+ * Return: 0 on success, negative on failure
+ */
+int fastboot_download_start(struct fastboot *fb, size_t len)
 {
-	const struct usb_interface_descriptor *ifc;
-	const struct usb_endpoint_descriptor *ept;
-	const struct usb_device_descriptor *dev;
-	const struct usb_config_descriptor *cfg;
-	const struct usb_descriptor_header *hdr;
-	unsigned type;
-	unsigned out;
-	unsigned in;
-	unsigned k;
-	unsigned l;
+	char cmd[32];
 	ssize_t n;
-	char *ptr;
-	char *end;
-	char desc[1024];
+
+	if (len > UINT32_MAX) {
+		warnx("download of %zu bytes exceeds fastboot limits", len);
+		return -1;
+	}
+
+	n = sprintf(cmd, "download:%08x", (unsigned int)len);
+	fastboot_write(fb, cmd, n);
+
+	n = fastboot_read(fb, NULL, 0);
+	if (n < 0) {
+		fprintf(stderr, "remote rejected download request\n");
+		return -1;
+	}
+
+	fb->download_size = len;
+	fb->download_left = len;
+	fb->download_error = 0;
+	fb->download_stalled = false;
+	fb->download_finishing = false;
+	clock_gettime(CLOCK_MONOTONIC, &fb->download_start);
+
+	return fb->transport->download_start(fb->transport_data);
+}
+
+/**
+ * fastboot_download_ready() - check if payload can be written without blocking
+ * @fb:		fastboot context
+ * @len:	number of bytes the caller intends to write
+ *
+ * If this returns false the ops->writable callback will be invoked once
+ * transfers have completed and more data can be accepted.
+ *
+ * Return: true if fastboot_download_write() won't wait for transfers
+ */
+bool fastboot_download_ready(struct fastboot *fb, size_t len)
+{
+	if (fb->download_error)
+		return true;
+
+	if (fb->transport->download_ready(fb->transport_data, len))
+		return true;
+
+	fb->download_stalled = true;
+
+	return false;
+}
+
+/**
+ * fastboot_download_write() - provide the next piece of a streamed payload
+ * @fb:		fastboot context
+ * @data:	payload data
+ * @len:	length of @data
+ *
+ * Data is passed on to the transport, which sends it without waiting for the
+ * transfers to complete. Blocks only if all transfers are in flight, see
+ * fastboot_download_ready().
+ *
+ * Return: 0 on success, negative on failure
+ */
+int fastboot_download_write(struct fastboot *fb, const void *data, size_t len)
+{
 	int ret;
-	int id;
 
-	n = read(usbfd, desc, sizeof(desc));
-	if (n < 0)
-		return n;
+	if (len > fb->download_left) {
+		warnx("discarding %zu bytes beyond announced download size",
+		      len - fb->download_left);
+		len = fb->download_left;
+	}
 
-	ptr = desc;
-	end = ptr + n;
+	fb->download_left -= len;
 
-	dev = (void *)ptr;
-	ptr += dev->bLength;
-	if (ptr >= end || dev->bDescriptorType != USB_DT_DEVICE)
-		return -EINVAL;
+	if (!fb->download_error) {
+		ret = fb->transport->download_write(fb->transport_data, data, len);
+		if (ret < 0)
+			fb->download_error = ret;
+	}
 
-	cfg = (void *)ptr;
-	ptr += cfg->bLength;
-	if (ptr >= end || cfg->bDescriptorType != USB_DT_CONFIG)
-		return -EINVAL;
+	return fb->download_error;
+}
 
-	for (k = 0; k < cfg->bNumInterfaces; k++) {
-		if (ptr >= end)
-			return -EINVAL;
+/**
+ * fastboot_download_finish() - complete a streamed download
+ * @fb:		fastboot context
+ * @done:	completion callback, or NULL to wait for completion
+ * @data:	context for @done
+ *
+ * Return: if @done is NULL the status of the download, otherwise 0 and the
+ * status is passed to @done once the remaining transfers have completed
+ */
+int fastboot_download_finish(struct fastboot *fb,
+			     void (*done)(struct fastboot *, void *, int),
+			     void *data)
+{
+	int ret;
 
-		do {
-			ifc = (void *)ptr;
-			if (ifc->bLength < USB_DT_INTERFACE_SIZE)
-				return -EINVAL;
+	if (fb->download_left && !fb->download_error) {
+		warnx("download ended %zu bytes short of announced size",
+		      fb->download_left);
+		fb->download_error = -EINVAL;
+	}
 
-			ptr += ifc->bLength;
-		} while (ptr < end && ifc->bDescriptorType != USB_DT_INTERFACE);
+	ret = fb->transport->download_finish(fb->transport_data,
+					     fb->download_error, !done);
+	if (ret == -EINPROGRESS) {
+		fb->download_done = done;
+		fb->download_done_data = data;
+		fb->download_finishing = true;
+		return 0;
+	}
 
-		in = -1;
-		out = -1;
+	if (ret < 0 && !fb->download_error)
+		fb->download_error = ret;
 
-		for (l = 0; l < ifc->bNumEndpoints; l++) {
-			if (ptr >= end)
-				return -EINVAL;
+	ret = fastboot_download_complete(fb);
+	if (done) {
+		done(fb, data, ret);
+		return 0;
+	}
 
-			do {
-				ept = (void *)ptr;
-				if (ept->bLength < USB_DT_ENDPOINT_SIZE)
-					return -EINVAL;
+	return ret;
+}
 
-				ptr += ept->bLength;
-			} while (ptr < end && ept->bDescriptorType != USB_DT_ENDPOINT);
+/*
+ * The device only returns to the command phase once it has received the
+ * announced size, so a download that's given up on is padded out, as the
+ * transport accepts it, before it's finished.
+ */
+static void fastboot_download_pad(struct fastboot *fb)
+{
+	static const char zeroes[64 * 1024];
+	size_t len;
 
-			type = ept->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK;
-			if (type != USB_ENDPOINT_XFER_BULK)
-				continue;
+	while (fb->download_left && !fb->download_error) {
+		len = MIN(fb->download_left, sizeof(zeroes));
+		if (!fastboot_download_ready(fb, len))
+			return;
 
-			if (ept->bEndpointAddress & USB_DIR_IN)
-				in = ept->bEndpointAddress;
-			else
-				out = ept->bEndpointAddress;
+		fastboot_download_write(fb, zeroes, len);
+	}
 
-			if (ptr >= end)
-				break;
+	fb->download_padding = false;
+	fastboot_download_finish(fb, fb->download_done, fb->download_done_data);
+}
+
+/**
+ * fastboot_download_abort() - give up on a streamed download
+ * @fb:		fastboot context
+ * @done:	completion callback
+ * @data:	context for @done
+ *
+ * The remainder of the payload is padded with zeroes and @done is invoked
+ * once the device is ready for the next command, possibly before this returns.
+ */
+static void fastboot_download_abort(struct fastboot *fb,
+				    void (*done)(struct fastboot *, void *, int),
+				    void *data)
+{
+	fb->download_done = done;
+	fb->download_done_data = data;
+	fb->download_padding = true;
+
+	if (fb->download_left && !fb->download_error)
+		warnx("padding out %zu bytes of aborted download", fb->download_left);
+
+	fastboot_download_pad(fb);
+}
+
+int fastboot_download(struct fastboot *fb, const void *data, size_t len)
+{
+	int ret;
+
+	ret = fastboot_download_start(fb, len);
+	if (ret < 0)
+		return ret;
+
+	fastboot_download_write(fb, data, len);
+
+	return fastboot_download_finish(fb, NULL, NULL);
+}
+
+/**
+ * fastboot_max_download_size() - largest download accepted by the device
+ * @fb:		fastboot context
+ *
+ * The device is asked once per connection, devices that don't report it are
+ * assumed to accept anything the download command can express.
+ *
+ * Return: size in bytes
+ */
+size_t fastboot_max_download_size(struct fastboot *fb)
+{
+	char buf[64];
+	size_t size;
+	int ret;
+
+	if (fb->max_download_size)
+		return fb->max_download_size;
+
+	ret = fastboot_getvar(fb, "max-download-size", buf, sizeof(buf));
+	size = ret > 0 ? strtoull(buf, NULL, 0) : 0;
+	if (!size || size > UINT32_MAX)
+		size = UINT32_MAX;
+
+	fb->max_download_size = size;
+
+	return size;
+}
+
+enum {
+	FASTBOOT_FLASH_IDLE,
+	FASTBOOT_FLASH_DOWNLOADING,
+	FASTBOOT_FLASH_BUSY,
+	FASTBOOT_FLASH_DONE,
+};
+
+/*
+ * Sparse images larger than the device's max-download-size are split by chunk
+ * boundaries, raw chunks being split by blocks if needed. The chunks parsed
+ * from the input are gathered in @buf, and sent as a piece once it's full,
+ * preceded and followed by chunks skipping the rest of the partition.
+ */
+struct fastboot_resparse {
+	uint32_t total_blks;
+	uint16_t chunk_extra;
+	bool header_done;
+
+	/* header being parsed, and input to skip past */
+	char header[sizeof(struct sparse_header)];
+	size_t header_len;
+	size_t header_want;
+	size_t skip;
+
+	/* current input chunk, @data_left bytes of raw data remaining */
+	struct chunk_header chunk;
+	uint64_t data_left;
+	bool fill;
+
+	/* next block of the partition */
+	uint32_t block;
+
+	/* chunks of the current piece, starting at block @first */
+	char *buf;
+	size_t len;
+	size_t size;
+	uint32_t chunks;
+	uint32_t first;
+
+	/* room left in the raw chunk last added to @buf */
+	size_t raw_left;
+};
+
+/* Room a piece must have left for the next chunk to be added */
+#define FASTBOOT_RESPARSE_CHUNK_MIN \
+	(sizeof(struct chunk_header) + SPARSE_BLOCK_SIZE)
+
+/*
+ * Images larger than the device's max-download-size are split in pieces,
+ * each sent as a sparse image covering the whole partition, with the blocks
+ * outside the piece left alone. While the device is busy writing a piece,
+ * which is the BUSY state, the caller's input is buffered and downloaded as
+ * the next piece once the device is done.
+ */
+struct fastboot_flash {
+	char partition[64];
+	uint64_t size;
+	uint64_t received;
+	bool sparse;
+
+	/* offset of the current piece in the image, and its payload */
+	uint64_t offset;
+	size_t piece;
+	size_t piece_len;
+	size_t piece_left;
+	uint32_t piece_skip;
+
+	int state;
+	int error;
+
+	char *buf;
+	size_t buf_head;
+	size_t buf_len;
+	size_t buf_size;
+	bool stalled;
+
+	/* nesting of calls into the pipeline, completion is deferred until 0 */
+	unsigned int depth;
+
+	bool finishing;
+	void (*done)(struct fastboot *, void *, int);
+	void *done_data;
+
+	/* split by chunks, if the image is already sparse */
+	struct fastboot_resparse *resparse;
+};
+
+/* Sparse header and chunk headers surrounding the payload of a piece */
+#define FASTBOOT_FLASH_SPARSE_OVERHEAD \
+	(sizeof(struct sparse_header) + 3 * sizeof(struct chunk_header))
+
+static void fastboot_flash_chunk(struct chunk_header *chunk, uint16_t type,
+				 uint32_t blocks, uint32_t size)
+{
+	chunk->chunk_type = htole16(type);
+	chunk->reserved1 = 0;
+	chunk->chunk_sz = htole32(blocks);
+	chunk->total_sz = htole32(sizeof(*chunk) + size);
+}
 
-			hdr = (void *)ptr;
-			if (hdr->bDescriptorType == USB_DT_SS_ENDPOINT_COMP)
-				ptr += USB_DT_SS_EP_COMP_SIZE;
+/* Build the headers preceding the current piece, return the download size */
+static void fastboot_flash_header(struct sparse_header *header,
+				  uint32_t total, uint32_t chunks)
+{
+	header->magic = htole32(SPARSE_HEADER_MAGIC);
+	header->major_version = htole16(1);
+	header->minor_version = 0;
+	header->file_hdr_sz = htole16(sizeof(*header));
+	header->chunk_hdr_sz = htole16(sizeof(struct chunk_header));
+	header->blk_sz = htole32(SPARSE_BLOCK_SIZE);
+	header->total_blks = htole32(total);
+	header->total_chunks = htole32(chunks);
+	header->image_checksum = 0;
+}
+
+static size_t fastboot_flash_sparse_header(struct fastboot_flash *flash,
+					   void *buf, size_t *header_len)
+{
+	struct sparse_header *header = buf;
+	struct chunk_header *chunk = (struct chunk_header *)(header + 1);
+	uint32_t total = (flash->size + SPARSE_BLOCK_SIZE - 1) / SPARSE_BLOCK_SIZE;
+	uint32_t first = flash->offset / SPARSE_BLOCK_SIZE;
+	uint32_t blocks = (flash->piece_len + SPARSE_BLOCK_SIZE - 1) / SPARSE_BLOCK_SIZE;
+	uint32_t chunks = 1;
+
+	if (first) {
+		fastboot_flash_chunk(chunk++, CHUNK_TYPE_DONT_CARE, first, 0);
+		chunks++;
+	}
+
+	fastboot_flash_chunk(chunk++, CHUNK_TYPE_RAW, blocks,
+			     blocks * SPARSE_BLOCK_SIZE);
+
+	flash->piece_skip = total - first - blocks;
+	if (flash->piece_skip)
+		chunks++;
+
+	fastboot_flash_header(header, total, chunks);
+
+	*header_len = (char *)chunk - (char *)buf;
+
+	return sizeof(*header) + chunks * sizeof(*chunk) +
+	       (size_t)blocks * SPARSE_BLOCK_SIZE;
+}
+
+static int fastboot_flash_piece_start(struct fastboot *fb)
+{
+	struct fastboot_flash *flash = fb->flash;
+	char header[FASTBOOT_FLASH_SPARSE_OVERHEAD];
+	size_t header_len = 0;
+	size_t len;
+	int ret;
+
+	flash->piece_len = MIN(flash->piece, flash->size - flash->offset);
+	flash->piece_left = flash->piece_len;
+
+	if (!flash->sparse)
+		len = flash->piece_len;
+	else
+		len = fastboot_flash_sparse_header(flash, header, &header_len);
+
+	ret = fastboot_download_start(fb, len);
+	if (ret < 0)
+		return ret;
+
+	flash->state = FASTBOOT_FLASH_DOWNLOADING;
+
+	if (flash->sparse)
+		return fastboot_download_write(fb, header, header_len);
+
+	return 0;
+}
+
+static void fastboot_flash_enter(struct fastboot_flash *flash)
+{
+	flash->depth++;
+}
+
+static void fastboot_flash_leave(struct fastboot *fb);
+
+static void fastboot_flash_aborted(struct fastboot *fb, void *data, int ret)
+{
+	struct fastboot_flash *flash = data;
+
+	fastboot_flash_enter(flash);
+	flash->state = FASTBOOT_FLASH_IDLE;
+	fastboot_flash_leave(fb);
+}
+
+static void fastboot_flash_fail(struct fastboot *fb, int error)
+{
+	struct fastboot_flash *flash = fb->flash;
+
+	if (!flash->error)
+		flash->error = error;
+
+	flash->buf_head = 0;
+	flash->buf_len = 0;
+
+	/*
+	 * Bring the device out of the data phase of the piece before the
+	 * failure is reported, the flash completes once it's padded out
+	 */
+	if (flash->state == FASTBOOT_FLASH_DOWNLOADING) {
+		flash->state = FASTBOOT_FLASH_BUSY;
+		fastboot_download_abort(fb, fastboot_flash_aborted, flash);
+		return;
+	}
+
+	/* A piece being written by the device completes before the flash */
+	if (flash->state != FASTBOOT_FLASH_BUSY)
+		flash->state = FASTBOOT_FLASH_IDLE;
+}
+
+static void fastboot_flash_leave(struct fastboot *fb)
+{
+	struct fastboot_flash *flash = fb->flash;
+	bool wake = false;
+
+	if (--flash->depth)
+		return;
+
+	if (flash->stalled && (flash->error || flash->state != FASTBOOT_FLASH_BUSY ||
+			       flash->buf_len - flash->buf_head < flash->buf_size)) {
+		flash->stalled = false;
+		wake = true;
+	}
+
+	if (flash->finishing && flash->state != FASTBOOT_FLASH_BUSY) {
+		wake = flash->stalled || wake;
+		fb->flash = NULL;
+
+		if (!flash->error)
+			warnx("flashed %s", flash->partition);
+		flash->done(fb, flash->done_data, flash->error);
+
+		if (flash->resparse)
+			free(flash->resparse->buf);
+		free(flash->resparse);
+		free(flash->buf);
+		free(flash);
+	}
+
+	if (wake && fb->ops && fb->ops->writable)
+		fb->ops->writable(fb, fb->data);
+}
+
+static void fastboot_flash_written(struct fastboot *fb, void *data, int ret);
+
+static void fastboot_flash_downloaded(struct fastboot *fb, void *data, int ret)
+{
+	struct fastboot_flash *flash = data;
+	char cmd[80];
+
+	fastboot_flash_enter(flash);
+
+	/* Don't write the piece if the flash failed in the meantime */
+	if (ret >= 0 && !flash->error) {
+		snprintf(cmd, sizeof(cmd), "flash:%s", flash->partition);
+		ret = fastboot_command_start(fb, cmd, fastboot_flash_written, flash);
+	} else {
+		flash->state = FASTBOOT_FLASH_IDLE;
+	}
+
+	if (ret < 0) {
+		flash->state = FASTBOOT_FLASH_IDLE;
+		fastboot_flash_fail(fb, ret);
+	}
+
+	fastboot_flash_leave(fb);
+}
+
+static void fastboot_flash_buffer(struct fastboot_flash *flash,
+				  const char *p, size_t len)
+{
+	if (flash->buf_head) {
+		flash->buf_len -= flash->buf_head;
+		memmove(flash->buf, flash->buf + flash->buf_head, flash->buf_len);
+		flash->buf_head = 0;
+	}
+
+	if (flash->buf_len + len > flash->buf_size) {
+		flash->buf_size = flash->buf_len + len;
+		flash->buf = realloc(flash->buf, flash->buf_size);
+		if (!flash->buf)
+			err(1, "failed to allocate flash buffer");
+	}
+
+	memcpy(flash->buf + flash->buf_len, p, len);
+	flash->buf_len += len;
+}
+
+/* Pass payload on to the download of the current piece, or buffer it */
+static void fastboot_flash_feed(struct fastboot *fb, const char *p, size_t len)
+{
+	struct fastboot_flash *flash = fb->flash;
+	static const char zeroes[SPARSE_BLOCK_SIZE];
+	struct chunk_header chunk;
+	size_t pad;
+	size_t xfer;
+	int ret;
+
+	while (len && !flash->error) {
+		if (flash->state != FASTBOOT_FLASH_DOWNLOADING) {
+			fastboot_flash_buffer(flash, p, len);
+			return;
 		}
 
-		if (ifc->bInterfaceClass != 0xff)
-			continue;
+		xfer = MIN(len, flash->piece_left);
+		ret = fastboot_download_write(fb, p, xfer);
 
-		if (ifc->bInterfaceSubClass != 0x42)
-			continue;
+		flash->piece_left -= xfer;
+		p += xfer;
+		len -= xfer;
 
-		if (ifc->bInterfaceProtocol != 0x03)
-			continue;
+		/* Complete the raw chunk and skip the rest of the partition */
+		if (!ret && !flash->piece_left && flash->sparse) {
+			pad = -flash->piece_len & (SPARSE_BLOCK_SIZE - 1);
+			ret = fastboot_download_write(fb, zeroes, pad);
+
+			if (!ret && flash->piece_skip) {
+				fastboot_flash_chunk(&chunk, CHUNK_TYPE_DONT_CARE,
+						     flash->piece_skip, 0);
+				ret = fastboot_download_write(fb, &chunk, sizeof(chunk));
+			}
+		}
 
-		id = ifc->bInterfaceNumber;
-		ret = ioctl(usbfd, USBDEVFS_CLAIMINTERFACE, &id);
 		if (ret < 0) {
-			warn("failed to claim interface");
-			continue;
+			fastboot_flash_fail(fb, ret);
+			return;
 		}
 
-		*ep_in = in;
-		*ep_out = out;
+		if (!flash->piece_left) {
+			flash->state = FASTBOOT_FLASH_BUSY;
+			fastboot_download_finish(fb, fastboot_flash_downloaded, flash);
+		}
+	}
+}
 
-		return 0;
+/* Download the buffered input as the next piece */
+static void fastboot_flash_drain(struct fastboot *fb)
+{
+	struct fastboot_flash *flash = fb->flash;
+	size_t xfer;
+
+	while (flash->buf_head < flash->buf_len &&
+	       flash->state == FASTBOOT_FLASH_DOWNLOADING) {
+		xfer = MIN(flash->buf_len - flash->buf_head, flash->piece_left);
+
+		fastboot_flash_feed(fb, flash->buf + flash->buf_head, xfer);
+		if (flash->error)
+			return;
+
+		flash->buf_head += xfer;
 	}
 
-	return -ENOENT;
+	if (flash->buf_head == flash->buf_len) {
+		flash->buf_head = 0;
+		flash->buf_len = 0;
+	}
 }
 
-static int handle_fastboot_add(struct fastboot *fastboot, struct udev_device *dev)
+static int fastboot_flash_resparse_start(struct fastboot *fb)
 {
-	const char *dev_path;
-	const char *dev_node;
-	unsigned ep_out;
-	unsigned ep_in;
-	int usbfd;
+	struct fastboot_flash *flash = fb->flash;
+	struct fastboot_resparse *rs;
+
+	rs = calloc(1, sizeof(*rs));
+	if (!rs)
+		err(1, "failed to allocate sparse image context");
+
+	flash->resparse = rs;
+
+	rs->header_want = sizeof(struct sparse_header);
+	rs->size = flash->buf_size;
+	if (rs->size < FASTBOOT_RESPARSE_CHUNK_MIN) {
+		warnx("sparse image for %s can't be split for max-download-size",
+		      flash->partition);
+		return -EINVAL;
+	}
+
+	rs->buf = malloc(rs->size);
+	if (!rs->buf)
+		err(1, "failed to allocate sparse image buffer");
+
+	warnx("flashing sparse %s in pieces of up to %zu bytes",
+	      flash->partition, rs->size);
+
+	return 0;
+}
+
+/* Append a chunk header to the current piece */
+static void fastboot_flash_resparse_add(struct fastboot_resparse *rs,
+					uint16_t type, uint32_t blocks,
+					uint32_t size)
+{
+	struct chunk_header chunk;
+
+	fastboot_flash_chunk(&chunk, type, blocks, size);
+	memcpy(rs->buf + rs->len, &chunk, sizeof(chunk));
+
+	rs->len += sizeof(chunk);
+	rs->chunks++;
+	rs->block += blocks;
+}
+
+/* Send the chunks gathered so far as the next piece */
+static int fastboot_flash_resparse_piece(struct fastboot *fb)
+{
+	struct fastboot_flash *flash = fb->flash;
+	struct fastboot_resparse *rs = flash->resparse;
+	uint32_t skip = rs->total_blks - rs->block;
+	struct sparse_header header;
+	struct chunk_header chunk;
+	size_t len;
 	int ret;
 
-	dev_path = udev_device_get_devpath(dev);
-	dev_node = udev_device_get_devnode(dev);
+	len = sizeof(header) + rs->len;
+	if (rs->first)
+		len += sizeof(chunk);
+	if (skip)
+		len += sizeof(chunk);
 
-	usbfd = open(dev_node, O_RDWR);
-	if (usbfd < 0)
-		return usbfd;
+	fastboot_flash_header(&header, rs->total_blks,
+			      rs->chunks + !!rs->first + !!skip);
 
-	ret = parse_usb_desc(usbfd, &ep_in, &ep_out);
-	if (ret < 0) {
-		close(usbfd);
+	ret = fastboot_download_start(fb, len);
+	if (ret < 0)
 		return ret;
+
+	flash->state = FASTBOOT_FLASH_DOWNLOADING;
+
+	ret = fastboot_download_write(fb, &header, sizeof(header));
+	if (!ret && rs->first) {
+		fastboot_flash_chunk(&chunk, CHUNK_TYPE_DONT_CARE, rs->first, 0);
+		ret = fastboot_download_write(fb, &chunk, sizeof(chunk));
 	}
 
-	fastboot->ep_in = ep_in;
-	fastboot->ep_out = ep_out;
-	fastboot->fd = usbfd;
-	fastboot->dev_path = strdup(dev_path);
+	if (!ret)
+		ret = fastboot_download_write(fb, rs->buf, rs->len);
+
+	if (!ret && skip) {
+		fastboot_flash_chunk(&chunk, CHUNK_TYPE_DONT_CARE, skip, 0);
+		ret = fastboot_download_write(fb, &chunk, sizeof(chunk));
+	}
+
+	if (ret < 0)
+		return ret;
 
-	fastboot->state = FASTBOOT_STATE_OPENED;
+	rs->len = 0;
+	rs->chunks = 0;
+	rs->first = rs->block;
 
-	if (fastboot->ops && fastboot->ops->opened)
-		fastboot->ops->opened(fastboot, fastboot->data);
+	flash->state = FASTBOOT_FLASH_BUSY;
+	fastboot_download_finish(fb, fastboot_flash_downloaded, flash);
 
 	return 0;
 }
 
-static int handle_udev_event(int fd, void *data)
+/* Act on the file header, a chunk header or the value of a fill chunk */
+static int fastboot_flash_resparse_header(struct fastboot_flash *flash)
 {
-	struct fastboot *fastboot = data;
-	struct udev_device* dev;
-	const char *dev_path;
-	const char *action;
-	const char *serial;
+	struct fastboot_resparse *rs = flash->resparse;
+	struct sparse_header *header = (struct sparse_header *)rs->header;
+	struct chunk_header *chunk = &rs->chunk;
+	uint32_t payload;
+	uint32_t blocks;
+
+	if (!rs->header_done) {
+		if (le16toh(header->file_hdr_sz) < sizeof(*header) ||
+		    le16toh(header->chunk_hdr_sz) < sizeof(*chunk) ||
+		    le32toh(header->blk_sz) != SPARSE_BLOCK_SIZE)
+			return -EINVAL;
 
-	dev = udev_monitor_receive_device(fastboot->mon);
+		rs->total_blks = le32toh(header->total_blks);
+		rs->chunk_extra = le16toh(header->chunk_hdr_sz) - sizeof(*chunk);
+		rs->skip = le16toh(header->file_hdr_sz) - sizeof(*header);
+		rs->header_done = true;
+		rs->header_want = sizeof(*chunk);
+		rs->first = 0;
+		return 0;
+	}
 
-	action = udev_device_get_action(dev);
-	dev_path = udev_device_get_devpath(dev);
+	if (rs->fill) {
+		fastboot_flash_resparse_add(rs, CHUNK_TYPE_FILL,
+					    le32toh(chunk->chunk_sz), sizeof(uint32_t));
+		memcpy(rs->buf + rs->len, rs->header, sizeof(uint32_t));
+		rs->len += sizeof(uint32_t);
 
-	if (!action || !dev_path)
-		goto unref_dev;
+		rs->fill = false;
+		rs->header_want = sizeof(*chunk);
+		return 0;
+	}
 
-	if (!strcmp(action, "add")) {
-		serial = udev_device_get_sysattr_value(dev, "serial");
-		if (!serial || strcmp(serial, fastboot->serial))
-			goto unref_dev;
+	memcpy(chunk, rs->header, sizeof(*chunk));
+	blocks = le32toh(chunk->chunk_sz);
+	payload = le32toh(chunk->total_sz) - sizeof(*chunk) - rs->chunk_extra;
 
-		handle_fastboot_add(fastboot, dev);
-	} else if (!strcmp(action, "remove")) {
-		if (!fastboot->dev_path || strcmp(dev_path, fastboot->dev_path))
-			goto unref_dev;
+	if (le32toh(chunk->total_sz) < sizeof(*chunk) + rs->chunk_extra ||
+	    blocks > rs->total_blks - rs->block)
+		return -EINVAL;
 
-		close(fastboot->fd);
-		fastboot->fd = -1;
-		fastboot->dev_path = NULL;
+	rs->skip = rs->chunk_extra;
 
-		if (fastboot->ops && fastboot->ops->disconnect)
-			fastboot->ops->disconnect(fastboot->data);
+	switch (le16toh(chunk->chunk_type)) {
+	case CHUNK_TYPE_RAW:
+		if (payload != (uint64_t)blocks * SPARSE_BLOCK_SIZE)
+			return -EINVAL;
+		rs->data_left = payload;
+		break;
+	case CHUNK_TYPE_FILL:
+		if (payload != sizeof(uint32_t))
+			return -EINVAL;
+		rs->fill = true;
+		rs->header_want = sizeof(uint32_t);
+		break;
+	case CHUNK_TYPE_DONT_CARE:
+		fastboot_flash_resparse_add(rs, CHUNK_TYPE_DONT_CARE, blocks, 0);
+		rs->skip += payload;
+		break;
+	case CHUNK_TYPE_CRC32:
+		/* checksums of the whole image don't hold for the pieces */
+		rs->skip += payload;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Parse sparse input into pieces, return the number of bytes consumed */
+static size_t fastboot_flash_resparse(struct fastboot *fb, const char *p, size_t len)
+{
+	struct fastboot_flash *flash = fb->flash;
+	struct fastboot_resparse *rs = flash->resparse;
+	const char *start = p;
+	uint32_t blocks;
+	size_t xfer;
+	int ret;
+
+	while (len && !flash->error) {
+		if (rs->skip) {
+			xfer = MIN(len, rs->skip);
+			rs->skip -= xfer;
+			p += xfer;
+			len -= xfer;
+			continue;
+		}
+
+		/* Send the piece once full, input waits while the device is busy */
+		if (!rs->raw_left && rs->size - rs->len < FASTBOOT_RESPARSE_CHUNK_MIN) {
+			if (flash->state != FASTBOOT_FLASH_IDLE)
+				break;
 
-		fastboot->state = FASTBOOT_STATE_CLOSED;
+			ret = fastboot_flash_resparse_piece(fb);
+			if (ret < 0)
+				fastboot_flash_fail(fb, ret);
+			continue;
+		}
+
+		if (rs->raw_left) {
+			xfer = MIN(len, rs->raw_left);
+			memcpy(rs->buf + rs->len, p, xfer);
+			rs->len += xfer;
+			rs->raw_left -= xfer;
+			rs->data_left -= xfer;
+			p += xfer;
+			len -= xfer;
+			continue;
+		}
+
+		/* Raw data is split by blocks, if it doesn't fit the piece */
+		if (rs->data_left) {
+			blocks = MIN(rs->data_left, rs->size - rs->len - sizeof(struct chunk_header)) /
+				 SPARSE_BLOCK_SIZE;
+			fastboot_flash_resparse_add(rs, CHUNK_TYPE_RAW, blocks,
+						    blocks * SPARSE_BLOCK_SIZE);
+			rs->raw_left = (size_t)blocks * SPARSE_BLOCK_SIZE;
+			continue;
+		}
+
+		xfer = MIN(len, rs->header_want - rs->header_len);
+		memcpy(rs->header + rs->header_len, p, xfer);
+		rs->header_len += xfer;
+		p += xfer;
+		len -= xfer;
+
+		if (rs->header_len == rs->header_want) {
+			rs->header_len = 0;
+
+			if (fastboot_flash_resparse_header(flash) < 0) {
+				warnx("invalid sparse image for %s", flash->partition);
+				fastboot_flash_fail(fb, -EINVAL);
+			}
+		}
 	}
 
-unref_dev:
-	udev_device_unref(dev);
+	return p - start;
+}
 
-	return 0;
+/* Parse the buffered input, the last piece is sent once all of it is parsed */
+static void fastboot_flash_resparse_run(struct fastboot *fb)
+{
+	struct fastboot_flash *flash = fb->flash;
+	struct fastboot_resparse *rs = flash->resparse;
+	int ret;
+
+	flash->buf_head += fastboot_flash_resparse(fb, flash->buf + flash->buf_head,
+						   flash->buf_len - flash->buf_head);
+	if (flash->error)
+		return;
+
+	if (flash->buf_head < flash->buf_len)
+		return;
+
+	flash->buf_head = 0;
+	flash->buf_len = 0;
+
+	if (flash->received < flash->size || flash->state != FASTBOOT_FLASH_IDLE)
+		return;
+
+	if (!rs->header_done || rs->header_len || rs->skip || rs->data_left ||
+	    rs->fill) {
+		warnx("sparse image for %s is truncated", flash->partition);
+		fastboot_flash_fail(fb, -EINVAL);
+		return;
+	}
+
+	if (!rs->len) {
+		flash->state = FASTBOOT_FLASH_DONE;
+		return;
+	}
+
+	ret = fastboot_flash_resparse_piece(fb);
+	if (ret < 0)
+		fastboot_flash_fail(fb, ret);
 }
 
-struct fastboot *fastboot_open(const char *serial, struct fastboot_ops *ops, void *data)
+static void fastboot_flash_written(struct fastboot *fb, void *data, int ret)
 {
-	struct fastboot *fb;
-	struct udev* udev;
-	int fd;
-	struct udev_enumerate* udev_enum;
-	struct udev_list_entry* first, *item;
+	struct fastboot_flash *flash = data;
+
+	fastboot_flash_enter(flash);
+
+	flash->state = FASTBOOT_FLASH_IDLE;
+	if (flash->error) {
+		/* failed while the device was writing the piece */
+	} else if (ret >= 0 && flash->resparse) {
+		fastboot_flash_resparse_run(fb);
+	} else if (ret >= 0) {
+		flash->offset += flash->piece_len;
+		if (flash->offset == flash->size) {
+			flash->state = FASTBOOT_FLASH_DONE;
+		} else {
+			ret = fastboot_flash_piece_start(fb);
+			if (ret >= 0)
+				fastboot_flash_drain(fb);
+		}
+	}
 
-	udev = udev_new();
-	if (!udev)
-		err(1, "udev_new() failed");
+	if (ret < 0)
+		fastboot_flash_fail(fb, ret);
 
-	fb = calloc(1, sizeof(struct fastboot));
-	if (!fb)
-		err(1, "failed to allocate fastboot structure");
+	fastboot_flash_leave(fb);
+}
 
-	fb->serial = serial;
-	fb->ops = ops;
-	fb->data = data;
+/**
+ * fastboot_flash_start() - start flashing a streamed image to a partition
+ * @fb:		fastboot context
+ * @partition:	name of the partition
+ * @size:	size of the image
+ *
+ * The image is then fed in arbitrarily sized pieces using
+ * fastboot_flash_write() and the flash is completed by fastboot_flash_finish().
+ * Images exceeding the device's max-download-size are split and flashed as
+ * sparse images, the next piece being received while the device is writing
+ * the previous one.
+ *
+ * Return: 0 on success, negative on failure
+ */
+int fastboot_flash_start(struct fastboot *fb, const char *partition, uint64_t size)
+{
+	struct fastboot_flash *flash;
+	size_t max;
+	int ret;
 
-	fb->state = FASTBOOT_STATE_START;
+	if (fb->flash) {
+		warnx("flashing of %s still in progress", fb->flash->partition);
+		return -EBUSY;
+	}
+
+	if (!size || strlen(partition) >= sizeof(flash->partition)) {
+		warnx("invalid flash request for \"%s\"", partition);
+		return -EINVAL;
+	}
+
+	max = fastboot_max_download_size(fb);
+
+	flash = calloc(1, sizeof(*flash));
+	if (!flash)
+		err(1, "failed to allocate flash context");
 
-	fb->mon = udev_monitor_new_from_netlink(udev, "udev");
-	udev_monitor_filter_add_match_subsystem_devtype(fb->mon, "usb", NULL);
-	udev_monitor_enable_receiving(fb->mon);
+	strcpy(flash->partition, partition);
+	flash->size = size;
 
-	fd = udev_monitor_get_fd(fb->mon);
+	if (size <= max) {
+		flash->piece = size;
+	} else {
+		if (max < FASTBOOT_FLASH_SPARSE_OVERHEAD + SPARSE_BLOCK_SIZE ||
+		    size / SPARSE_BLOCK_SIZE >= UINT32_MAX) {
+			warnx("%s image of %llu bytes can't be split for max-download-size of %zu",
+			      partition, (unsigned long long)size, max);
+			free(flash);
+			return -EINVAL;
+		}
 
-	watch_add_readfd(fd, handle_udev_event, fb);
+		flash->sparse = true;
+		flash->piece = (max - FASTBOOT_FLASH_SPARSE_OVERHEAD) & ~(SPARSE_BLOCK_SIZE - 1);
+		flash->buf_size = MIN(flash->piece, FASTBOOT_FLASH_BUFFER);
+		flash->buf = malloc(flash->buf_size);
+		if (!flash->buf)
+			err(1, "failed to allocate flash buffer");
+	}
 
-	udev_enum = udev_enumerate_new(udev);
-	udev_enumerate_add_match_subsystem(udev_enum, "usb");
-	udev_enumerate_add_match_sysattr(udev_enum, "serial", serial);
-	udev_enumerate_scan_devices(udev_enum);
+	fb->flash = flash;
 
-	first = udev_enumerate_get_list_entry(udev_enum);
-	udev_list_entry_foreach(item, first) {
-		const char *path;
-		struct udev_device *dev;
+	/* How to split the image is decided as its first data shows up */
+	if (flash->sparse)
+		return 0;
 
-		path = udev_list_entry_get_name(item);
-		dev = udev_device_new_from_syspath(udev, path);
-		handle_fastboot_add(fb, dev);
+	ret = fastboot_flash_piece_start(fb);
+	if (ret < 0) {
+		fb->flash = NULL;
+		free(flash->buf);
+		free(flash);
 	}
 
-	udev_enumerate_unref(udev_enum);
+	return ret;
+}
 
-	return fb;
+/* Split images that are already sparse by chunks, others by blocks */
+static int fastboot_flash_split_start(struct fastboot *fb, const void *data,
+				      size_t len)
+{
+	struct fastboot_flash *flash = fb->flash;
+	uint32_t magic = 0;
+
+	if (len >= sizeof(magic))
+		memcpy(&magic, data, sizeof(magic));
+
+	if (le32toh(magic) == SPARSE_HEADER_MAGIC)
+		return fastboot_flash_resparse_start(fb);
+
+	warnx("flashing %s in %llu pieces of up to %zu bytes", flash->partition,
+	      (unsigned long long)((flash->size + flash->piece - 1) / flash->piece),
+	      flash->piece);
+
+	return fastboot_flash_piece_start(fb);
 }
 
-int fastboot_getvar(struct fastboot *fb, const char *var, char *buf, size_t len)
+/**
+ * fastboot_flash_ready() - check if image data can be written without blocking
+ * @fb:		fastboot context
+ * @len:	number of bytes the caller intends to write
+ *
+ * If this returns false the ops->writable callback will be invoked once more
+ * data can be accepted.
+ *
+ * Return: true if fastboot_flash_write() won't wait for the device
+ */
+bool fastboot_flash_ready(struct fastboot *fb, size_t len)
 {
-	char cmd[128];
-	int n;
+	struct fastboot_flash *flash = fb->flash;
 
-	n = snprintf(cmd, sizeof(cmd), "getvar:%s", var);
-	fastboot_write(fb, cmd, n);
+	if (!flash || flash->error)
+		return true;
 
-	return fastboot_read(fb, buf, len);
+	if (flash->state == FASTBOOT_FLASH_DOWNLOADING)
+		return fastboot_download_ready(fb, MIN(len, flash->piece_left));
+
+	if (flash->buf_len == flash->buf_head ||
+	    flash->buf_len - flash->buf_head + len <= flash->buf_size)
+		return true;
+
+	flash->stalled = true;
+
+	return false;
 }
 
-int fastboot_download(struct fastboot *fb, const void *data, size_t len)
+/**
+ * fastboot_flash_idle() - check if a new flash can be started
+ * @fb:		fastboot context
+ *
+ * Return: true if no flash is in progress, otherwise the ops->writable
+ * callback is invoked once the ongoing flash has completed
+ */
+bool fastboot_flash_idle(struct fastboot *fb)
 {
-	size_t xfer;
-	ssize_t n;
-	size_t offset = 0;
-	void *buf;
-	char cmd[32];
-	int ret = 0;
+	if (!fb->flash)
+		return true;
 
-	buf = malloc(MAX_USBFS_BULK_SIZE);
-	if (!buf)
-		err(1, "failed to allocate usb scratch buffer");
+	fb->flash->stalled = true;
 
-	n = sprintf(cmd, "download:%08x", (unsigned int)len);
-	fastboot_write(fb, cmd, n);
+	return false;
+}
 
-	n = fastboot_read(fb, buf, MAX_USBFS_BULK_SIZE);
-	if (n < 0) {
-		fprintf(stderr, "remote rejected download request\n");
-		return -1;
+/**
+ * fastboot_flash_write() - provide the next piece of the image being flashed
+ * @fb:		fastboot context
+ * @data:	image data
+ * @len:	length of @data
+ *
+ * Return: 0 on success, negative once flashing has failed
+ */
+int fastboot_flash_write(struct fastboot *fb, const void *data, size_t len)
+{
+	struct fastboot_flash *flash = fb->flash;
+	int ret;
+
+	if (len > flash->size - flash->received) {
+		warnx("discarding %llu bytes beyond announced image size",
+		      (unsigned long long)(len - (flash->size - flash->received)));
+		len = flash->size - flash->received;
 	}
 
-	while (len > 0) {
-		xfer = MIN(len, MAX_USBFS_BULK_SIZE);
+	fastboot_flash_enter(flash);
 
-		ret = fastboot_write(fb, (const char *)data + offset, xfer);
+	if (!flash->received && flash->sparse && len) {
+		ret = fastboot_flash_split_start(fb, data, len);
 		if (ret < 0)
-			goto out;
+			fastboot_flash_fail(fb, ret);
+	}
 
-		offset += xfer;
-		len -= xfer;
+	flash->received += len;
+
+	if (!flash->resparse) {
+		fastboot_flash_feed(fb, data, len);
+	} else if (!flash->error) {
+		fastboot_flash_buffer(flash, data, len);
+		fastboot_flash_resparse_run(fb);
 	}
 
-	ret = fastboot_read(fb, NULL, 0);
+	ret = flash->error;
+	fastboot_flash_leave(fb);
 
-out:
-	free(buf);
 	return ret;
 }
 
+/**
+ * fastboot_flash_finish() - complete flashing of a streamed image
+ * @fb:		fastboot context
+ * @done:	completion callback
+ * @data:	context for @done
+ *
+ * @done is invoked with the status of the flash once the last piece has been
+ * written by the device, possibly before this returns.
+ */
+void fastboot_flash_finish(struct fastboot *fb,
+			   void (*done)(struct fastboot *, void *, int),
+			   void *data)
+{
+	struct fastboot_flash *flash = fb->flash;
+
+	fastboot_flash_enter(flash);
+
+	flash->finishing = true;
+	flash->done = done;
+	flash->done_data = data;
+
+	if (flash->received < flash->size && !flash->error) {
+		warnx("image for %s ended %llu bytes short of announced size",
+		      flash->partition,
+		      (unsigned long long)(flash->size - flash->received));
+		fastboot_flash_fail(fb, -EINVAL);
+	}
+
+	fastboot_flash_leave(fb);
+}
+
 int fastboot_boot(struct fastboot *fb)
 {
 	char buf[80];
@@ -1,17 +1,84 @@
 #ifndef __FASTBOOT_H__
 #define __FASTBOOT_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 struct fastboot;
 
 struct fastboot_ops {
 	void (*opened)(struct fastboot *, void *);
 	void (*disconnect)(void *);
 	void (*info)(struct fastboot *, const void *, size_t);
+	void (*writable)(struct fastboot *, void *);
+};
+
+/**
+ * struct fastboot_transport - link to a fastboot device
+ * @open:		start looking for the device at @address, return the
+ *			transport's context; fastboot_transport_opened() and
+ *			fastboot_transport_disconnect() are called as the
+ *			device comes and goes
+ * @read:		receive a response packet of up to @len bytes, blocking
+ * @write:		send a command, blocking
+ * @read_async:		receive a response packet without blocking, it is
+ *			passed to fastboot_transport_response() once it arrives
+ * @download_start:	prepare for the data phase of a download
+ * @download_ready:	check if @len bytes of payload can be written without
+ *			blocking, otherwise fastboot_transport_writable() is
+ *			called once they can
+ * @download_write:	queue payload, blocking only if no buffer is available
+ * @download_finish:	send the remaining payload, or drop it if @discard;
+ *			unless @wait, return -EINPROGRESS if transfers are still
+ *			in flight and call fastboot_transport_drained() as they
+ *			complete
+ *
+ * The payload operations return 0 on success, or the negative errno of the
+ * first failed transfer of the download.
+ */
+struct fastboot_transport {
+	void *(*open)(struct fastboot *fb, const char *address);
+	int (*read)(void *data, void *buf, size_t len);
+	int (*write)(void *data, const void *buf, size_t len);
+	int (*read_async)(void *data);
+
+	int (*download_start)(void *data);
+	bool (*download_ready)(void *data, size_t len);
+	int (*download_write)(void *data, const void *buf, size_t len);
+	int (*download_finish)(void *data, bool discard, bool wait);
 };
 
-struct fastboot *fastboot_open(const char *serial, struct fastboot_ops *ops, void *);
+extern const struct fastboot_transport fastboot_usb_transport;
+extern const struct fastboot_transport fastboot_tcp_transport;
+extern const struct fastboot_transport fastboot_emu_transport;
+
+void fastboot_transport_opened(struct fastboot *fb);
+void fastboot_transport_disconnect(struct fastboot *fb);
+void fastboot_transport_writable(struct fastboot *fb);
+void fastboot_transport_drained(struct fastboot *fb, int error);
+void fastboot_transport_response(struct fastboot *fb, const void *buf, int len);
+
+struct fastboot *fastboot_open(const struct fastboot_transport *transport,
+			       const char *address,
+			       struct fastboot_ops *ops, void *);
+bool fastboot_is_present(struct fastboot *fb);
 int fastboot_getvar(struct fastboot *fb, const char *var, char *buf, size_t len);
 int fastboot_download(struct fastboot *fb, const void *data, size_t len);
+int fastboot_download_start(struct fastboot *fb, size_t len);
+bool fastboot_download_ready(struct fastboot *fb, size_t len);
+int fastboot_download_write(struct fastboot *fb, const void *data, size_t len);
+int fastboot_download_finish(struct fastboot *fb,
+			     void (*done)(struct fastboot *, void *, int),
+			     void *data);
+size_t fastboot_max_download_size(struct fastboot *fb);
+int fastboot_flash_start(struct fastboot *fb, const char *partition, uint64_t size);
+bool fastboot_flash_ready(struct fastboot *fb, size_t len);
+bool fastboot_flash_idle(struct fastboot *fb);
+int fastboot_flash_write(struct fastboot *fb, const void *data, size_t len);
+void fastboot_flash_finish(struct fastboot *fb,
+			   void (*done)(struct fastboot *, void *, int),
+			   void *data);
 int fastboot_boot(struct fastboot *fb);
 int fastboot_erase(struct fastboot *fb, const char *partition);
 int fastboot_set_active(struct fastboot *fb, const char *active);
@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2024, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * On-disk cache of received boot images, keyed by their SHA-256 digest.
+ * Recently used entries have their mtime refreshed, the least recently used
+ * entries are evicted when the configured limits are exceeded.
+ */
+#define _GNU_SOURCE
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <yaml.h>
+
+#include "device_parser.h"
+#include "image_cache.h"
+#include "sha256.h"
+
+#define TOKEN_LENGTH	256
+
+#define DEFAULT_MAX_SIZE	(1024ULL * 1024 * 1024)
+#define DEFAULT_MAX_ENTRIES	16
+
+/* Temporary files of sessions that went away are removed after this long */
+#define STALE_TMP_AGE		60
+
+#define TMP_PREFIX		".tmp-"
+
+static struct {
+	char *path;
+	unsigned long long max_size;
+	unsigned int max_entries;
+} cache = {
+	.max_size = DEFAULT_MAX_SIZE,
+	.max_entries = DEFAULT_MAX_ENTRIES,
+};
+
+struct image_cache_writer {
+	int fd;
+	char tmp_path[PATH_MAX];
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	size_t size;
+	size_t written;
+	bool failed;
+
+	struct sha256_ctx sha;
+};
+
+void image_cache_parse(struct device_parser *dp)
+{
+	char value[TOKEN_LENGTH];
+	char key[TOKEN_LENGTH];
+
+	device_parser_expect(dp, YAML_MAPPING_START_EVENT, NULL, 0);
+
+	while (device_parser_accept(dp, YAML_SCALAR_EVENT, key, TOKEN_LENGTH)) {
+		if (!device_parser_accept(dp, YAML_SCALAR_EVENT, value, TOKEN_LENGTH))
+			errx(1, "%s: expected value for \"%s\"", __func__, key);
+
+		if (!strcmp(key, "path"))
+			cache.path = strdup(value);
+		else if (!strcmp(key, "max_size"))
+			cache.max_size = device_parser_size(value);
+		else if (!strcmp(key, "max_entries"))
+			cache.max_entries = strtoul(value, NULL, 0);
+		else
+			errx(1, "%s: unknown option \"%s\"", __func__, key);
+	}
+
+	device_parser_expect(dp, YAML_MAPPING_END_EVENT, NULL, 0);
+
+	if (!cache.path)
+		errx(1, "%s: image cache path not specified", __func__);
+}
+
+static void image_cache_entry_path(char *path, size_t len, const uint8_t *digest)
+{
+	size_t n;
+	int i;
+
+	n = snprintf(path, len, "%s/", cache.path);
+	for (i = 0; i < SHA256_DIGEST_SIZE && n < len; i++)
+		n += snprintf(path + n, len - n, "%02x", digest[i]);
+}
+
+/*
+ * Whoever can write to the cache controls what gets booted, so only trust
+ * files owned by the server's user and not writable by anyone else.
+ */
+static bool image_cache_trusted(const struct stat *sb, const char *path)
+{
+	if (sb->st_uid == geteuid() && !(sb->st_mode & (S_IWGRP | S_IWOTH)))
+		return true;
+
+	warnx("image cache: %s is not exclusively owned by the server, ignoring",
+	      path);
+
+	return false;
+}
+
+/* Create the cache directory, or check that an existing one is trusted */
+static bool image_cache_dir_ok(void)
+{
+	struct stat sb;
+
+	if (mkdir(cache.path, 0700) < 0 && errno != EEXIST) {
+		warn("image cache: failed to create %s", cache.path);
+		return false;
+	}
+
+	if (lstat(cache.path, &sb) < 0) {
+		warn("image cache: failed to stat %s", cache.path);
+		return false;
+	}
+
+	if (!S_ISDIR(sb.st_mode)) {
+		warnx("image cache: %s is not a directory", cache.path);
+		return false;
+	}
+
+	return image_cache_trusted(&sb, cache.path);
+}
+
+static bool image_cache_is_entry(const char *name)
+{
+	return strlen(name) == SHA256_DIGEST_SIZE * 2 &&
+	       strspn(name, "0123456789abcdef") == SHA256_DIGEST_SIZE * 2;
+}
+
+/**
+ * image_cache_lookup() - find image in the cache
+ * @digest:	SHA-256 digest of the image
+ * @size:	size of the image
+ *
+ * Return: read-only file descriptor of the cached image, or -1 if not found
+ */
+int image_cache_lookup(const uint8_t *digest, size_t size)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	int fd;
+
+	if (!cache.path || !size)
+		return -1;
+
+	if (!image_cache_dir_ok())
+		return -1;
+
+	image_cache_entry_path(path, sizeof(path), digest);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+	    sb.st_size != (off_t)size || !image_cache_trusted(&sb, path)) {
+		close(fd);
+		return -1;
+	}
+
+	/* Mark the entry as most recently used */
+	futimens(fd, NULL);
+
+	return fd;
+}
+
+struct image_cache_entry {
+	struct stat sb;
+	char name[SHA256_DIGEST_SIZE * 2 + 1];
+};
+
+static int image_cache_mtime_cmp(const void *a, const void *b)
+{
+	const struct timespec *ta = &((const struct image_cache_entry *)a)->sb.st_mtim;
+	const struct timespec *tb = &((const struct image_cache_entry *)b)->sb.st_mtim;
+
+	if (ta->tv_sec != tb->tv_sec)
+		return ta->tv_sec < tb->tv_sec ? -1 : 1;
+	if (ta->tv_nsec != tb->tv_nsec)
+		return ta->tv_nsec < tb->tv_nsec ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Writers hold a lock on their temporary file, remove those left behind by
+ * sessions that were killed while receiving an image.
+ */
+static void image_cache_sweep_tmp(int dfd, const char *name)
+{
+	struct stat sb;
+	int fd;
+
+	fd = openat(dfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return;
+
+	/* Leave files alone that were only just created and not yet locked */
+	if (fstat(fd, &sb) < 0 || sb.st_mtime + STALE_TMP_AGE > time(NULL))
+		goto out;
+
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+		goto out;
+
+	if (unlinkat(dfd, name, 0) < 0 && errno != ENOENT)
+		warn("image cache: failed to remove %s", name);
+
+out:
+	close(fd);
+}
+
+static void image_cache_evict(void)
+{
+	struct image_cache_entry *entries = NULL;
+	struct image_cache_entry *tmp;
+	unsigned long long total = 0;
+	char path[PATH_MAX];
+	struct dirent *de;
+	size_t count = 0;
+	size_t i;
+	DIR *dir;
+
+	dir = opendir(cache.path);
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (!strncmp(de->d_name, TMP_PREFIX, strlen(TMP_PREFIX))) {
+			image_cache_sweep_tmp(dirfd(dir), de->d_name);
+			continue;
+		}
+
+		if (!image_cache_is_entry(de->d_name))
+			continue;
+
+		tmp = realloc(entries, (count + 1) * sizeof(*entries));
+		if (!tmp)
+			break;
+		entries = tmp;
+
+		if (fstatat(dirfd(dir), de->d_name, &entries[count].sb, 0) < 0)
+			continue;
+
+		strcpy(entries[count].name, de->d_name);
+		total += entries[count].sb.st_size;
+		count++;
+	}
+
+	closedir(dir);
+
+	/* Oldest entries first */
+	qsort(entries, count, sizeof(*entries), image_cache_mtime_cmp);
+
+	for (i = 0; i < count; i++) {
+		if (total <= cache.max_size && count - i <= cache.max_entries)
+			break;
+
+		snprintf(path, sizeof(path), "%s/%s", cache.path, entries[i].name);
+		if (unlink(path) < 0 && errno != ENOENT) {
+			warn("image cache: failed to evict %s", path);
+			continue;
+		}
+
+		total -= entries[i].sb.st_size;
+	}
+
+	free(entries);
+}
+
+/**
+ * image_cache_store() - prepare for storing an image in the cache
+ * @digest:	SHA-256 digest the client claims for the image
+ * @size:	size of the image
+ *
+ * The image data is provided using image_cache_write() and is only entered
+ * into the cache by image_cache_commit() if it matches @digest.
+ *
+ * Return: writer object, or NULL if the image should not be cached
+ */
+struct image_cache_writer *image_cache_store(const uint8_t *digest, size_t size)
+{
+	struct image_cache_writer *writer;
+
+	if (!cache.path || !size || size > cache.max_size)
+		return NULL;
+
+	writer = calloc(1, sizeof(*writer));
+	if (!writer)
+		return NULL;
+
+	snprintf(writer->tmp_path, sizeof(writer->tmp_path),
+		 "%s/" TMP_PREFIX "XXXXXX", cache.path);
+
+	if (!image_cache_dir_ok()) {
+		free(writer);
+		return NULL;
+	}
+
+	writer->fd = mkostemp(writer->tmp_path, O_CLOEXEC);
+	if (writer->fd < 0) {
+		warn("image cache: failed to create %s", writer->tmp_path);
+		free(writer);
+		return NULL;
+	}
+
+	/* Held until committed or aborted, see image_cache_sweep_tmp() */
+	flock(writer->fd, LOCK_EX);
+
+	memcpy(writer->digest, digest, SHA256_DIGEST_SIZE);
+	writer->size = size;
+	sha256_init(&writer->sha);
+
+	return writer;
+}
+
+void image_cache_write(struct image_cache_writer *writer, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	if (writer->failed)
+		return;
+
+	sha256_update(&writer->sha, data, len);
+	writer->written += len;
+
+	while (len) {
+		n = write(writer->fd, p, len);
+		if (n < 0) {
+			warn("image cache: failed to write %s", writer->tmp_path);
+			writer->failed = true;
+			return;
+		}
+
+		p += n;
+		len -= n;
+	}
+}
+
+void image_cache_commit(struct image_cache_writer *writer)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	char path[PATH_MAX];
+
+	sha256_final(&writer->sha, digest);
+
+	if (writer->failed || writer->written != writer->size ||
+	    memcmp(digest, writer->digest, SHA256_DIGEST_SIZE)) {
+		warnx("image cache: received image does not match digest, not caching");
+		image_cache_abort(writer);
+		return;
+	}
+
+	image_cache_entry_path(path, sizeof(path), writer->digest);
+
+	fchmod(writer->fd, 0644);
+	close(writer->fd);
+
+	if (rename(writer->tmp_path, path) < 0) {
+		warn("image cache: failed to store %s", path);
+		unlink(writer->tmp_path);
+	}
+
+	free(writer);
+
+	image_cache_evict();
+}
+
+void image_cache_abort(struct image_cache_writer *writer)
+{
+	close(writer->fd);
+	unlink(writer->tmp_path);
+	free(writer);
+}
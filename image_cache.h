@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2024, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __IMAGE_CACHE_H__
+#define __IMAGE_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct device_parser;
+struct image_cache_writer;
+
+void image_cache_parse(struct device_parser *dp);
+
+int image_cache_lookup(const uint8_t *digest, size_t size);
+
+struct image_cache_writer *image_cache_store(const uint8_t *digest, size_t size);
+void image_cache_write(struct image_cache_writer *writer, const void *data, size_t len);
+void image_cache_commit(struct image_cache_writer *writer);
+void image_cache_abort(struct image_cache_writer *writer);
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2024, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * SHA-256 as specified in FIPS 180-4, used to identify boot images.
+ */
+#include <string.h>
+
+#include "sha256.h"
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_transform(struct sha256_ctx *ctx, const uint8_t *block)
+{
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t t1, t2;
+	uint32_t w[64];
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t)block[i * 4] << 24 |
+		       (uint32_t)block[i * 4 + 1] << 16 |
+		       (uint32_t)block[i * 4 + 2] << 8 |
+		       (uint32_t)block[i * 4 + 3];
+	}
+
+	for (i = 16; i < 64; i++) {
+		t1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		t2 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+	}
+
+	a = ctx->state[0];
+	b = ctx->state[1];
+	c = ctx->state[2];
+	d = ctx->state[3];
+	e = ctx->state[4];
+	f = ctx->state[5];
+	g = ctx->state[6];
+	h = ctx->state[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+		     ((e & f) ^ (~e & g)) + k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+	ctx->state[5] += f;
+	ctx->state[6] += g;
+	ctx->state[7] += h;
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->count = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t fill = ctx->count % sizeof(ctx->buf);
+	size_t n;
+
+	ctx->count += len;
+
+	if (fill) {
+		n = sizeof(ctx->buf) - fill;
+		if (len < n) {
+			memcpy(ctx->buf + fill, p, len);
+			return;
+		}
+
+		memcpy(ctx->buf + fill, p, n);
+		sha256_transform(ctx, ctx->buf);
+		p += n;
+		len -= n;
+	}
+
+	for (; len >= sizeof(ctx->buf); p += sizeof(ctx->buf), len -= sizeof(ctx->buf))
+		sha256_transform(ctx, p);
+
+	memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t *digest)
+{
+	uint64_t bits = ctx->count * 8;
+	size_t fill = ctx->count % sizeof(ctx->buf);
+	int i;
+
+	ctx->buf[fill++] = 0x80;
+	if (fill > 56) {
+		memset(ctx->buf + fill, 0, sizeof(ctx->buf) - fill);
+		sha256_transform(ctx, ctx->buf);
+		fill = 0;
+	}
+
+	memset(ctx->buf + fill, 0, 56 - fill);
+	for (i = 0; i < 8; i++)
+		ctx->buf[56 + i] = bits >> (56 - i * 8);
+	sha256_transform(ctx, ctx->buf);
+
+	for (i = 0; i < 8; i++) {
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+}
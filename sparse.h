@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2024, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Android sparse image format, as accepted by fastboot flash. All fields are
+ * little endian.
+ */
+#ifndef __SPARSE_H__
+#define __SPARSE_H__
+
+#include <stdint.h>
+
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+#define SPARSE_BLOCK_SIZE	4096
+
+#define CHUNK_TYPE_RAW		0xcac1
+#define CHUNK_TYPE_FILL		0xcac2
+#define CHUNK_TYPE_DONT_CARE	0xcac3
+#define CHUNK_TYPE_CRC32	0xcac4
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+} __attribute__((packed));
+
+/* @total_sz includes the header and the data following it */
+struct chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;
+	uint32_t total_sz;
+} __attribute__((packed));
+
+#endif
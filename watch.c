@@ -5,16 +5,18 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
-#include <sys/time.h>
+#include <sys/epoll.h>
 #include <alloca.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cdba.h"
@@ -23,99 +25,435 @@
 
 static bool quit_invoked;
 
+/*
+ * A single watch holds the read and write callbacks of a file descriptor, as
+ * epoll only allows one registration per file descriptor.
+ */
 struct watch {
 	struct list_head node;
 
 	int fd;
-	int (*cb)(int, void*);
-	void *data;
+	uint32_t events;
+
+	int (*read_cb)(int, void*);
+	void *read_data;
+	void **read_ctx;
+
+	int (*write_cb)(int, void*);
+	void *write_data;
+	void **write_ctx;
 };
 
-struct timer {
-	struct list_head node;
-	struct timeval tv;
+struct watch_timer {
+	struct timespec expires;
+	unsigned long seq;
+	size_t index;
 
 	void (*cb)(void *);
 	void *data;
+	void **ctx;
 };
 
-static struct list_head read_watches = LIST_INIT(read_watches);
-static struct list_head timer_watches = LIST_INIT(timer_watches);
+static void **watch_ctx;
 
-void watch_add_readfd(int fd, int (*cb)(int, void*), void *data)
+static struct list_head fd_watches = LIST_INIT(fd_watches);
+
+/* Watches indexed by fd, for lookup without walking fd_watches */
+static struct watch **fd_index;
+static size_t fd_index_size;
+
+/* Pending timers, as a binary min-heap ordered by expiry */
+static struct watch_timer **timers;
+static size_t timers_count;
+static size_t timers_size;
+
+/**
+ * watch_set_context() - set the context of subsequently added watches
+ * @ctx:	context
+ *
+ * Watches and timers capture the current context as they are added, and it
+ * is restored while their callbacks are invoked. The context refers to a slot
+ * holding a pointer, rather than the pointer itself, so that its value may
+ * change during the lifetime of the watches.
+ *
+ * Return: the previous context
+ */
+void **watch_set_context(void **ctx)
+{
+	void **old = watch_ctx;
+
+	watch_ctx = ctx;
+
+	return old;
+}
+
+/**
+ * watch_get_context() - get the context of the current callback
+ *
+ * Return: the slot of the current context, or NULL
+ */
+void **watch_get_context(void)
 {
+	return watch_ctx;
+}
+
+static int watch_epoll_fd(void)
+{
+	static int epoll_fd = -1;
+
+	if (epoll_fd < 0) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0)
+			err(1, "failed to create epoll instance");
+	}
+
+	return epoll_fd;
+}
+
+/*
+ * Closing an fd drops it from the epoll set, without its watch being removed.
+ * If the fd number has since been reused, the registration of the watch is
+ * gone and the callbacks left behind are stale.
+ */
+static bool watch_stale(struct watch *w)
+{
+	struct epoll_event ev = {
+		.events = w->events,
+		.data.ptr = w,
+	};
+
+	if (!w->events)
+		return false;
+
+	return epoll_ctl(watch_epoll_fd(), EPOLL_CTL_MOD, w->fd, &ev) < 0 &&
+	       errno == ENOENT;
+}
+
+static struct watch *watch_get(int fd, bool create)
+{
+	struct watch **new_index;
 	struct watch *w;
+	size_t size;
+
+	if (fd >= 0 && (size_t)fd < fd_index_size && fd_index[fd]) {
+		w = fd_index[fd];
+
+		/* Registered afresh, don't inherit the callbacks of a closed fd */
+		if (create && watch_stale(w)) {
+			w->read_cb = NULL;
+			w->write_cb = NULL;
+			w->events = 0;
+		}
+
+		return w;
+	}
+
+	if (!create)
+		return NULL;
+
+	if (fd < 0)
+		errx(1, "failed to watch invalid fd %d", fd);
+
+	if ((size_t)fd >= fd_index_size) {
+		size = fd_index_size ? fd_index_size : 64;
+		while (size <= (size_t)fd)
+			size *= 2;
+
+		new_index = realloc(fd_index, size * sizeof(*fd_index));
+		if (!new_index)
+			err(1, "failed to allocate watch index");
+
+		memset(new_index + fd_index_size, 0,
+		       (size - fd_index_size) * sizeof(*fd_index));
+		fd_index = new_index;
+		fd_index_size = size;
+	}
 
 	w = calloc(1, sizeof(*w));
+	if (!w)
+		err(1, "failed to allocate watch");
+
 	w->fd = fd;
-	w->cb = cb;
-	w->data = data;
+	list_add(&fd_watches, &w->node);
+	fd_index[fd] = w;
 
-	list_add(&read_watches, &w->node);
+	return w;
 }
 
-void watch_timer_add(int timeout_ms, void (*cb)(void *), void *data)
+/*
+ * Reflect the registered callbacks of @w in the epoll set. A new registration
+ * is passed to epoll even if the events are unchanged, as the fd might have
+ * been closed, dropping it from the epoll set, and its number reused.
+ */
+static void watch_update(struct watch *w, bool reregister)
 {
-	struct timeval tv_timeout;
-	struct timeval now;
-	struct timer *t;
+	struct epoll_event ev = {};
+	int ret;
 
-	t = calloc(1, sizeof(*t));
+	if (w->read_cb)
+		ev.events |= EPOLLIN;
+	if (w->write_cb)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = w;
+
+	if (ev.events == w->events && !reregister)
+		return;
+
+	if (!ev.events) {
+		ret = epoll_ctl(watch_epoll_fd(), EPOLL_CTL_DEL, w->fd, NULL);
+		/* The fd might already have been closed */
+		if (ret < 0 && errno != EBADF && errno != ENOENT)
+			warn("failed to remove watch for fd %d", w->fd);
+	} else if (!w->events) {
+		ret = epoll_ctl(watch_epoll_fd(), EPOLL_CTL_ADD, w->fd, &ev);
+		if (ret < 0 && errno == EEXIST)
+			ret = epoll_ctl(watch_epoll_fd(), EPOLL_CTL_MOD, w->fd, &ev);
+		if (ret < 0)
+			warn("failed to add watch for fd %d", w->fd);
+	} else {
+		ret = epoll_ctl(watch_epoll_fd(), EPOLL_CTL_MOD, w->fd, &ev);
+		/* Closing the fd drops it from the epoll set, so re-add it */
+		if (ret < 0 && errno == ENOENT)
+			ret = epoll_ctl(watch_epoll_fd(), EPOLL_CTL_ADD, w->fd, &ev);
+		if (ret < 0)
+			warn("failed to update watch for fd %d", w->fd);
+	}
+
+	w->events = ev.events;
+}
+
+/*
+ * Watches might be removed from within callbacks, while events referencing
+ * them are pending, so unused watches are only freed by watch_purge().
+ */
+static void watch_purge(void)
+{
+	struct watch *next;
+	struct watch *w;
 
-	gettimeofday(&now, NULL);
+	list_for_each_entry_safe(w, next, &fd_watches, node) {
+		if (!w->events) {
+			list_del(&w->node);
+			fd_index[w->fd] = NULL;
+			free(w);
+		}
+	}
+}
 
-	tv_timeout.tv_sec = timeout_ms / 1000;
-	tv_timeout.tv_usec = (timeout_ms % 1000) * 1000;
+void watch_add_readfd(int fd, int (*cb)(int, void*), void *data)
+{
+	struct watch *w = watch_get(fd, true);
 
-	t->cb = cb;
-	t->data = data;
-	timeradd(&now, &tv_timeout, &t->tv);
+	w->read_cb = cb;
+	w->read_data = data;
+	w->read_ctx = watch_ctx;
 
-	list_add(&timer_watches, &t->node);
+	watch_update(w, true);
 }
 
-static struct timeval *watch_timer_next(void)
+void watch_del_readfd(int fd)
 {
-	static struct timeval timeout;
-	struct timeval now;
-	struct timer *next;
-	struct timer *t;
+	struct watch *w = watch_get(fd, false);
 
-	if (list_empty(&timer_watches))
-		return NULL;
+	if (!w)
+		return;
 
-	next = list_entry_first(&timer_watches, struct timer, node);
+	w->read_cb = NULL;
+	watch_update(w, false);
+}
+
+void watch_add_writefd(int fd, int (*cb)(int, void*), void *data)
+{
+	struct watch *w = watch_get(fd, true);
 
-	list_for_each_entry(t, &timer_watches, node) {
-		if (timercmp(&t->tv, &next->tv, <))
-			next = t;
+	w->write_cb = cb;
+	w->write_data = data;
+	w->write_ctx = watch_ctx;
+
+	watch_update(w, true);
+}
+
+void watch_del_writefd(int fd)
+{
+	struct watch *w = watch_get(fd, false);
+
+	if (!w)
+		return;
+
+	w->write_cb = NULL;
+	watch_update(w, false);
+}
+
+/* Order by expiry, and timers expiring at the same time in order of addition */
+static bool watch_timer_before(struct watch_timer *a, struct watch_timer *b)
+{
+	if (a->expires.tv_sec != b->expires.tv_sec)
+		return a->expires.tv_sec < b->expires.tv_sec;
+	if (a->expires.tv_nsec != b->expires.tv_nsec)
+		return a->expires.tv_nsec < b->expires.tv_nsec;
+
+	return a->seq < b->seq;
+}
+
+static void watch_timer_set(size_t index, struct watch_timer *t)
+{
+	timers[index] = t;
+	t->index = index;
+}
+
+static void watch_timer_sift_up(size_t index)
+{
+	struct watch_timer *t = timers[index];
+	size_t parent;
+
+	while (index > 0) {
+		parent = (index - 1) / 2;
+		if (!watch_timer_before(t, timers[parent]))
+			break;
+
+		watch_timer_set(index, timers[parent]);
+		index = parent;
 	}
 
-	gettimeofday(&now, NULL);
-	timersub(&next->tv, &now, &timeout);
-	if (timeout.tv_sec < 0) {
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 0;
+	watch_timer_set(index, t);
+}
+
+static void watch_timer_sift_down(size_t index)
+{
+	struct watch_timer *t = timers[index];
+	size_t child;
+
+	for (;;) {
+		child = index * 2 + 1;
+		if (child >= timers_count)
+			break;
+
+		if (child + 1 < timers_count &&
+		    watch_timer_before(timers[child + 1], timers[child]))
+			child++;
+
+		if (!watch_timer_before(timers[child], t))
+			break;
+
+		watch_timer_set(index, timers[child]);
+		index = child;
 	}
 
-	return &timeout;
+	watch_timer_set(index, t);
+}
+
+static void watch_timer_remove(struct watch_timer *t)
+{
+	struct watch_timer *last = timers[--timers_count];
+
+	if (last == t)
+		return;
+
+	/* Move the last timer into the hole and restore the heap order */
+	watch_timer_set(t->index, last);
+	watch_timer_sift_up(last->index);
+	watch_timer_sift_down(last->index);
+}
+
+/**
+ * watch_timer_add() - schedule a callback
+ * @timeout_ms:	delay, in milliseconds, before invoking @cb
+ * @cb:		callback to invoke
+ * @data:	context for @cb
+ *
+ * Return: handle for watch_timer_cancel(), valid until @cb is invoked
+ */
+struct watch_timer *watch_timer_add(int timeout_ms, void (*cb)(void *), void *data)
+{
+	static unsigned long seq;
+	struct watch_timer **new_timers;
+	struct watch_timer *t;
+
+	if (timers_count == timers_size) {
+		timers_size = timers_size ? timers_size * 2 : 16;
+
+		new_timers = realloc(timers, timers_size * sizeof(*timers));
+		if (!new_timers)
+			err(1, "failed to allocate timers");
+
+		timers = new_timers;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		err(1, "failed to allocate timer");
+
+	clock_gettime(CLOCK_MONOTONIC, &t->expires);
+	t->expires.tv_sec += timeout_ms / 1000;
+	t->expires.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (t->expires.tv_nsec >= 1000000000L) {
+		t->expires.tv_sec++;
+		t->expires.tv_nsec -= 1000000000L;
+	}
+
+	t->seq = seq++;
+	t->cb = cb;
+	t->data = data;
+	t->ctx = watch_ctx;
+
+	watch_timer_set(timers_count++, t);
+	watch_timer_sift_up(t->index);
+
+	return t;
+}
+
+/**
+ * watch_timer_cancel() - cancel a pending timer
+ * @t:		timer handle, as returned from watch_timer_add(), or NULL
+ */
+void watch_timer_cancel(struct watch_timer *t)
+{
+	if (!t)
+		return;
+
+	watch_timer_remove(t);
+	free(t);
+}
+
+/* Return: milliseconds until the next timer expires, or -1 if none pending */
+static int watch_timer_next(void)
+{
+	struct timespec now;
+	struct watch_timer *t;
+	long long ms;
+
+	if (!timers_count)
+		return -1;
+
+	t = timers[0];
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* Round up, to not wake up right before the timer expires */
+	ms = (long long)(t->expires.tv_sec - now.tv_sec) * 1000 +
+	     (t->expires.tv_nsec - now.tv_nsec + 999999) / 1000000;
+
+	return ms < 0 ? 0 : (int)MIN(ms, INT32_MAX);
 }
 
 static void watch_timer_invoke(void)
 {
-	struct timeval now;
-	struct timer *tmp;
-	struct timer *t;
+	struct watch_timer expired = {};
+	struct watch_timer *t;
 
-	gettimeofday(&now, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &expired.expires);
+	expired.seq = ULONG_MAX;
 
-	list_for_each_entry_safe(t, tmp, &timer_watches, node) {
-		if (timercmp(&t->tv, &now, <)) {
-			t->cb(t->data);
+	/* Callbacks may add and cancel timers, so look at the heap every time */
+	while (timers_count && watch_timer_before(timers[0], &expired)) {
+		t = timers[0];
+		watch_timer_remove(t);
 
-			list_del(&t->node);
-			free(t);
-		}
+		watch_ctx = t->ctx;
+		t->cb(t->data);
+		watch_ctx = NULL;
+
+		free(t);
 	}
 }
 
@@ -124,44 +462,64 @@ void watch_quit(void)
 	quit_invoked = true;
 }
 
+static int watch_invoke(struct watch *w, uint32_t events)
+{
+	int ret;
+
+	/* Errors and hangups are reported to whichever callback is registered */
+	if (w->write_cb && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+		watch_ctx = w->write_ctx;
+		ret = w->write_cb(w->fd, w->write_data);
+		watch_ctx = NULL;
+		if (ret < 0)
+			return ret;
+	}
+
+	/* The write callback might have removed the read watch */
+	if (w->read_cb && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+		watch_ctx = w->read_ctx;
+		ret = w->read_cb(w->fd, w->read_data);
+		watch_ctx = NULL;
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+#define WATCH_MAX_EVENTS	32
+
 int watch_main_loop(bool (*quit_cb)(void))
 {
-	struct timeval *timeoutp;
-	struct watch *w;
-	fd_set rfds;
-	int nfds;
+	struct epoll_event events[WATCH_MAX_EVENTS];
+	int timeout;
 	int ret;
+	int n;
+	int i;
 
 	while (!quit_invoked) {
 		if (quit_cb && quit_cb())
 			break;
 
-		nfds = 0;
-
-		list_for_each_entry(w, &read_watches, node) {
-			nfds = MAX(nfds, w->fd);
-			FD_SET(w->fd, &rfds);
-		}
+		watch_purge();
 
-		timeoutp = watch_timer_next();
-		ret = select(nfds + 1, &rfds, NULL, NULL, timeoutp);
-		if (ret < 0 && errno == EINTR)
+		timeout = watch_timer_next();
+		n = epoll_wait(watch_epoll_fd(), events, WATCH_MAX_EVENTS, timeout);
+		if (n < 0 && errno == EINTR)
 			continue;
-		else if (ret < 0) {
+		else if (n < 0) {
 			int err = errno;
-			fprintf(stderr, "select returned %s\n", strerror(err));
+			fprintf(stderr, "epoll_wait returned %s\n", strerror(err));
 			return -err;
 		}
 
 		watch_timer_invoke();
 
-		list_for_each_entry(w, &read_watches, node) {
-			if (FD_ISSET(w->fd, &rfds)) {
-				ret = w->cb(w->fd, w->data);
-				if (ret < 0) {
-					fprintf(stderr, "cb returned %d\n", ret);
-					return ret;
-				}
+		for (i = 0; i < n; i++) {
+			ret = watch_invoke(events[i].data.ptr, events[i].events);
+			if (ret < 0) {
+				fprintf(stderr, "cb returned %d\n", ret);
+				return ret;
 			}
 		}
 	}
@@ -174,8 +532,8 @@ int watch_run(void)
 	struct watch *w;
 	bool found = false;
 
-	list_for_each_entry(w, &read_watches, node) {
-		if (w->fd == STDIN_FILENO)
+	list_for_each_entry(w, &fd_watches, node) {
+		if (w->fd == STDIN_FILENO && w->read_cb)
 			found = true;
 	}
 
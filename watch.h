@@ -1,10 +1,18 @@
 #ifndef __WATCH_H__
 #define __WATCH_H__
 
+struct watch_timer;
+
 void watch_add_readfd(int fd, int (*cb)(int, void*), void *data);
+void watch_del_readfd(int fd);
+void watch_add_writefd(int fd, int (*cb)(int, void*), void *data);
+void watch_del_writefd(int fd);
 int watch_add_quit(int (*cb)(int, void*), void *data);
-void watch_timer_add(int timeout_ms, void (*cb)(void *), void *data);
+struct watch_timer *watch_timer_add(int timeout_ms, void (*cb)(void *), void *data);
+void watch_timer_cancel(struct watch_timer *t);
 void watch_quit(void);
+void **watch_set_context(void **ctx);
+void **watch_get_context(void);
 int watch_main_loop(bool (*quit_cb)(void));
 int watch_run(void);
 